@@ -9,6 +9,8 @@ commands_recovery_local_path := $(LOCAL_PATH)
 
 LOCAL_SRC_FILES := \
 	extendedcommands.c \
+	fileops.c \
+	md5.c \
 	nandroid.c \
 	legacy.c \
 	commands.c \
@@ -65,6 +67,10 @@ ifdef BOARD_SDCARD_DEVICE_SECONDARY
   LOCAL_CFLAGS += -DSDCARD_DEVICE_SECONDARY=\"$(BOARD_SDCARD_DEVICE_SECONDARY)\"
 endif
 
+ifdef BOARD_UMS_LUNFILE
+  LOCAL_CFLAGS += -DBOARD_UMS_LUNFILE=\"$(BOARD_UMS_LUNFILE)\"
+endif
+
 ifdef BOARD_SDEXT_DEVICE
   LOCAL_CFLAGS += -DSDEXT_DEVICE=\"$(BOARD_SDEXT_DEVICE)\"
 endif
@@ -154,8 +160,8 @@ endif
 
 LOCAL_STATIC_LIBRARIES += libext4_utils libz
 LOCAL_STATIC_LIBRARIES += libbusybox libclearsilverregex libmkyaffs2image libunyaffs liberase_image libdump_image libflash_image libmtdutils
-LOCAL_STATIC_LIBRARIES += libamend
-LOCAL_STATIC_LIBRARIES += libminzip libunz libmtdutils libmmcutils libmincrypt
+LOCAL_STATIC_LIBRARIES += libamend libtraceutils
+LOCAL_STATIC_LIBRARIES += libminzip libunz libmtdutils libmmcutils libmincrypt libhashutils libspawnutils
 LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libcutils
 LOCAL_STATIC_LIBRARIES += libstdc++ libc
 
@@ -286,7 +292,7 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 LOCAL_MODULE_TAGS := tests
 
-LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
+LOCAL_STATIC_LIBRARIES := libmincrypt libhashutils libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
 
@@ -299,6 +305,9 @@ include $(commands_recovery_local_path)/mtdutils/Android.mk
 include $(commands_recovery_local_path)/mmcutils/Android.mk
 include $(commands_recovery_local_path)/tools/Android.mk
 include $(commands_recovery_local_path)/edify/Android.mk
+include $(commands_recovery_local_path)/hashutils/Android.mk
+include $(commands_recovery_local_path)/traceutils/Android.mk
+include $(commands_recovery_local_path)/spawnutils/Android.mk
 include $(commands_recovery_local_path)/updater/Android.mk
 include $(commands_recovery_local_path)/applypatch/Android.mk
 include $(commands_recovery_local_path)/utilities/Android.mk
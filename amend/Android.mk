@@ -36,6 +36,9 @@ LOCAL_SRC_FILES := \
 LOCAL_CFLAGS := $(amend_cflags) -g -O0
 LOCAL_MODULE := amend
 LOCAL_YACCFLAGS := -v
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES := libtraceutils
+LOCAL_LDLIBS += -lpthread -lrt
 
 include $(BUILD_HOST_EXECUTABLE)
 
@@ -49,5 +52,6 @@ LOCAL_SRC_FILES += $(amend_test_files)
 
 LOCAL_CFLAGS := $(amend_cflags)
 LOCAL_MODULE := libamend
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 
 include $(BUILD_STATIC_LIBRARY)
@@ -21,6 +21,7 @@
 #include <assert.h>
 #include "ast.h"
 #include "execute.h"
+#include "traceutils/trace.h"
 
 typedef struct {
     int c;
@@ -304,7 +305,16 @@ execCommandList(ExecContext *ctx, const AmCommandList *commandList)
 {
     int i;
     for (i = 0; i < commandList->commandCount; i++) {
-        int ret = execCommand(ctx, commandList->commands[i]);
+        const AmCommand *command = commandList->commands[i];
+        int ret;
+        if (gTraceEnabled) {
+            TraceSpan span;
+            TraceBegin(&span);
+            ret = execCommand(ctx, command);
+            TraceEnd(&span, command->name, "amend", command->line, 0);
+        } else {
+            ret = execCommand(ctx, command);
+        }
         if (ret != 0) {
             int line = commandList->commands[i]->line;
             return line > 0 ? line : ret;
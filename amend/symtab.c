@@ -18,12 +18,17 @@
 #include <string.h>
 #include "symtab.h"
 
+/* Must be a power of two. */
 #define DEFAULT_TABLE_SIZE 16
 
+/* An open-addressing hash table, kept at most half full.
+ * Empty slots have a NULL symbol.
+ */
 typedef struct {
     char *symbol;
     const void *cookie;
     unsigned int flags;
+    unsigned int hash;
 } SymbolTableEntry;
 
 struct SymbolTable {
@@ -32,6 +37,37 @@ struct SymbolTable {
     int maxSize;
 };
 
+static unsigned int
+hashSymbol(const char *symbol, unsigned int flags)
+{
+    /* FNV-1a, with the flags mixed in last. */
+    unsigned int hash = 2166136261u;
+    const unsigned char *p;
+    for (p = (const unsigned char *)symbol; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return (hash ^ flags) * 16777619u;
+}
+
+/* Returns the entry for symbol/flags, or the empty slot where it
+ * would go.
+ */
+static SymbolTableEntry *
+findSlot(SymbolTableEntry *table, int size, const char *symbol,
+        unsigned int flags, unsigned int hash)
+{
+    unsigned int i = hash & (size - 1);
+    while (table[i].symbol != NULL) {
+        if (table[i].hash == hash && table[i].flags == flags &&
+                strcmp(table[i].symbol, symbol) == 0)
+        {
+            break;
+        }
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
 SymbolTable *
 createSymbolTable()
 {
@@ -41,8 +77,8 @@ createSymbolTable()
     if (tab != NULL) {
         tab->numEntries = 0;
         tab->maxSize = DEFAULT_TABLE_SIZE;
-        tab->table = (SymbolTableEntry *)malloc(
-                            tab->maxSize * sizeof(SymbolTableEntry));
+        tab->table = (SymbolTableEntry *)calloc(tab->maxSize,
+                            sizeof(SymbolTableEntry));
         if (tab->table == NULL) {
             free(tab);
             tab = NULL;
@@ -55,32 +91,28 @@ void
 deleteSymbolTable(SymbolTable *tab)
 {
     if (tab != NULL) {
-        while (tab->numEntries > 0) {
-            free(tab->table[--tab->numEntries].symbol);
+        int i;
+        for (i = 0; i < tab->maxSize; i++) {
+            free(tab->table[i].symbol);
         }
         free(tab->table);
+        free(tab);
     }
 }
 
 void *
 findInSymbolTable(SymbolTable *tab, const char *symbol, unsigned int flags)
 {
-    int i;
-
     if (tab == NULL || symbol == NULL) {
         return NULL;
     }
 
-    // TODO: Sort the table and binary search
-    for (i = 0; i < tab->numEntries; i++) {
-        if (strcmp(tab->table[i].symbol, symbol) == 0 &&
-                tab->table[i].flags == flags)
-        {
-            return (void *)tab->table[i].cookie;
-        }
+    SymbolTableEntry *entry = findSlot(tab->table, tab->maxSize, symbol,
+            flags, hashSymbol(symbol, flags));
+    if (entry->symbol == NULL) {
+        return NULL;
     }
-
-    return NULL;
+    return (void *)entry->cookie;
 }
 
 int
@@ -93,27 +125,37 @@ addToSymbolTable(SymbolTable *tab, const char *symbol, unsigned int flags,
 
     /* Make sure that this symbol isn't already in the table.
      */
-    if (findInSymbolTable(tab, symbol, flags) != NULL) {
+    unsigned int hash = hashSymbol(symbol, flags);
+    SymbolTableEntry *entry = findSlot(tab->table, tab->maxSize, symbol,
+            flags, hash);
+    if (entry->symbol != NULL) {
         return -2;
     }
 
-    /* Make sure there's enough space for the new entry.
+    /* Keep the table no more than half full, so probes stay short.
      */
-    if (tab->numEntries == tab->maxSize) {
+    if ((tab->numEntries + 1) * 2 > tab->maxSize) {
         SymbolTableEntry *newTable;
         int newSize;
+        int i;
 
-        newSize = tab->numEntries * 2;
-        if (newSize < DEFAULT_TABLE_SIZE) {
-            newSize = DEFAULT_TABLE_SIZE;
-        }
-        newTable = (SymbolTableEntry *)realloc(tab->table,
-                            newSize * sizeof(SymbolTableEntry));
+        newSize = tab->maxSize * 2;
+        newTable = (SymbolTableEntry *)calloc(newSize,
+                            sizeof(SymbolTableEntry));
         if (newTable == NULL) {
             return -1;
         }
+        for (i = 0; i < tab->maxSize; i++) {
+            SymbolTableEntry *old = &tab->table[i];
+            if (old->symbol != NULL) {
+                *findSlot(newTable, newSize, old->symbol, old->flags,
+                        old->hash) = *old;
+            }
+        }
+        free(tab->table);
         tab->maxSize = newSize;
         tab->table = newTable;
+        entry = findSlot(tab->table, tab->maxSize, symbol, flags, hash);
     }
 
     /* Insert the new entry.
@@ -122,10 +164,10 @@ addToSymbolTable(SymbolTable *tab, const char *symbol, unsigned int flags,
     if (symbol == NULL) {
         return -1;
     }
-    // TODO: Sort the table
-    tab->table[tab->numEntries].symbol = (char *)symbol;
-    tab->table[tab->numEntries].cookie = cookie;
-    tab->table[tab->numEntries].flags = flags;
+    entry->symbol = (char *)symbol;
+    entry->cookie = cookie;
+    entry->flags = flags;
+    entry->hash = hash;
     tab->numEntries++;
 
     return 0;
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #undef NDEBUG
 #include <assert.h>
@@ -138,6 +139,28 @@ test_symtab()
     cookie = findInSymbolTable(tab, "one", 0);
     assert((int)cookie == 1);
 
+    /* Add enough entries to make the table grow a few times, and
+     * make sure everything is still findable afterward.
+     */
+    char name[32];
+    int i;
+    for (i = 0; i < 1000; i++) {
+        sprintf(name, "sym%d", i);
+        ret = addToSymbolTable(tab, name, i % 3, (void *)(i + 100));
+        assert(ret == 0);
+    }
+    for (i = 0; i < 1000; i++) {
+        sprintf(name, "sym%d", i);
+        cookie = findInSymbolTable(tab, name, i % 3);
+        assert((int)cookie == i + 100);
+        cookie = findInSymbolTable(tab, name, (i + 1) % 3);
+        assert(cookie == NULL);
+    }
+    cookie = findInSymbolTable(tab, "one", 333);
+    assert((int)cookie == 11);
+    cookie = findInSymbolTable(tab, "sym1000", 1);
+    assert(cookie == NULL);
+
     /* Try deleting again, now that there's stuff in the table.
      */
     deleteSymbolTable(tab);
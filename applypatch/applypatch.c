@@ -16,16 +16,20 @@
 
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mincrypt/sha.h"
+#include "hashutils/sha1.h"
 #include "applypatch.h"
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
@@ -37,15 +41,104 @@ ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 
 static int mtd_partitions_scanned = 0;
 
-// Read a file into memory; store it and its associated metadata in
-// *file.  Return 0 on success.
-int LoadFileContents(const char* filename, FileContents* file) {
+// SHA-1s of files we've already hashed during this run, keyed by
+// the stat() fields that change whenever a file is rewritten.  The
+// same files get checked by apply_patch_check(), patched by
+// apply_patch(), and copied to the cache, and each of those would
+// otherwise hash them again.
+#define SHA1_MEMO_SIZE 64
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mtime_nsec;
+    time_t ctime;
+    long ctime_nsec;
+    off_t size;
+    uint8_t sha1[SHA_DIGEST_SIZE];
+} Sha1MemoEntry;
+
+// bionic's struct stat has st_mtime_nsec where glibc has st_mtim.
+#ifdef HAVE_ANDROID_OS
+#define MTIME_NSEC(st) ((long)(st)->st_mtime_nsec)
+#define CTIME_NSEC(st) ((long)(st)->st_ctime_nsec)
+#else
+#define MTIME_NSEC(st) ((long)(st)->st_mtim.tv_nsec)
+#define CTIME_NSEC(st) ((long)(st)->st_ctim.tv_nsec)
+#endif
+
+static Sha1MemoEntry sha1_memo[SHA1_MEMO_SIZE];
+static int sha1_memo_count = 0;
+static int sha1_memo_next = 0;    // slot to overwrite once full
+static pthread_mutex_t sha1_memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int MemoMatches(const Sha1MemoEntry* e, const struct stat* st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino &&
+        e->mtime == st->st_mtime && e->mtime_nsec == MTIME_NSEC(st) &&
+        e->ctime == st->st_ctime && e->ctime_nsec == CTIME_NSEC(st) &&
+        e->size == st->st_size;
+}
+
+static int LookupSha1Memo(const struct stat* st, uint8_t* sha1) {
+    int i, found = 0;
+    pthread_mutex_lock(&sha1_memo_lock);
+    for (i = 0; i < sha1_memo_count; ++i) {
+        if (MemoMatches(sha1_memo+i, st)) {
+            memcpy(sha1, sha1_memo[i].sha1, SHA_DIGEST_SIZE);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sha1_memo_lock);
+    return found;
+}
+
+static void StoreSha1Memo(const struct stat* st, const uint8_t* sha1) {
+    // Filesystems that keep whole seconds (yaffs2, rfs, ext3) show a
+    // second rewrite in the same second as no change at all, so don't
+    // vouch for a file that changed that recently.
+    time_t now = time(NULL);
+    if (st->st_mtime >= now - 1 || st->st_ctime >= now - 1) return;
+
+    int i;
+    pthread_mutex_lock(&sha1_memo_lock);
+    for (i = 0; i < sha1_memo_count; ++i) {
+        if (MemoMatches(sha1_memo+i, st)) break;
+    }
+    if (i == sha1_memo_count) {
+        if (sha1_memo_count < SHA1_MEMO_SIZE) {
+            i = sha1_memo_count++;
+        } else {
+            i = sha1_memo_next;
+            sha1_memo_next = (sha1_memo_next + 1) % SHA1_MEMO_SIZE;
+        }
+    }
+    Sha1MemoEntry* e = sha1_memo+i;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtime;
+    e->mtime_nsec = MTIME_NSEC(st);
+    e->ctime = st->st_ctime;
+    e->ctime_nsec = CTIME_NSEC(st);
+    e->size = st->st_size;
+    memcpy(e->sha1, sha1, SHA_DIGEST_SIZE);
+    pthread_mutex_unlock(&sha1_memo_lock);
+}
+
+static int LoadFile(const char* filename, FileContents* file, int allow_map) {
     file->data = NULL;
+    file->mapped = 0;
+    file->sha1_valid = 0;
 
     // A special 'filename' beginning with "MTD:" means to load the
     // contents of an MTD partition.
     if (strncmp(filename, "MTD:", 4) == 0) {
-        return LoadMTDContents(filename, file);
+        if (LoadMTDContents(filename, file) != 0) {
+            return -1;
+        }
+        file->sha1_valid = 1;
+        return 0;
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -54,7 +147,22 @@ int LoadFileContents(const char* filename, FileContents* file) {
     }
 
     file->size = file->st.st_size;
-    file->data = malloc(file->size);
+
+    if (allow_map && S_ISREG(file->st.st_mode) && file->size > 0) {
+        int fd = open(filename, O_RDONLY);
+        if (fd >= 0) {
+            void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (data != MAP_FAILED) {
+                file->data = data;
+                file->mapped = 1;
+                return 0;
+            }
+        }
+        // fall back to reading it
+    }
+
+    file->data = malloc(file->size > 0 ? file->size : 1);
 
     FILE* f = fopen(filename, "rb");
     if (f == NULL) {
@@ -70,14 +178,46 @@ int LoadFileContents(const char* filename, FileContents* file) {
                filename, (long)bytes_read, (long)file->size);
         free(file->data);
         file->data = NULL;
+        fclose(f);
         return -1;
     }
     fclose(f);
-
-    SHA(file->data, file->size, file->sha1);
     return 0;
 }
 
+int LoadFileContents(const char* filename, FileContents* file) {
+    return LoadFile(filename, file, 1);
+}
+
+int LoadFileContentsCopy(const char* filename, FileContents* file) {
+    return LoadFile(filename, file, 0);
+}
+
+// Return the SHA-1 of the loaded contents, computing it (or finding
+// it in the memo) the first time it's asked for.
+const uint8_t* FileContentsSha1(FileContents* file) {
+    if (!file->sha1_valid) {
+        if (!LookupSha1Memo(&file->st, file->sha1)) {
+            Sha1(file->data, file->size, file->sha1);
+            StoreSha1Memo(&file->st, file->sha1);
+        }
+        file->sha1_valid = 1;
+    }
+    return file->sha1;
+}
+
+void ReleaseFileContents(FileContents* file) {
+    if (file->data != NULL) {
+        if (file->mapped) {
+            munmap(file->data, file->size);
+        } else {
+            free(file->data);
+        }
+    }
+    file->data = NULL;
+    file->mapped = 0;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -94,7 +234,7 @@ static int compare_size_indices(const void* a, const void* b) {
 }
 
 void FreeFileContents(FileContents* file) {
-    if (file) free(file->data);
+    if (file) ReleaseFileContents(file);
     free(file);
 }
 
@@ -175,8 +315,8 @@ int LoadMTDContents(const char* filename, FileContents* file) {
         return -1;
     }
 
-    SHA_CTX sha_ctx;
-    SHA_init(&sha_ctx);
+    Sha1Ctx sha_ctx;
+    Sha1Init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
     // allocate enough memory to hold the largest size.
@@ -199,15 +339,15 @@ int LoadMTDContents(const char* filename, FileContents* file) {
                 file->data = NULL;
                 return -1;
             }
-            SHA_update(&sha_ctx, p, read);
+            Sha1Update(&sha_ctx, p, read);
             file->size += read;
         }
 
         // Duplicate the SHA context and finalize the duplicate so we can
         // check it against this pair's expected hash.
-        SHA_CTX temp_ctx;
-        memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
-        const uint8_t* sha_so_far = SHA_final(&temp_ctx);
+        Sha1Ctx temp_ctx;
+        memcpy(&temp_ctx, &sha_ctx, sizeof(Sha1Ctx));
+        const uint8_t* sha_so_far = Sha1Final(&temp_ctx);
 
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
@@ -240,7 +380,7 @@ int LoadMTDContents(const char* filename, FileContents* file) {
         return -1;
     }
 
-    const uint8_t* sha_final = SHA_final(&sha_ctx);
+    const uint8_t* sha_final = Sha1Final(&sha_ctx);
     for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
         file->sha1[i] = sha_final[i];
     }
@@ -258,6 +398,57 @@ int LoadMTDContents(const char* filename, FileContents* file) {
     return 0;
 }
 
+// Bytes at the start of an MTD partition that FileFingerprint() hashes.
+#define FINGERPRINT_HEAD_SIZE 4096
+
+// Write to 'out' a short token (no spaces) that changes whenever
+// filename's contents may have:  the device, inode, size and
+// (nanosecond) mtime and ctime of a file, or for "MTD:<partition>..."
+// the partition's size and a hash of its first few kilobytes.
+// Returns 0 on success.
+int FileFingerprint(const char* filename, char* out, size_t out_size) {
+    if (strncmp(filename, "MTD:", 4) != 0) {
+        struct stat st;
+        if (stat(filename, &st) != 0) return -1;
+        snprintf(out, out_size, "f%llx.%llx.%llx.%lx.%lx.%lx.%lx",
+                 (unsigned long long)st.st_dev,
+                 (unsigned long long)st.st_ino,
+                 (unsigned long long)st.st_size,
+                 (unsigned long)st.st_mtime, (unsigned long)MTIME_NSEC(&st),
+                 (unsigned long)st.st_ctime, (unsigned long)CTIME_NSEC(&st));
+        return 0;
+    }
+
+    char partition[64];
+    size_t len = strcspn(filename + 4, ":");
+    if (len == 0 || len >= sizeof(partition)) return -1;
+    memcpy(partition, filename + 4, len);
+    partition[len] = '\0';
+
+    if (!mtd_partitions_scanned) {
+        mtd_scan_partitions();
+        mtd_partitions_scanned = 1;
+    }
+    const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+    size_t total_size;
+    if (mtd == NULL || mtd_partition_info(mtd, &total_size, NULL, NULL) != 0) {
+        return -1;
+    }
+    MtdReadContext* ctx = mtd_read_partition(mtd);
+    if (ctx == NULL) return -1;
+    char head[FINGERPRINT_HEAD_SIZE];
+    ssize_t read = mtd_read_data(ctx, head, sizeof(head));
+    mtd_read_close(ctx);
+    if (read != sizeof(head)) return -1;
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    Sha1(head, sizeof(head), digest);
+    snprintf(out, out_size, "m%lx.%02x%02x%02x%02x%02x%02x%02x%02x",
+             (unsigned long)total_size, digest[0], digest[1], digest[2],
+             digest[3], digest[4], digest[5], digest[6], digest[7]);
+    return 0;
+}
+
 
 // Save the contents of the given FileContents object under the given
 // filename.  Return 0 on success.
@@ -384,7 +575,7 @@ int ParseSha1(const char* str, uint8_t* digest) {
 // Search an array of sha1 strings for one matching the given sha1.
 // Return the index of the match on success, or -1 if no match is
 // found.
-int FindMatchingPatch(uint8_t* sha1, char** const patch_sha1_str,
+int FindMatchingPatch(const uint8_t* sha1, char** const patch_sha1_str,
                       int num_patches) {
     int i;
     uint8_t patch_sha1[SHA_DIGEST_SIZE];
@@ -397,6 +588,21 @@ int FindMatchingPatch(uint8_t* sha1, char** const patch_sha1_str,
     return -1;
 }
 
+// Returns 1 if the patch journal says an earlier run of this package
+// left filename with one of the given sha1s.
+static int JournaledAsAny(const char* filename,
+                          char** const patch_sha1_str, int num_patches) {
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    int i;
+    for (i = 0; i < num_patches; ++i) {
+        if (ParseSha1(patch_sha1_str[i], sha1) == 0 &&
+            PatchJournalIsDone(filename, sha1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 // Returns 0 if the contents of the file (argv[2]) or the cached file
 // match any of the sha1's on the command line (argv[3:]).  Returns
 // nonzero otherwise.
@@ -404,6 +610,11 @@ int applypatch_check(const char* filename,
                      int num_patches, char** const patch_sha1_str) {
     FileContents file;
     file.data = NULL;
+    file.mapped = 0;
+
+    if (JournaledAsAny(filename, patch_sha1_str, num_patches)) {
+        return 0;
+    }
 
     // It's okay to specify no sha1s; the check will pass if the
     // LoadFileContents is successful.  (Useful for reading MTD
@@ -411,11 +622,12 @@ int applypatch_check(const char* filename,
     // check them twice.)
     if (LoadFileContents(filename, &file) != 0 ||
         (num_patches > 0 &&
-         FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0)) {
+         FindMatchingPatch(FileContentsSha1(&file),
+                           patch_sha1_str, num_patches) < 0)) {
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
+        ReleaseFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -428,17 +640,198 @@ int applypatch_check(const char* filename,
             return 1;
         }
 
-        if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
+        if (FindMatchingPatch(FileContentsSha1(&file),
+                              patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            ReleaseFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    ReleaseFileContents(&file);
     return 0;
 }
 
+// SHA-1 a file without keeping its contents around.  Uses (and
+// fills) the memo, so a later load of the same file won't hash it
+// again.  Returns 0 on success.
+static int HashFile(const char* filename, uint8_t* sha1) {
+    FileContents file;
+    if (LoadFileContents(filename, &file) != 0) {
+        return -1;
+    }
+    if (file.mapped) {
+        madvise(file.data, file.size, MADV_SEQUENTIAL);
+    }
+    memcpy(sha1, FileContentsSha1(&file), SHA_DIGEST_SIZE);
+    ReleaseFileContents(&file);
+    return 0;
+}
+
+typedef struct {
+    PatchCheckItem* items;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} PatchCheckQueue;
+
+static void CheckOneItem(PatchCheckItem* item) {
+    if (JournaledAsAny(item->filename, item->sha1s, item->num_sha1s)) {
+        item->result = 0;
+        return;
+    }
+
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    int loaded = HashFile(item->filename, sha1);
+
+    // As in applypatch_check(), no sha1s means the file only has to
+    // be readable.
+    item->result = (loaded == 0 &&
+                    (item->num_sha1s == 0 ||
+                     FindMatchingPatch(sha1, item->sha1s,
+                                       item->num_sha1s) >= 0)) ? 0 : 1;
+}
+
+// Like CheckOneItem() for several files at once.  Their hashes are
+// computed with one Sha1Multi() call, which (lacking SHA-1 hardware)
+// runs them side by side in vector lanes.
+#define CHECK_GROUP_SIZE 4
+
+static void CheckItemGroup(PatchCheckItem** items, int n) {
+    FileContents files[CHECK_GROUP_SIZE];
+    Sha1Job jobs[CHECK_GROUP_SIZE];
+    int job_file[CHECK_GROUP_SIZE];
+    int num_jobs = 0;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        files[i].data = NULL;
+        files[i].mapped = 0;
+        items[i]->result = 1;
+        if (JournaledAsAny(items[i]->filename, items[i]->sha1s,
+                           items[i]->num_sha1s)) {
+            items[i]->result = 0;
+            continue;
+        }
+        if (LoadFileContents(items[i]->filename, files+i) != 0) {
+            continue;
+        }
+        if (LookupSha1Memo(&files[i].st, files[i].sha1)) {
+            files[i].sha1_valid = 1;
+            continue;
+        }
+        if (files[i].mapped) {
+            madvise(files[i].data, files[i].size, MADV_SEQUENTIAL);
+        }
+        jobs[num_jobs].data = files[i].data;
+        jobs[num_jobs].len = files[i].size;
+        job_file[num_jobs++] = i;
+    }
+
+    Sha1Multi(jobs, num_jobs);
+    for (i = 0; i < num_jobs; ++i) {
+        FileContents* file = files + job_file[i];
+        memcpy(file->sha1, jobs[i].digest, SHA_DIGEST_SIZE);
+        file->sha1_valid = 1;
+        StoreSha1Memo(&file->st, file->sha1);
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (files[i].data == NULL) continue;
+        items[i]->result = (items[i]->num_sha1s == 0 ||
+                            FindMatchingPatch(files[i].sha1, items[i]->sha1s,
+                                              items[i]->num_sha1s) >= 0)
+            ? 0 : 1;
+        ReleaseFileContents(files+i);
+    }
+}
+
+static void* PatchCheckThread(void* cookie) {
+    PatchCheckQueue* q = (PatchCheckQueue*)cookie;
+    for (;;) {
+        PatchCheckItem* group[CHECK_GROUP_SIZE];
+        int n = 0;
+        pthread_mutex_lock(&q->lock);
+        while (n < CHECK_GROUP_SIZE && q->next < q->count) {
+            PatchCheckItem* item = q->items + q->next++;
+            if (strncmp(item->filename, "MTD:", 4) != 0) {
+                group[n++] = item;
+            }
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (n == 0) break;
+        CheckItemGroup(group, n);
+    }
+    return NULL;
+}
+
+// Check many files at once.  Each item passes if its file (or the
+// cached copy of a file interrupted mid-patch) matches one of its
+// sha1s, exactly as applypatch_check() would decide; item->result is
+// set to 0 for a pass and nonzero otherwise.  Returns the number of
+// items that failed.
+//
+// Files are mapped and hashed, a few at a time, on a pool of threads
+// so reads and hashing overlap.  MTD partitions are loaded on the calling thread
+// since the mtd scan isn't thread-safe.
+int applypatch_check_batch(PatchCheckItem* items, int count) {
+    PatchCheckQueue q;
+    q.items = items;
+    q.count = count;
+    q.next = 0;
+    pthread_mutex_init(&q.lock, NULL);
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (strncmp(items[i].filename, "MTD:", 4) == 0) {
+            CheckOneItem(items+i);
+        }
+    }
+
+    // Flash reads block, so use a couple of threads per core.
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    if (num_threads < 2) num_threads = 2;
+    if (num_threads > 8) num_threads = 8;
+    if (num_threads > (count + CHECK_GROUP_SIZE - 1) / CHECK_GROUP_SIZE) {
+        num_threads = (count + CHECK_GROUP_SIZE - 1) / CHECK_GROUP_SIZE;
+    }
+
+    pthread_t threads[8];
+    int started = 0;
+    while (started < num_threads &&
+           pthread_create(threads+started, NULL, PatchCheckThread, &q) == 0) {
+        ++started;
+    }
+    PatchCheckThread(&q);
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&q.lock);
+
+    // Anything that failed may have been caught mid-patch; its source
+    // would then be in CACHE_TEMP_SOURCE.  Hash that at most once.
+    int failures = 0;
+    int have_cache = 0;
+    uint8_t cache_sha1[SHA_DIGEST_SIZE];
+    for (i = 0; i < count; ++i) {
+        if (items[i].result == 0) continue;
+        if (have_cache == 0) {
+            have_cache = (HashFile(CACHE_TEMP_SOURCE, cache_sha1) == 0)
+                ? 1 : -1;
+        }
+        if (have_cache > 0 &&
+            FindMatchingPatch(cache_sha1, items[i].sha1s,
+                              items[i].num_sha1s) >= 0) {
+            items[i].result = 0;
+        } else {
+            printf("file \"%s\" doesn't have any of expected sha1 sums\n",
+                   items[i].filename);
+            ++failures;
+        }
+    }
+    return failures;
+}
+
 int ShowLicenses() {
     ShowBSDiffLicense();
     return 0;
@@ -522,6 +915,16 @@ int CacheSizeCheck(size_t bytes) {
 // data.  See the comments for the LoadMTDContents() function above
 // for the format of such a filename.
 
+static int ApplyPatchTo(const char* source_filename,
+                        const char* target_filename,
+                        const char* target_sha1_str,
+                        size_t target_size,
+                        int num_patches,
+                        char** const patch_sha1_str,
+                        Value** patch_data,
+                        FileContents* source_file,
+                        FileContents* copy_file);
+
 int applypatch(const char* source_filename,
                const char* target_filename,
                const char* target_sha1_str,
@@ -529,6 +932,49 @@ int applypatch(const char* source_filename,
                int num_patches,
                char** const patch_sha1_str,
                Value** patch_data) {
+    // The source may be mapped; make sure it's unmapped however we
+    // leave.
+    FileContents source_file;
+    FileContents copy_file;
+    source_file.data = NULL;
+    source_file.mapped = 0;
+    copy_file.data = NULL;
+    copy_file.mapped = 0;
+
+    int result = ApplyPatchTo(source_filename, target_filename,
+                              target_sha1_str, target_size,
+                              num_patches, patch_sha1_str, patch_data,
+                              &source_file, &copy_file);
+
+    ReleaseFileContents(&source_file);
+    ReleaseFileContents(&copy_file);
+    return result;
+}
+
+// Save the source to CACHE_TEMP_SOURCE before we start destroying
+// it.  If we were interrupted while patching this same target, the
+// copy may already be there; don't write it again.
+static int BackupSource(const char* target_filename,
+                        FileContents* source_file) {
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    if (PatchJournalIsInflight(target_filename) &&
+        HashFile(CACHE_TEMP_SOURCE, sha1) == 0 &&
+        memcmp(sha1, FileContentsSha1(source_file), SHA_DIGEST_SIZE) == 0) {
+        printf("reusing cached source from interrupted run\n");
+        return 0;
+    }
+    return SaveFileContents(CACHE_TEMP_SOURCE, *source_file);
+}
+
+static int ApplyPatchTo(const char* source_filename,
+                        const char* target_filename,
+                        const char* target_sha1_str,
+                        size_t target_size,
+                        int num_patches,
+                        char** const patch_sha1_str,
+                        Value** patch_data,
+                        FileContents* source_file,
+                        FileContents* copy_file) {
     printf("\napplying patch to %s\n", source_filename);
 
     if (target_filename[0] == '-' &&
@@ -542,15 +988,22 @@ int applypatch(const char* source_filename,
         return 1;
     }
 
-    FileContents copy_file;
-    FileContents source_file;
+    // An earlier, interrupted run of this package already wrote the
+    // target; don't read it back just to hash it.
+    if (PatchJournalIsDone(target_filename, target_sha1)) {
+        printf("\"%s\" is already target (journaled); no patch needed\n",
+               target_filename);
+        return 0;
+    }
+
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
     int made_copy = 0;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file) == 0) {
-        if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
+    if (LoadFileContents(target_filename, source_file) == 0) {
+        if (memcmp(FileContentsSha1(source_file), target_sha1,
+                   SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
@@ -559,17 +1012,17 @@ int applypatch(const char* source_filename,
         }
     }
 
-    if (source_file.data == NULL ||
+    if (source_file->data == NULL ||
         (target_filename != source_filename &&
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        LoadFileContents(source_filename, &source_file);
+        ReleaseFileContents(source_file);
+        LoadFileContents(source_filename, source_file);
     }
 
-    if (source_file.data != NULL) {
-        int to_use = FindMatchingPatch(source_file.sha1,
+    if (source_file->data != NULL) {
+        int to_use = FindMatchingPatch(FileContentsSha1(source_file),
                                        patch_sha1_str, num_patches);
         if (to_use >= 0) {
             source_patch_value = patch_data[to_use];
@@ -577,16 +1030,16 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
+        ReleaseFileContents(source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file) < 0) {
+        if (LoadFileContents(CACHE_TEMP_SOURCE, copy_file) < 0) {
             // fail.
             printf("failed to read copy file\n");
             return 1;
         }
 
-        int to_use = FindMatchingPatch(copy_file.sha1,
+        int to_use = FindMatchingPatch(FileContentsSha1(copy_file),
                                        patch_sha1_str, num_patches);
         if (to_use > 0) {
             copy_patch_value = patch_data[to_use];
@@ -599,8 +1052,10 @@ int applypatch(const char* source_filename,
         }
     }
 
+    PatchJournalBegin(target_filename, target_sha1);
+
     int retry = 1;
-    SHA_CTX ctx;
+    Sha1Ctx ctx;
     int output;
     MemorySinkInfo msi;
     FileContents* source_to_use;
@@ -631,11 +1086,11 @@ int applypatch(const char* source_filename,
 
             // We still write the original source to cache, in case the MTD
             // write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file.size) < 0) {
+            if (MakeFreeSpaceOnCache(source_file->size) < 0) {
                 printf("not enough free space on /cache\n");
                 return 1;
             }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+            if (BackupSource(target_filename, source_file) < 0) {
                 printf("failed to back up source file\n");
                 return 1;
             }
@@ -668,16 +1123,26 @@ int applypatch(const char* source_filename,
                     return 1;
                 }
 
-                if (MakeFreeSpaceOnCache(source_file.size) < 0) {
+                if (MakeFreeSpaceOnCache(source_file->size) < 0) {
                     printf("not enough free space on /cache\n");
                     return 1;
                 }
 
-                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                if (BackupSource(target_filename, source_file) < 0) {
                     printf("failed to back up source file\n");
                     return 1;
                 }
                 made_copy = 1;
+
+                // A mapping of the source would keep its blocks allocated
+                // after the unlink; read from the copy from here on.
+                if (source_file->mapped) {
+                    ReleaseFileContents(source_file);
+                    if (LoadFileContents(CACHE_TEMP_SOURCE, source_file) != 0) {
+                        printf("failed to reload source from cache\n");
+                        return 1;
+                    }
+                }
                 unlink(source_filename);
 
                 size_t free_space = FreeSpaceForFile(target_fs);
@@ -687,10 +1152,10 @@ int applypatch(const char* source_filename,
 
         const Value* patch;
         if (source_patch_value != NULL) {
-            source_to_use = &source_file;
+            source_to_use = source_file;
             patch = source_patch_value;
         } else {
-            source_to_use = &copy_file;
+            source_to_use = copy_file;
             patch = copy_patch_value;
         }
 
@@ -734,12 +1199,13 @@ int applypatch(const char* source_filename,
         char* header = patch->data;
         ssize_t header_bytes_read = patch->size;
 
-        SHA_init(&ctx);
+        Sha1Init(&ctx);
 
         int result;
 
         if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
+            (memcmp(header, "BSDIFF40", 8) == 0 ||
+             memcmp(header, "BSDIFF41", 8) == 0)) {
             result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
                                       patch, 0, sink, token, &ctx);
         } else if (header_bytes_read >= 8 &&
@@ -772,7 +1238,7 @@ int applypatch(const char* source_filename,
         }
     } while (retry-- > 0);
 
-    const uint8_t* current_target_sha1 = SHA_final(&ctx);
+    const uint8_t* current_target_sha1 = Sha1Final(&ctx);
     if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
         printf("patch did not produce expected sha1\n");
         return 1;
@@ -785,6 +1251,7 @@ int applypatch(const char* source_filename,
             return 1;
         }
         free(msi.buffer);
+        PatchJournalFinish(target_filename, target_sha1);
     } else {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
@@ -804,6 +1271,7 @@ int applypatch(const char* source_filename,
                    target_filename, strerror(errno));
             return 1;
         }
+        PatchJournalFinish(target_filename, target_sha1);
     }
 
     // If this run of applypatch created the copy, and we're here, we
@@ -19,6 +19,7 @@
 
 #include <sys/stat.h>
 #include "mincrypt/sha.h"
+#include "hashutils/sha1.h"
 #include "edify/expr.h"
 
 typedef struct _Patch {
@@ -27,10 +28,12 @@ typedef struct _Patch {
 } Patch;
 
 typedef struct _FileContents {
-  uint8_t sha1[SHA_DIGEST_SIZE];
+  uint8_t sha1[SHA_DIGEST_SIZE];   // only once sha1_valid; see FileContentsSha1()
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;                      // data is an mmap() of the file
+  int sha1_valid;
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -40,6 +43,10 @@ typedef struct _FileContents {
 // and use it as the source instead.
 #define CACHE_TEMP_SOURCE "/cache/saved.file"
 
+// Where the updater records which patches a package has finished
+// applying, so an interrupted install can pick up where it left off.
+#define CACHE_PATCH_JOURNAL "/cache/applypatch.journal"
+
 typedef ssize_t (*SinkFn)(unsigned char*, ssize_t, void*);
 
 // applypatch.c
@@ -47,6 +54,8 @@ int ShowLicenses();
 size_t FreeSpaceForFile(const char* filename);
 int CacheSizeCheck(size_t bytes);
 int ParseSha1(const char* str, uint8_t* digest);
+int FileFingerprint(const char* filename, char* out, size_t out_size);
+#define FINGERPRINT_MAX 128
 
 int applypatch(const char* source_filename,
                const char* target_filename,
@@ -59,16 +68,32 @@ int applypatch_check(const char* filename,
                      int num_patches,
                      char** const patch_sha1_str);
 
+typedef struct {
+    const char* filename;
+    int num_sha1s;
+    char** sha1s;
+    int result;                // out: 0 if the file matches
+} PatchCheckItem;
+
+int applypatch_check_batch(PatchCheckItem* items, int count);
+
 // Read a file into memory; store it and its associated metadata in
-// *file.  Return 0 on success.
+// *file.  Return 0 on success.  Regular files are mapped read-only
+// rather than copied, and the SHA-1 isn't computed until
+// FileContentsSha1() is called.  Release with ReleaseFileContents().
 int LoadFileContents(const char* filename, FileContents* file);
+// Like LoadFileContents(), but file->data is always a malloc'ed copy
+// that the caller may take ownership of.
+int LoadFileContentsCopy(const char* filename, FileContents* file);
+const uint8_t* FileContentsSha1(FileContents* file);
+void ReleaseFileContents(FileContents* file);
 void FreeFileContents(FileContents* file);
 
 // bsdiff.c
 void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx);
+                     SinkFn sink, void* token, Sha1Ctx* ctx);
 int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
                         unsigned char** new_data, ssize_t* new_size);
@@ -76,7 +101,15 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
 // imgpatch.c
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx);
+                    SinkFn sink, void* token, Sha1Ctx* ctx);
+
+// journal.c
+int OpenPatchJournal(const char* path, const char* package_id);
+void ClosePatchJournal(int completed);
+int PatchJournalIsDone(const char* filename, const uint8_t* sha1);
+int PatchJournalIsInflight(const char* filename);
+void PatchJournalBegin(const char* filename, const uint8_t* target_sha1);
+void PatchJournalFinish(const char* filename, const uint8_t* target_sha1);
 
 // freecache.c
 int MakeFreeSpaceOnCache(size_t bytes_needed);
@@ -54,6 +54,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#include "bsdiff.h"
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
@@ -156,6 +159,63 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+static SuffixSortBackend suffix_sort_backend = SUFFIX_SORT_AUTO;
+
+void SetSuffixSortBackend(SuffixSortBackend backend)
+{
+	suffix_sort_backend = backend;
+}
+
+SuffixArray* BuildSuffixArray(u_char *old,off_t oldsize)
+{
+	SuffixArray *sa;
+	SuffixSortBackend backend = suffix_sort_backend;
+
+	if((sa=calloc(1,sizeof(SuffixArray)))==NULL) return NULL;
+	sa->size=oldsize;
+
+	/* SA-IS only does 32-bit indices; bigger sources fall back */
+	if(backend==SUFFIX_SORT_AUTO)
+		backend=(oldsize<INT32_MAX) ? SUFFIX_SORT_SAIS : SUFFIX_SORT_QSUFSORT;
+	if(backend==SUFFIX_SORT_SAIS && oldsize>=INT32_MAX)
+		backend=SUFFIX_SORT_QSUFSORT;
+
+	if(backend==SUFFIX_SORT_SAIS) {
+		if(((sa->I32=malloc((oldsize+1)*sizeof(int32_t)))!=NULL) &&
+			(sais(old,oldsize,sa->I32)==0))
+			return sa;
+		/* out of memory somewhere in the recursion; try the old way */
+		free(sa->I32);
+		sa->I32=NULL;
+	};
+
+	{
+		off_t *V;
+		if(((sa->I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
+			((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) {
+			free(sa->I);
+			free(sa);
+			return NULL;
+		};
+		qsufsort(sa->I,V,old,oldsize);
+		free(V);
+	}
+	return sa;
+}
+
+void FreeSuffixArray(SuffixArray *sa)
+{
+	if(sa==NULL) return;
+	free(sa->I);
+	free(sa->I32);
+	free(sa);
+}
+
+static inline off_t sa_get(const SuffixArray *sa,off_t i)
+{
+	return sa->I32!=NULL ? (off_t)sa->I32[i] : sa->I[i];
+}
+
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -166,26 +226,26 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(const SuffixArray *I,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
 	off_t x,y;
 
 	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+		x=matchlen(old+sa_get(I,st),oldsize-sa_get(I,st),new,newsize);
+		y=matchlen(old+sa_get(I,en),oldsize-sa_get(I,en),new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*pos=sa_get(I,st);
 			return x;
 		} else {
-			*pos=I[en];
+			*pos=sa_get(I,en);
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
+	if(memcmp(old+sa_get(I,x),new,MIN(oldsize-sa_get(I,x),newsize))<0) {
 		return search(I,old,oldsize,new,newsize,x,en,pos);
 	} else {
 		return search(I,old,oldsize,new,newsize,st,x,pos);
@@ -210,22 +270,177 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+// Growable output buffer for bsdiff_to_buffer().
+typedef struct {
+	u_char *data;
+	off_t size;
+	off_t alloc;
+} PatchBuffer;
+
+static void buffer_reserve(PatchBuffer *pb,off_t extra)
+{
+	if(pb->size+extra<=pb->alloc) return;
+	while(pb->size+extra>pb->alloc)
+		pb->alloc=pb->alloc ? pb->alloc*2 : 4096;
+	if((pb->data=realloc(pb->data,pb->alloc))==NULL) err(1,NULL);
+}
+
+static void buffer_append(PatchBuffer *pb,const u_char *data,off_t len)
+{
+	buffer_reserve(pb,len);
+	memcpy(pb->data+pb->size,data,len);
+	pb->size+=len;
+}
+
+/* bzip2 data onto the end of pb.  Uses the same parameters as the
+   BZ2_bzWriteOpen(..., 9, 0, 0) calls in stock bsdiff, so the output
+   bytes are the same as they'd be on disk. */
+static void buffer_append_bz2(PatchBuffer *pb,u_char *data,off_t len)
+{
+	bz_stream strm;
+	int bz2err,action;
+
+	memset(&strm,0,sizeof(strm));
+	if((bz2err=BZ2_bzCompressInit(&strm,9,0,0))!=BZ_OK)
+		errx(1, "BZ2_bzCompressInit, bz2err = %d", bz2err);
+
+	do {
+		/* avail_in is only 32 bits wide; feed huge blocks in slices */
+		if(strm.avail_in==0 && len>0) {
+			off_t n=MIN(len,(off_t)1<<30);
+			strm.next_in=(char*)data;
+			strm.avail_in=n;
+			data+=n;
+			len-=n;
+		};
+		action=(len>0) ? BZ_RUN : BZ_FINISH;
+
+		buffer_reserve(pb,65536);
+		strm.next_out=(char*)(pb->data+pb->size);
+		strm.avail_out=pb->alloc-pb->size > (1<<30) ?
+			(1<<30) : pb->alloc-pb->size;
+		{
+			unsigned int before=strm.avail_out;
+			bz2err=BZ2_bzCompress(&strm,action);
+			pb->size+=before-strm.avail_out;
+		}
+		if(bz2err!=BZ_RUN_OK && bz2err!=BZ_FINISH_OK &&
+			bz2err!=BZ_STREAM_END)
+			errx(1, "BZ2_bzCompress, bz2err = %d", bz2err);
+	} while(bz2err!=BZ_STREAM_END);
+
+	BZ2_bzCompressEnd(&strm);
+}
+
+/* Raw-deflate data onto the end of pb (BSDIFF_CODEC_DEFLATE). */
+static void buffer_append_deflate(PatchBuffer *pb,u_char *data,off_t len)
+{
+	z_stream strm;
+	int zerr,flush;
+
+	memset(&strm,0,sizeof(strm));
+	if((zerr=deflateInit2(&strm,Z_BEST_COMPRESSION,Z_DEFLATED,-15,9,
+				Z_DEFAULT_STRATEGY))!=Z_OK)
+		errx(1, "deflateInit2, zerr = %d", zerr);
+
+	do {
+		if(strm.avail_in==0 && len>0) {
+			off_t n=MIN(len,(off_t)1<<30);
+			strm.next_in=data;
+			strm.avail_in=n;
+			data+=n;
+			len-=n;
+		};
+		flush=(len>0) ? Z_NO_FLUSH : Z_FINISH;
+
+		buffer_reserve(pb,65536);
+		strm.next_out=pb->data+pb->size;
+		strm.avail_out=pb->alloc-pb->size > (1<<30) ?
+			(1<<30) : pb->alloc-pb->size;
+		{
+			unsigned int before=strm.avail_out;
+			zerr=deflate(&strm,flush);
+			pb->size+=before-strm.avail_out;
+		}
+		if(zerr!=Z_OK && zerr!=Z_STREAM_END && zerr!=Z_BUF_ERROR)
+			errx(1, "deflate, zerr = %d", zerr);
+	} while(zerr!=Z_STREAM_END);
+
+	deflateEnd(&strm);
+}
+
+/* Assemble a complete patch from the three uncompressed blocks. */
+static void encode_patch(PatchBuffer *out,int codec,off_t newsize,
+		PatchBuffer *ctrl,u_char *db,off_t dblen,u_char *eb,off_t eblen)
+{
+	u_char header[BSDIFF41_HEADER_SIZE];
+	off_t header_size,ctrl_end,diff_end;
+	void (*append)(PatchBuffer*,u_char*,off_t);
+
+	/* Header is
+		0	8	 "BSDIFF40" or "BSDIFF41"
+		8	8	length of compressed ctrl block
+		16	8	length of compressed diff block
+		24	8	length of new file
+	   and for BSDIFF41 only
+		32	8	codec used for all three blocks */
+	/* File is
+		0	32/40	Header
+		??	??	Compressed ctrl block
+		??	??	Compressed diff block
+		??	??	Compressed extra block */
+	if(codec==BSDIFF_CODEC_BZIP2) {
+		memcpy(header,"BSDIFF40",8);
+		header_size=BSDIFF40_HEADER_SIZE;
+		append=buffer_append_bz2;
+	} else {
+		memcpy(header,"BSDIFF41",8);
+		offtout(codec, header + 32);
+		header_size=BSDIFF41_HEADER_SIZE;
+		append=buffer_append_deflate;
+	};
+	offtout(0, header + 8);
+	offtout(0, header + 16);
+	offtout(newsize, header + 24);
+
+	out->size=0;
+	buffer_append(out, header, header_size);
+	append(out,ctrl->data,ctrl->size);
+	ctrl_end=out->size;
+	append(out,db,dblen);
+	diff_end=out->size;
+	append(out,eb,eblen);
+
+	/* Fill in the block sizes */
+	offtout(ctrl_end-header_size, out->data + 8);
+	offtout(diff_end-ctrl_end, out->data + 16);
+}
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, new, newsize are arguments; we don't load this
 //      data from files.  old and new are owned by the caller; we
 //      don't free them at the end.
 //
-//    - the "I" block of memory is owned by the caller, who passes a
-//      pointer to *I, which can be NULL.  This way if we call
+//    - the suffix array is owned by the caller, who passes a
+//      pointer to *SAP, which can be NULL.  This way if we call
 //      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//      the suffix sort the first time.
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename)
+//    - the patch is built in memory and returned in a malloc'ed
+//      buffer, so callers running several diffs at once don't need
+//      temp files.  (bsdiff() below writes it to a file.)  The ctrl
+//      block is collected uncompressed and compressed at the end
+//      along with the diff and extra blocks.
+//
+//    - the blocks can be compressed with deflate instead of bzip2
+//      (see BSDIFF_CODEC_* in bsdiff.h).
+//
+int bsdiff_to_buffer(u_char* old, off_t oldsize, SuffixArray** SAP,
+                     u_char* new, off_t newsize, int codec,
+                     u_char** patch, off_t* patch_size)
 {
-	int fd;
-	off_t *I;
+	SuffixArray *I;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -234,50 +449,23 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	off_t i;
 	off_t dblen,eblen;
 	u_char *db,*eb;
-	u_char buf[8];
-	u_char header[32];
-	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
-
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+	u_char buf[24];
+	PatchBuffer ctrl,out;
+
+        if (*SAP == NULL) {
+            if ((*SAP = BuildSuffixArray(old, oldsize)) == NULL)
+                err(1, NULL);
         }
-        I = *IP;
+        I = *SAP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
 		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
 	dblen=0;
 	eblen=0;
+	memset(&ctrl,0,sizeof(ctrl));
+	memset(&out,0,sizeof(out));
 
-	/* Create the patch file */
-	if ((pf = fopen(patch_filename, "w")) == NULL)
-              err(1, "%s", patch_filename);
-
-	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
-		24	8	length of new file */
-	/* File is
-		0	32	Header
-		32	??	Bzip2ed ctrl block
-		??	??	Bzip2ed diff block
-		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
-
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+	/* Compute the differences, collecting ctrl as we go */
 	scan=0;len=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<newsize) {
@@ -341,70 +529,62 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 			eblen+=(scan-lenb)-(lastscan+lenf);
 
 			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			offtout((scan-lenb)-(lastscan+lenf),buf+8);
+			offtout((pos-lenb)-(lastpos+lenf),buf+16);
+			buffer_append(&ctrl,buf,24);
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
 			lastoffset=pos-scan;
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed ctrl data */
-	if ((len = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(len-32, header + 8);
-
-	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed diff data */
-	if ((newsize = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(newsize - len, header + 16);
-
-	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Seek to the beginning, write the header, and close the file */
-	if (fseeko(pf, 0, SEEK_SET))
-		err(1, "fseeko");
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
-	if (fclose(pf))
-		err(1, "fclose");
+
+	if(codec==BSDIFF_CODEC_AUTO) {
+		/* Deflate unpacks several times faster than bzip2 on the
+		   device; take it unless the patch gets much bigger. */
+		PatchBuffer bz2;
+		memset(&bz2,0,sizeof(bz2));
+		encode_patch(&bz2,BSDIFF_CODEC_BZIP2,newsize,&ctrl,db,dblen,eb,eblen);
+		encode_patch(&out,BSDIFF_CODEC_DEFLATE,newsize,&ctrl,db,dblen,eb,eblen);
+		if(out.size-bz2.size > bz2.size*BSDIFF_AUTO_MAX_GROWTH/100) {
+			free(out.data);
+			out=bz2;
+		} else {
+			free(bz2.data);
+		};
+	} else {
+		encode_patch(&out,codec,newsize,&ctrl,db,dblen,eb,eblen);
+	};
 
 	/* Free the memory we used */
+	free(ctrl.data);
 	free(db);
 	free(eb);
 
+	*patch=out.data;
+	*patch_size=out.size;
+	return 0;
+}
+
+// Writes the output of bsdiff_to_buffer() to patch_filename.
+int bsdiff(u_char* old, off_t oldsize, SuffixArray** SAP, u_char* new, off_t newsize,
+           const char* patch_filename)
+{
+	u_char *patch;
+	off_t patch_size;
+	FILE *pf;
+
+	if(bsdiff_to_buffer(old,oldsize,SAP,new,newsize,BSDIFF_CODEC_BZIP2,
+			&patch,&patch_size)!=0)
+		return 1;
+
+	if ((pf = fopen(patch_filename, "w")) == NULL)
+              err(1, "%s", patch_filename);
+	if (fwrite(patch, 1, patch_size, pf) != (size_t)patch_size)
+		err(1, "fwrite(%s)", patch_filename);
+	if (fclose(pf))
+		err(1, "fclose");
+
+	free(patch);
 	return 0;
 }
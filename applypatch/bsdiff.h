@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BUILD_TOOLS_APPLYPATCH_BSDIFF_H
+#define _BUILD_TOOLS_APPLYPATCH_BSDIFF_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// A suffix array over bsdiff's source ("old") data.  It only depends
+// on the source, so it's built once and reused for every target diffed
+// against that source.  Entry 0 is the empty suffix; the remaining
+// 'size' entries are the suffixes of the source in sorted order.
+//
+// Exactly one of I and I32 is set, depending on which backend built it.
+typedef struct {
+  off_t size;
+  off_t* I;           // qsufsort:  8 bytes per entry
+  int32_t* I32;       // SA-IS:     4 bytes per entry
+} SuffixArray;
+
+typedef enum {
+  SUFFIX_SORT_AUTO = 0,     // SA-IS if the source fits 32-bit indices
+  SUFFIX_SORT_QSUFSORT,     // Larsson-Sadakane, O(n log n), 16 bytes/byte
+  SUFFIX_SORT_SAIS,         // Nong-Zhang-Chan SA-IS, O(n), ~4 bytes/byte
+} SuffixSortBackend;
+
+// Picks the backend used by later BuildSuffixArray() calls.  Every
+// backend produces the same order, so patches don't depend on this.
+void SetSuffixSortBackend(SuffixSortBackend backend);
+
+SuffixArray* BuildSuffixArray(unsigned char* old, off_t oldsize);
+void FreeSuffixArray(SuffixArray* sa);
+
+// Codecs for the ctrl, diff and extra blocks of a patch.  bzip2
+// patches are written as BSDIFF40, which every applypatch understands;
+// anything else needs a BSDIFF41 header, which names the codec.
+#define BSDIFF_CODEC_BZIP2     0
+#define BSDIFF_CODEC_DEFLATE   1   // raw deflate (zlib, windowBits -15)
+#define BSDIFF_CODEC_AUTO     -1   // for bsdiff_to_buffer() only; see below
+
+#define BSDIFF40_HEADER_SIZE  32
+#define BSDIFF41_HEADER_SIZE  40
+
+// BSDIFF_CODEC_AUTO picks deflate unless that makes the patch more
+// than this many percent bigger than bzip2 would.
+#define BSDIFF_AUTO_MAX_GROWTH  10
+
+// Builds a patch from old to new in a malloc'ed buffer, returned in
+// *patch and *patch_size, compressing its blocks with 'codec'.  *SAP
+// may be NULL, in which case the suffix array for old is built and
+// left there for the next call.
+//
+// Separate calls may run concurrently as long as they don't share a
+// NULL *SAP.
+int bsdiff_to_buffer(unsigned char* old, off_t oldsize, SuffixArray** SAP,
+                     unsigned char* new, off_t newsize, int codec,
+                     unsigned char** patch, off_t* patch_size);
+
+// Same as bsdiff_to_buffer() with BSDIFF_CODEC_BZIP2, but writes the
+// patch to patch_filename.
+int bsdiff(unsigned char* old, off_t oldsize, SuffixArray** SAP,
+           unsigned char* new, off_t newsize, const char* patch_filename);
+
+// in sais.c.  Fills SA[0..size] with the suffix array of data,
+// including the empty suffix at SA[0].  Returns 0 on success.
+int sais(const unsigned char* data, int32_t size, int32_t* SA);
+
+#endif  // _BUILD_TOOLS_APPLYPATCH_BSDIFF_H
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Host tool for comparing bsdiff's suffix sort backends.
+//
+//   bsdiff_bench <oldfile> <newfile>
+//
+// Each backend runs in its own child process so the peak RSS numbers
+// don't pollute each other.  The resulting patches must be identical;
+// the tool exits nonzero if they aren't.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bsdiff.h"
+
+static const struct {
+  SuffixSortBackend backend;
+  const char* name;
+} kBackends[] = {
+  { SUFFIX_SORT_QSUFSORT, "qsufsort" },
+  { SUFFIX_SORT_SAIS,     "sais" },
+};
+#define NUM_BACKENDS (sizeof(kBackends) / sizeof(kBackends[0]))
+
+static unsigned char* ReadFile(const char* filename, off_t* size) {
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    fprintf(stderr, "failed to stat \"%s\": %s\n", filename, strerror(errno));
+    return NULL;
+  }
+  unsigned char* data = malloc(st.st_size > 0 ? st.st_size : 1);
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "failed to open \"%s\": %s\n", filename, strerror(errno));
+    free(data);
+    return NULL;
+  }
+  if (fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+    fprintf(stderr, "failed to read \"%s\"\n", filename);
+    fclose(f);
+    free(data);
+    return NULL;
+  }
+  fclose(f);
+  *size = st.st_size;
+  return data;
+}
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Runs in the child: sort, diff, and print timings.
+static int RunBackend(int which, unsigned char* old, off_t oldsize,
+                      unsigned char* new, off_t newsize,
+                      const char* patch_filename) {
+  SetSuffixSortBackend(kBackends[which].backend);
+
+  double start = Now();
+  SuffixArray* sa = BuildSuffixArray(old, oldsize);
+  if (sa == NULL) {
+    fprintf(stderr, "%s: failed to build suffix array\n",
+            kBackends[which].name);
+    return 1;
+  }
+  double sorted = Now();
+  if (bsdiff(old, oldsize, &sa, new, newsize, patch_filename) != 0) {
+    fprintf(stderr, "%s: bsdiff failed\n", kBackends[which].name);
+    return 1;
+  }
+  double done = Now();
+
+  printf("%-10s sort %8.3f s   diff %8.3f s   (%s entries)\n",
+         kBackends[which].name, sorted - start, done - sorted,
+         sa->I32 != NULL ? "32-bit" : "off_t");
+  fflush(stdout);
+  FreeSuffixArray(sa);
+  return 0;
+}
+
+static int SameContents(const char* a, const char* b) {
+  off_t asize, bsize;
+  unsigned char* adata = ReadFile(a, &asize);
+  unsigned char* bdata = ReadFile(b, &bsize);
+  int same = adata != NULL && bdata != NULL && asize == bsize &&
+             memcmp(adata, bdata, asize) == 0;
+  free(adata);
+  free(bdata);
+  return same;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <oldfile> <newfile>\n", argv[0]);
+    return 2;
+  }
+
+  off_t oldsize, newsize;
+  unsigned char* old = ReadFile(argv[1], &oldsize);
+  unsigned char* new = ReadFile(argv[2], &newsize);
+  if (old == NULL || new == NULL) return 1;
+
+  printf("old %ld bytes, new %ld bytes\n", (long)oldsize, (long)newsize);
+
+  char patch_filenames[NUM_BACKENDS][32];
+  int i;
+  int result = 0;
+  for (i = 0; i < (int)NUM_BACKENDS; ++i) {
+    strcpy(patch_filenames[i], "/tmp/bsdiff_bench-XXXXXX");
+    int fd = mkstemp(patch_filenames[i]);
+    if (fd < 0) {
+      fprintf(stderr, "mkstemp failed: %s\n", strerror(errno));
+      return 1;
+    }
+    close(fd);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "fork failed: %s\n", strerror(errno));
+      return 1;
+    }
+    if (pid == 0) {
+      _exit(RunBackend(i, old, oldsize, new, newsize, patch_filenames[i]));
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "%s: child failed\n", kBackends[i].name);
+      result = 1;
+      continue;
+    }
+    printf("%-10s peak rss %ld kB\n", kBackends[i].name, usage.ru_maxrss);
+  }
+
+  for (i = 1; i < (int)NUM_BACKENDS && result == 0; ++i) {
+    if (!SameContents(patch_filenames[0], patch_filenames[i])) {
+      fprintf(stderr, "patch from %s differs from %s\n",
+              kBackends[i].name, kBackends[0].name);
+      result = 1;
+    }
+  }
+  if (result == 0) printf("patches are identical\n");
+
+  for (i = 0; i < (int)NUM_BACKENDS; ++i) {
+    unlink(patch_filenames[i]);
+  }
+  free(old);
+  free(new);
+  return result;
+}
@@ -20,16 +20,21 @@
 // applypatch with the -l option will display the bsdiff license
 // notice.
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 
 #include <bzlib.h>
+#include <zlib.h>
 
 #include "mincrypt/sha.h"
+#include "hashutils/sha1.h"
 #include "applypatch.h"
+#include "bsdiff.h"
 
 void ShowBSDiffLicense() {
     puts("The bsdiff library used herein is:\n"
@@ -92,37 +97,152 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
         }
         if (stream->avail_out > 0) {
             printf("need %d more bytes\n", stream->avail_out);
+            if (bzerr == BZ_STREAM_END || stream->avail_in == 0) {
+                // nothing more is coming
+                return -1;
+            }
         }
     }
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+int FillInflateBuffer(unsigned char* buffer, int size, z_stream* stream) {
+    stream->next_out = buffer;
+    stream->avail_out = size;
+    while (stream->avail_out > 0) {
+        int zerr = inflate(stream, Z_NO_FLUSH);
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            printf("zlib error %d inflating\n", zerr);
+            return -1;
+        }
+        if (stream->avail_out > 0) {
+            printf("need %d more bytes\n", stream->avail_out);
+            if (zerr == Z_STREAM_END || stream->avail_in == 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// One of the three compressed blocks of a patch, read with whichever
+// codec the header names.
+typedef struct {
+    int codec;
+    bz_stream bz;
+    z_stream z;
+} PatchStream;
+
+static int OpenPatchStream(PatchStream* ps, int codec,
+                           const char* data, ssize_t len, const char* name) {
+    memset(ps, 0, sizeof(*ps));
+    ps->codec = codec;
+    if (codec == BSDIFF_CODEC_BZIP2) {
+        ps->bz.next_in = (char*)data;
+        ps->bz.avail_in = len;
+        int bzerr = BZ2_bzDecompressInit(&ps->bz, 0, 0);
+        if (bzerr != BZ_OK) {
+            printf("failed to bzinit %s stream (%d)\n", name, bzerr);
+            return -1;
+        }
+    } else {
+        ps->z.next_in = (unsigned char*)data;
+        ps->z.avail_in = len;
+        int zerr = inflateInit2(&ps->z, -15);
+        if (zerr != Z_OK) {
+            printf("failed to inflateInit %s stream (%d)\n", name, zerr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int ReadPatchStream(PatchStream* ps, unsigned char* buffer, int size) {
+    if (ps->codec == BSDIFF_CODEC_BZIP2) {
+        return FillBuffer(buffer, size, &ps->bz);
+    }
+    return FillInflateBuffer(buffer, size, &ps->z);
+}
+
+static void ClosePatchStream(PatchStream* ps) {
+    if (ps->codec == BSDIFF_CODEC_BZIP2) {
+        BZ2_bzDecompressEnd(&ps->bz);
+    } else {
+        inflateEnd(&ps->z);
+    }
+}
+
+// Output is assembled in windows of this many bytes, which are passed
+// to the sink (and SHA) as each one fills.  This bounds how much of
+// the target we hold in memory regardless of the size of the file.
+#define BSPATCH_WINDOW_SIZE 32768
+
+// dst[i] += src[i] for i in [0, len).  Bytes are added eight at a
+// time: the low seven bits of each byte are summed with the carry out
+// of bit 6 landing in bit 7, then bit 7 is fixed up with an xor so no
+// carry crosses into the neighboring byte.
+static void AddBytes(unsigned char* dst, const unsigned char* src, size_t len) {
+    const uint64_t kLow7 = 0x7f7f7f7f7f7f7f7fULL;
+    const uint64_t kHigh = 0x8080808080808080ULL;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst+i, 8);
+        memcpy(&b, src+i, 8);
+        a = ((a & kLow7) + (b & kLow7)) ^ ((a ^ b) & kHigh);
+        memcpy(dst+i, &a, 8);
+    }
+    for (; i < len; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+// Add old_data[oldpos, oldpos+len) into dst, skipping the parts of
+// that range that fall outside the old data.
+static void AddOldData(unsigned char* dst, const unsigned char* old_data,
+                       ssize_t old_size, off_t oldpos, off_t len) {
+    // Compare before subtracting or negating, so that a corrupt oldpos
+    // can't overflow.
+    if (oldpos >= old_size || oldpos <= -len) return;
+    off_t start = oldpos < 0 ? -oldpos : 0;
+    off_t end = (old_size - oldpos < len) ? old_size - oldpos : len;
+    if (start < end) {
+        AddBytes(dst + start, old_data + oldpos + start, end - start);
+    }
+}
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
+typedef struct {
+    unsigned char* data;
+    ssize_t pos;
+    ssize_t size;
+} BufferSinkInfo;
+
+static ssize_t BufferSink(unsigned char* data, ssize_t len, void* token) {
+    BufferSinkInfo* bsi = (BufferSinkInfo*)token;
+    if (bsi->size - bsi->pos < len) {
         return -1;
     }
+    memcpy(bsi->data + bsi->pos, data, len);
+    bsi->pos += len;
+    return len;
+}
 
-    if (sink(new_data, new_size, token) < new_size) {
+static int FlushWindow(unsigned char* window, ssize_t len,
+                       SinkFn sink, void* token, Sha1Ctx* ctx) {
+    if (len == 0) return 0;
+    if (sink(window, len, token) < len) {
         printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
+        return -1;
     }
     if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+        Sha1Update(ctx, window, len);
     }
-    free(new_data);
-
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, Sha1Ctx* ctx) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -134,110 +254,141 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // with control block a set of triples (x,y,z) meaning "add x bytes
     // from oldfile to x bytes from the diff block; copy y bytes from the
     // extra block; seek forwards in oldfile by z bytes".
-
+    //
+    // A "BSDIFF41" patch has the same layout but an eight-byte codec
+    // number at offset 32 (see BSDIFF_CODEC_* in bsdiff.h); the three
+    // blocks start at 40 and are compressed with that codec instead
+    // of bzip2.
+    //
+    // The three blocks are decompressed in step, and the output is
+    // produced one window at a time.
+
+    if (patch->size < patch_offset + BSDIFF40_HEADER_SIZE) {
+        printf("patch too short to contain bsdiff header\n");
+        return 1;
+    }
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
+    ssize_t header_size;
+    int codec;
+    if (memcmp(header, "BSDIFF40", 8) == 0) {
+        header_size = BSDIFF40_HEADER_SIZE;
+        codec = BSDIFF_CODEC_BZIP2;
+    } else if (memcmp(header, "BSDIFF41", 8) == 0 &&
+               patch->size >= patch_offset + BSDIFF41_HEADER_SIZE) {
+        header_size = BSDIFF41_HEADER_SIZE;
+        codec = offtin(header+32);
+        if (codec != BSDIFF_CODEC_BZIP2 && codec != BSDIFF_CODEC_DEFLATE) {
+            printf("unknown bsdiff patch codec %d\n", codec);
+            return 1;
+        }
+    } else {
         printf("corrupt bsdiff patch file header (magic number)\n");
         return 1;
     }
 
-    ssize_t ctrl_len, data_len;
+    ssize_t ctrl_len, data_len, new_size;
     ctrl_len = offtin(header+8);
     data_len = offtin(header+16);
-    *new_size = offtin(header+24);
+    new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (ctrl_len < 0 || data_len < 0 || new_size < 0 ||
+        patch_offset + header_size + ctrl_len + data_len > patch->size) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
 
-    int bzerr;
+    int result = 1;
+    const char* blocks = patch->data + patch_offset + header_size;
 
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
+    PatchStream cstream, dstream, estream;
+    if (OpenPatchStream(&cstream, codec, blocks, ctrl_len, "control") != 0) {
+        return 1;
     }
-
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
+    if (OpenPatchStream(&dstream, codec, blocks + ctrl_len, data_len,
+                        "diff") != 0) {
+        ClosePatchStream(&cstream);
+        return 1;
     }
-
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
+    if (OpenPatchStream(&estream, codec, blocks + ctrl_len + data_len,
+                        patch->size - (patch_offset + header_size +
+                                       ctrl_len + data_len),
+                        "extra") != 0) {
+        ClosePatchStream(&cstream);
+        ClosePatchStream(&dstream);
+        return 1;
     }
 
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
-        return 1;
+    unsigned char* window = malloc(BSPATCH_WINDOW_SIZE);
+    if (window == NULL) {
+        printf("failed to allocate patch window\n");
+        goto done;
     }
+    ssize_t fill = 0;
 
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (ReadPatchStream(&cstream, buf, 24) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
         ctrl[2] = offtin(buf+16);
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            ctrl[0] > new_size - newpos ||
+            ctrl[1] > new_size - newpos - ctrl[0]) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
-
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
+        // oldpos never needs to leave [-new_size, old_size+new_size];
+        // keeping it there keeps the arithmetic on it from overflowing.
+        off_t next_oldpos = oldpos + ctrl[0];
+        if (ctrl[2] < -new_size - next_oldpos ||
+            ctrl[2] > old_size + new_size - next_oldpos) {
+            printf("corrupt patch (old file seek out of range)\n");
+            goto done;
         }
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+        // Read diff string and add old data to it
+        off_t left = ctrl[0];
+        while (left > 0) {
+            off_t n = BSPATCH_WINDOW_SIZE - fill;
+            if (n > left) n = left;
+            if (ReadPatchStream(&dstream, window + fill, n) != 0) {
+                printf("error while reading diff stream\n");
+                goto done;
+            }
+            AddOldData(window + fill, old_data, old_size, oldpos, n);
+            fill += n;
+            oldpos += n;
+            left -= n;
+            if (fill == BSPATCH_WINDOW_SIZE) {
+                if (FlushWindow(window, fill, sink, token, ctx) != 0) goto done;
+                fill = 0;
             }
         }
-
-        // Adjust pointers
         newpos += ctrl[0];
-        oldpos += ctrl[0];
-
-        // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
-            printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        left = ctrl[1];
+        while (left > 0) {
+            off_t n = BSPATCH_WINDOW_SIZE - fill;
+            if (n > left) n = left;
+            if (ReadPatchStream(&estream, window + fill, n) != 0) {
+                printf("error while reading extra stream\n");
+                goto done;
+            }
+            fill += n;
+            left -= n;
+            if (fill == BSPATCH_WINDOW_SIZE) {
+                if (FlushWindow(window, fill, sink, token, ctx) != 0) goto done;
+                fill = 0;
+            }
         }
 
         // Adjust pointers
@@ -245,8 +396,45 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         oldpos += ctrl[2];
     }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
+    if (FlushWindow(window, fill, sink, token, ctx) != 0) goto done;
+    result = 0;
+
+done:
+    free(window);
+    ClosePatchStream(&cstream);
+    ClosePatchStream(&dstream);
+    ClosePatchStream(&estream);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    if (patch->size < patch_offset + BSDIFF40_HEADER_SIZE) {
+        printf("patch too short to contain bsdiff header\n");
+        return 1;
+    }
+    *new_size = offtin((unsigned char*)patch->data + patch_offset + 24);
+    if (*new_size < 0) {
+        printf("corrupt patch file header (data lengths)\n");
+        return 1;
+    }
+
+    BufferSinkInfo bsi;
+    bsi.data = malloc(*new_size > 0 ? *new_size : 1);
+    if (bsi.data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+    bsi.pos = 0;
+    bsi.size = *new_size;
+
+    if (ApplyBSDiffPatch(old_data, old_size, patch, patch_offset,
+                         BufferSink, &bsi, NULL) != 0) {
+        free(bsi.data);
+        return 1;
+    }
+    *new_data = bsi.data;
     return 0;
 }
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,7 +12,91 @@
 
 #include "applypatch.h"
 
-static int EliminateOpenFiles(char** files, int file_count) {
+// We're allowed to delete unopened regular files in any of these
+// directories.
+static const char* expendable_dirs[] = {"/cache", "/cache/recovery/otatest"};
+#define NUM_EXPENDABLE_DIRS (sizeof(expendable_dirs)/sizeof(expendable_dirs[0]))
+
+typedef struct {
+  char* name;
+  off_t bytes;        // space we'd get back (allocated blocks)
+  time_t mtime;
+} CacheFile;
+
+// What we know about /cache, built by ScanCache() and kept until the
+// directories change under us.  Candidates are sorted by size, oldest
+// first among equal sizes, so a request for space can be planned with
+// a binary search instead of trial and error.  Which files are open
+// isn't part of what's kept:  that changes without touching the
+// directories, so each request looks in /proc again.
+typedef struct {
+  int valid;
+  time_t dir_mtime[NUM_EXPENDABLE_DIRS];
+  CacheFile* files;
+  int count;
+  off_t* suffix_bytes;   // suffix_bytes[i] = sum of files[i..count-1].bytes
+} CacheIndex;
+
+static CacheIndex cache_index;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A set of paths, open-addressed on a string hash.
+typedef struct {
+  char** slots;
+  int alloc;          // power of two
+  int count;
+} PathSet;
+
+static unsigned int HashPath(const char* s) {
+  unsigned int h = 2166136261u;
+  for (; *s; ++s) {
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  }
+  return h;
+}
+
+static char** PathSetSlot(char** slots, int alloc, const char* path) {
+  unsigned int i = HashPath(path) & (alloc - 1);
+  while (slots[i] != NULL && strcmp(slots[i], path) != 0) {
+    i = (i + 1) & (alloc - 1);
+  }
+  return slots + i;
+}
+
+static void PathSetAdd(PathSet* set, const char* path) {
+  if ((set->count + 1) * 2 > set->alloc) {
+    int new_alloc = set->alloc ? set->alloc * 2 : 64;
+    char** slots = calloc(new_alloc, sizeof(char*));
+    int i;
+    for (i = 0; i < set->alloc; ++i) {
+      if (set->slots[i]) *PathSetSlot(slots, new_alloc, set->slots[i]) = set->slots[i];
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->alloc = new_alloc;
+  }
+  char** slot = PathSetSlot(set->slots, set->alloc, path);
+  if (*slot == NULL) {
+    *slot = strdup(path);
+    ++set->count;
+  }
+}
+
+static int PathSetContains(const PathSet* set, const char* path) {
+  return set->count > 0 && *PathSetSlot(set->slots, set->alloc, path) != NULL;
+}
+
+static void PathSetFree(PathSet* set) {
+  int i;
+  for (i = 0; i < set->alloc; ++i) free(set->slots[i]);
+  free(set->slots);
+  set->slots = NULL;
+  set->alloc = set->count = 0;
+}
+
+// Collect every /cache file that some process has open, with one
+// pass over /proc/*/fd.
+static int FindOpenCacheFiles(PathSet* open_files) {
   DIR* d;
   struct dirent* de;
   d = opendir("/proc");
@@ -48,19 +133,8 @@ static int EliminateOpenFiles(char** files, int file_count) {
       count = readlink(fd_path, link, sizeof(link)-1);
       if (count >= 0) {
         link[count] = '\0';
-
-        // This is inefficient, but it should only matter if there are
-        // lots of files in /cache, and lots of them are open (neither
-        // of which should be true, especially in recovery).
         if (strncmp(link, "/cache/", 7) == 0) {
-          int j;
-          for (j = 0; j < file_count; ++j) {
-            if (files[j] && strcmp(files[j], link) == 0) {
-              printf("%s is open by %s\n", link, de->d_name);
-              free(files[j]);
-              files[j] = NULL;
-            }
-          }
+          PathSetAdd(open_files, link);
         }
       }
     }
@@ -71,60 +145,164 @@ static int EliminateOpenFiles(char** files, int file_count) {
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
-  DIR* d;
-  struct dirent* de;
-  int size = 32;
-  *entries = 0;
-  *names = malloc(size * sizeof(char*));
+static int CompareCacheFiles(const void* a, const void* b) {
+  const CacheFile* fa = (const CacheFile*)a;
+  const CacheFile* fb = (const CacheFile*)b;
+  if (fa->bytes != fb->bytes) return fa->bytes < fb->bytes ? -1 : 1;
+  if (fa->mtime != fb->mtime) return fa->mtime < fb->mtime ? -1 : 1;
+  return 0;
+}
 
-  char path[FILENAME_MAX];
+static void FreeCacheIndex() {
+  int i;
+  for (i = 0; i < cache_index.count; ++i) free(cache_index.files[i].name);
+  free(cache_index.files);
+  free(cache_index.suffix_bytes);
+  memset(&cache_index, 0, sizeof(cache_index));
+}
 
-  // We're allowed to delete unopened regular files in any of these
-  // directories.
-  const char* dirs[2] = {"/cache", "/cache/recovery/otatest"};
+static void ComputeSuffixBytes() {
+  int i;
+  off_t total = 0;
+  for (i = cache_index.count - 1; i >= 0; --i) {
+    total += cache_index.files[i].bytes;
+    cache_index.suffix_bytes[i] = total;
+  }
+}
 
+// Returns 1 if files have come or gone in the expendable directories
+// since the index was built.
+static int CacheIndexStale() {
   unsigned int i;
-  for (i = 0; i < sizeof(dirs)/sizeof(dirs[0]); ++i) {
-    d = opendir(dirs[i]);
+  if (!cache_index.valid) return 1;
+  for (i = 0; i < NUM_EXPENDABLE_DIRS; ++i) {
+    struct stat st;
+    time_t mtime = (stat(expendable_dirs[i], &st) == 0) ? st.st_mtime : 0;
+    if (mtime != cache_index.dir_mtime[i]) return 1;
+  }
+  return 0;
+}
+
+static void ScanCache(const PathSet* open_files) {
+  FreeCacheIndex();
+
+  int size = 32;
+  cache_index.files = malloc(size * sizeof(CacheFile));
+
+  char path[FILENAME_MAX];
+  unsigned int i;
+  for (i = 0; i < NUM_EXPENDABLE_DIRS; ++i) {
+    struct stat st;
+    cache_index.dir_mtime[i] =
+        (stat(expendable_dirs[i], &st) == 0) ? st.st_mtime : 0;
+
+    DIR* d = opendir(expendable_dirs[i]);
     if (d == NULL) {
-      printf("error opening %s: %s\n", dirs[i], strerror(errno));
+      printf("error opening %s: %s\n", expendable_dirs[i], strerror(errno));
       continue;
     }
 
     // Look for regular files in the directory (not in any subdirectories).
+    struct dirent* de;
     while ((de = readdir(d)) != 0) {
-      strcpy(path, dirs[i]);
+      strcpy(path, expendable_dirs[i]);
       strcat(path, "/");
       strcat(path, de->d_name);
 
       // We can't delete CACHE_TEMP_SOURCE; if it's there we might have
       // restarted during installation and could be depending on it to
-      // be there.
-      if (strcmp(path, CACHE_TEMP_SOURCE) == 0) continue;
+      // be there.  The same goes for the journal of finished patches.
+      if (strcmp(path, CACHE_TEMP_SOURCE) == 0 ||
+          strcmp(path, CACHE_PATCH_JOURNAL) == 0) continue;
 
-      struct stat st;
-      if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
-        if (*entries >= size) {
-          size *= 2;
-          *names = realloc(*names, size * sizeof(char*));
-        }
-        (*names)[(*entries)++] = strdup(path);
+      if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+      if (PathSetContains(open_files, path)) {
+        printf("%s is open\n", path);
+        continue;
+      }
+
+      if (cache_index.count >= size) {
+        size *= 2;
+        cache_index.files = realloc(cache_index.files, size * sizeof(CacheFile));
       }
+      CacheFile* f = cache_index.files + cache_index.count++;
+      f->name = strdup(path);
+      f->bytes = (off_t)st.st_blocks * 512;
+      f->mtime = st.st_mtime;
     }
 
     closedir(d);
   }
 
-  printf("%d regular files in deletable directories\n", *entries);
+  qsort(cache_index.files, cache_index.count, sizeof(CacheFile),
+        CompareCacheFiles);
+  cache_index.suffix_bytes = malloc((cache_index.count + 1) * sizeof(off_t));
+  ComputeSuffixBytes();
+  cache_index.valid = 1;
 
-  if (EliminateOpenFiles(*names, *entries) < 0) {
-    return -1;
+  printf("%d deletable files on /cache\n", cache_index.count);
+}
+
+// Drop files that have been opened since the index was built.
+static void RemoveOpenFiles(const PathSet* open_files) {
+  int i, n = 0;
+  for (i = 0; i < cache_index.count; ++i) {
+    if (PathSetContains(open_files, cache_index.files[i].name)) {
+      printf("%s is open\n", cache_index.files[i].name);
+      free(cache_index.files[i].name);
+    } else {
+      cache_index.files[n++] = cache_index.files[i];
+    }
+  }
+  if (n != cache_index.count) {
+    cache_index.count = n;
+    ComputeSuffixBytes();
+  }
+}
+
+// Decide which files to delete to get back 'deficit' bytes.  If one
+// file is big enough, it's the smallest (then oldest) such file;
+// otherwise it's the fewest files, biggest first, that cover it.
+// Sets files[*first..*last) as the plan.  Returns -1 if even
+// deleting everything won't do.
+static int PlanDeletion(off_t deficit, int* first, int* last) {
+  int n = cache_index.count;
+  if (n == 0 || cache_index.suffix_bytes[0] < deficit) return -1;
+
+  // Smallest single file with bytes >= deficit.
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (cache_index.files[mid].bytes >= deficit) hi = mid; else lo = mid + 1;
+  }
+  if (lo < n) {
+    *first = lo;
+    *last = lo + 1;
+    return 0;
   }
 
+  // Largest i whose suffix (the biggest files) covers the deficit.
+  lo = 0;
+  hi = n - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (cache_index.suffix_bytes[mid] >= deficit) lo = mid; else hi = mid - 1;
+  }
+  *first = lo;
+  *last = n;
   return 0;
 }
 
+static void RemoveFromIndex(int first, int last) {
+  int i;
+  for (i = first; i < last; ++i) free(cache_index.files[i].name);
+  memmove(cache_index.files + first, cache_index.files + last,
+          (cache_index.count - last) * sizeof(CacheFile));
+  cache_index.count -= last - first;
+  ComputeSuffixBytes();
+}
+
 int MakeFreeSpaceOnCache(size_t bytes_needed) {
   size_t free_now = FreeSpaceForFile("/cache");
   printf("%ld bytes free on /cache (%ld needed)\n",
@@ -134,39 +312,67 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
     return 0;
   }
 
-  char** names;
-  int entries;
+  pthread_mutex_lock(&cache_lock);
 
-  if (FindExpendableFiles(&names, &entries) < 0) {
+  PathSet open_files;
+  memset(&open_files, 0, sizeof(open_files));
+  if (FindOpenCacheFiles(&open_files) < 0) {
+    pthread_mutex_unlock(&cache_lock);
     return -1;
   }
 
-  if (entries == 0) {
-    // nothing we can delete to free up space!
-    printf("no files can be deleted to free space on /cache\n");
-    return -1;
-  }
+  // Try at most twice: if the plan from a cached index falls short,
+  // something changed that we didn't notice, so rescan and try again.
+  int attempt;
+  for (attempt = 0; attempt < 2 && free_now < bytes_needed; ++attempt) {
+    if (attempt > 0 || CacheIndexStale()) {
+      ScanCache(&open_files);
+    } else {
+      RemoveOpenFiles(&open_files);
+    }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
+    int first, last;
+    if (PlanDeletion(bytes_needed - free_now, &first, &last) < 0) {
+      if (cache_index.count == 0) {
+        // nothing we can delete to free up space!
+        printf("no files can be deleted to free space on /cache\n");
+      } else {
+        printf("deleting every expendable file on /cache won't be enough\n");
+      }
+      if (attempt > 0 || CacheIndexStale()) break;
+      continue;
+    }
 
-  int i;
-  for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
-      free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
+    // Whether or not it goes, a file we fail to delete has no
+    // business in the index any more; the rescan will find it again.
+    off_t freed = 0;
+    int i;
+    for (i = first; i < last; ++i) {
+      if (unlink(cache_index.files[i].name) == 0) {
+        printf("deleted %s\n", cache_index.files[i].name);
+        freed += cache_index.files[i].bytes;
+      } else {
+        printf("failed to delete %s: %s\n",
+               cache_index.files[i].name, strerror(errno));
+      }
+    }
+    RemoveFromIndex(first, last);
+
+    // Our own deletions changed the directory; that doesn't make the
+    // rest of the index stale.
+    unsigned int d;
+    for (d = 0; d < NUM_EXPENDABLE_DIRS; ++d) {
+      struct stat st;
+      cache_index.dir_mtime[d] =
+          (stat(expendable_dirs[d], &st) == 0) ? st.st_mtime : 0;
     }
-  }
 
-  for (; i < entries; ++i) {
-    free(names[i]);
+    free_now = FreeSpaceForFile("/cache");
+    printf("freed %lld bytes; now %ld bytes free\n",
+           (long long)freed, (long)free_now);
   }
-  free(names);
+  PathSetFree(&open_files);
 
+  pthread_mutex_unlock(&cache_lock);
   return (free_now >= bytes_needed) ? 0 : -1;
 }
@@ -111,9 +111,15 @@
  *
  * After the header there are 'chunk count' bsdiff patches; the offset
  * of each from the beginning of the file is specified in the header.
+ * By default these are BSDIFF40 (bzip2) patches.  With "-c deflate"
+ * they're BSDIFF41 patches whose blocks are raw deflate streams, which
+ * applypatch unpacks much faster; "-c auto" makes that choice per
+ * chunk, keeping bzip2 where deflate would cost noticeably more space.
+ * Older versions of applypatch can only apply BSDIFF40.
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -122,6 +128,7 @@
 #include <sys/types.h>
 
 #include "zlib.h"
+#include "bsdiff.h"
 #include "imgdiff.h"
 #include "utils.h"
 
@@ -135,7 +142,7 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  SuffixArray* I;       // used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -170,9 +177,6 @@ static int fileentry_compare(const void* a, const void* b) {
   }
 }
 
-// from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename);
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -590,11 +594,14 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
   return -1;
 }
 
+// Codec for the bsdiff patches, from the -c option.
+static int patch_codec = BSDIFF_CODEC_BZIP2;
+
 /*
- * Given source and target chunks, compute a bsdiff patch between them
- * by running bsdiff in a subprocess.  Return the patch data, placing
- * its length in *size.  Return NULL on failure.  We expect the bsdiff
- * program to be in the path.
+ * Given source and target chunks, compute a bsdiff patch between them.
+ * Return the patch data, placing its length in *size.  Return NULL on
+ * failure.  src->I must already be built (see BuildSourceIndexes) if
+ * more than one thread might be diffing against src.
  */
 unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   if (tgt->type == CHUNK_NORMAL) {
@@ -605,46 +612,25 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
     }
   }
 
-  char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-  mkstemp(ptemp);
-
-  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
+  unsigned char* data;
+  off_t data_size;
+  int r = bsdiff_to_buffer(src->data, src->len, &(src->I),
+                           tgt->data, tgt->len, patch_codec,
+                           &data, &data_size);
   if (r != 0) {
     printf("bsdiff() failed: %d\n", r);
     return NULL;
   }
 
-  struct stat st;
-  if (stat(ptemp, &st) != 0) {
-    printf("failed to stat patch file %s: %s\n",
-            ptemp, strerror(errno));
-    return NULL;
-  }
-
-  unsigned char* data = malloc(st.st_size);
-
-  if (tgt->type == CHUNK_NORMAL && tgt->len <= st.st_size) {
-    unlink(ptemp);
+  if (tgt->type == CHUNK_NORMAL && tgt->len <= data_size) {
+    free(data);
 
     tgt->type = CHUNK_RAW;
     *size = tgt->len;
     return tgt->data;
   }
 
-  *size = st.st_size;
-
-  FILE* f = fopen(ptemp, "rb");
-  if (f == NULL) {
-    printf("failed to open patch %s: %s\n", ptemp, strerror(errno));
-    return NULL;
-  }
-  if (fread(data, 1, st.st_size, f) != st.st_size) {
-    printf("failed to read patch %s: %s\n", ptemp, strerror(errno));
-    return NULL;
-  }
-  fclose(f);
-
-  unlink(ptemp);
+  *size = data_size;
 
   tgt->source_start = src->start;
   switch (tgt->type) {
@@ -660,6 +646,104 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   return data;
 }
 
+/*
+ * Run fn(i, cookie) for each i in [0, count) on a pool of threads, one
+ * per online CPU.  Items are handed out in order, but may finish in
+ * any order.
+ */
+typedef struct {
+  int count;
+  int next;
+  pthread_mutex_t lock;
+  void (*fn)(int, void*);
+  void* cookie;
+} WorkQueue;
+
+static void* WorkQueueThread(void* arg) {
+  WorkQueue* q = (WorkQueue*)arg;
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    int i = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    if (i >= q->count) break;
+    q->fn(i, q->cookie);
+  }
+  return NULL;
+}
+
+static void RunParallel(int count, void (*fn)(int, void*), void* cookie) {
+  WorkQueue q;
+  q.count = count;
+  q.next = 0;
+  q.fn = fn;
+  q.cookie = cookie;
+  pthread_mutex_init(&q.lock, NULL);
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > count) num_threads = count;
+
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  int started = 0;
+  long t;
+  for (t = 1; t < num_threads; ++t) {
+    if (pthread_create(threads+started, NULL, WorkQueueThread, &q) != 0) {
+      break;
+    }
+    ++started;
+  }
+  WorkQueueThread(&q);   // this thread works too
+  for (t = 0; t < started; ++t) {
+    pthread_join(threads[t], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&q.lock);
+}
+
+typedef struct {
+  ImageChunk* src;           // chunk to diff against
+  ImageChunk* tgt;
+  unsigned char* patch_data;
+  size_t patch_size;
+} PatchJob;
+
+static void BuildSourceIndexJob(int i, void* cookie) {
+  ImageChunk* src = ((ImageChunk**)cookie)[i];
+  if ((src->I = BuildSuffixArray(src->data, src->len)) == NULL) {
+    printf("failed to build suffix array (%d bytes)\n", (int)src->len);
+    exit(1);
+  }
+}
+
+/*
+ * Build the suffix array of every source chunk that some job will
+ * diff against, so the diffs themselves only read from shared source
+ * chunks.
+ */
+static void BuildSourceIndexes(PatchJob* jobs, int num_jobs) {
+  ImageChunk** sources = malloc(num_jobs * sizeof(ImageChunk*));
+  int num_sources = 0;
+  int i, j;
+  for (i = 0; i < num_jobs; ++i) {
+    ImageChunk* src = jobs[i].src;
+    if (jobs[i].tgt->type == CHUNK_NORMAL && jobs[i].tgt->len <= 160) {
+      continue;   // will be stored raw; never diffed
+    }
+    if (src->I != NULL) continue;
+    for (j = 0; j < num_sources; ++j) {
+      if (sources[j] == src) break;
+    }
+    if (j == num_sources) sources[num_sources++] = src;
+  }
+  RunParallel(num_sources, BuildSourceIndexJob, sources);
+  free(sources);
+}
+
+static void MakePatchJob(int i, void* cookie) {
+  PatchJob* job = ((PatchJob*)cookie) + i;
+  job->patch_data = MakePatch(job->src, job->tgt, &job->patch_size);
+}
+
 /*
  * Cause a gzip chunk to be treated as a normal chunk (ie, as a blob
  * of uninterpreted data).  The resulting patch will likely be about
@@ -772,19 +856,36 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
 }
 
 int main(int argc, char** argv) {
-  if (argc != 4 && argc != 5) {
-    usage:
-    printf("usage: %s [-z] <src-img> <tgt-img> <patch-file>\n",
-            argv[0]);
-    return 2;
-  }
-
+  const char* progname = argv[0];
   int zip_mode = 0;
 
-  if (strcmp(argv[1], "-z") == 0) {
-    zip_mode = 1;
-    --argc;
-    ++argv;
+  while (argc > 1 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-z") == 0) {
+      zip_mode = 1;
+      --argc;
+      ++argv;
+    } else if (strcmp(argv[1], "-c") == 0 && argc > 2) {
+      if (strcmp(argv[2], "bzip2") == 0) {
+        patch_codec = BSDIFF_CODEC_BZIP2;
+      } else if (strcmp(argv[2], "deflate") == 0) {
+        patch_codec = BSDIFF_CODEC_DEFLATE;
+      } else if (strcmp(argv[2], "auto") == 0) {
+        patch_codec = BSDIFF_CODEC_AUTO;
+      } else {
+        goto usage;
+      }
+      argc -= 2;
+      argv += 2;
+    } else {
+      goto usage;
+    }
+  }
+
+  if (argc != 4) {
+    usage:
+    printf("usage: %s [-z] [-c bzip2|deflate|auto] "
+           "<src-img> <tgt-img> <patch-file>\n", progname);
+    return 2;
   }
 
 
@@ -910,24 +1011,42 @@ int main(int argc, char** argv) {
   // data, in the case of deflate chunks).
 
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
-  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
-  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  PatchJob* jobs = malloc(num_tgt_chunks * sizeof(PatchJob));
   for (i = 0; i < num_tgt_chunks; ++i) {
+    ImageChunk* src;
     if (zip_mode) {
-      ImageChunk* src;
-      if (tgt_chunks[i].type == CHUNK_DEFLATE &&
+      if (tgt_chunks[i].type != CHUNK_DEFLATE ||
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
-                                 num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
-      } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+                                 num_src_chunks)) == NULL) {
+        src = src_chunks;
       }
     } else {
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      src = src_chunks+i;
+    }
+    jobs[i].src = src;
+    jobs[i].tgt = tgt_chunks+i;
+  }
+
+  // Each chunk's patch is independent of the others once the source
+  // indexes exist, so build those first and then diff all the chunks
+  // in parallel.  The results are collected in chunk order, so the
+  // output is the same as doing them one at a time.
+  BuildSourceIndexes(jobs, num_tgt_chunks);
+  RunParallel(num_tgt_chunks, MakePatchJob, jobs);
+
+  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
+  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (jobs[i].patch_data == NULL) {
+      printf("failed to construct patch for chunk %d\n", i);
+      return 1;
     }
+    patch_data[i] = jobs[i].patch_data;
+    patch_size[i] = jobs[i].patch_size;
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
   }
+  free(jobs);
 
   // Figure out how big the imgdiff file header is going to be, so
   // that we can correctly compute the offset of each bsdiff patch
@@ -103,9 +103,11 @@ patch_and_apply() {
 for i in $((zipinfo -1 $START_OTA_PACKAGE; zipinfo -1 $END_OTA_PACKAGE) | \
            sort | uniq -d | egrep -e '[.](apk|jar|zip)$'); do
   patch_and_apply $i -z
+  patch_and_apply $i -z -c auto
 done
 patch_and_apply boot.img
 patch_and_apply system/recovery.img
+patch_and_apply boot.img -c deflate
 
 
 # --------------- cleanup ----------------------
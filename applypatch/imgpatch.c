@@ -17,7 +17,9 @@
 // See imgdiff.c in this directory for a description of the patch file
 // format.
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -25,195 +27,438 @@
 
 #include "zlib.h"
 #include "mincrypt/sha.h"
+#include "hashutils/sha1.h"
 #include "applypatch.h"
 #include "imgdiff.h"
 #include "utils.h"
 
-/*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
- */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx) {
+// One entry per chunk of the patch, parsed from the header up front.
+// Deflate chunks are expanded, patched and recompressed into 'output'
+// by whichever thread claims them; everything is written to the sink
+// in chunk order by the thread that called ApplyImagePatch().
+typedef struct {
+    int type;
+
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_RAW: the data is patch->data[raw_offset, raw_offset+raw_len)
+    ssize_t raw_offset;
+    ssize_t raw_len;
+
+    // CHUNK_DEFLATE only
+    size_t expanded_len;
+    size_t target_len;
+    int level, method, windowBits, memLevel, strategy;
+
+    int state;               // JOB_PENDING, JOB_RUNNING, JOB_DONE
+    int status;              // 0 on success
+    unsigned char* output;   // recompressed chunk
+    ssize_t output_size;
+} ChunkJob;
+
+#define JOB_PENDING 0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+
+typedef struct {
+    const unsigned char* old_data;
+    ssize_t old_size;
+    const Value* patch;
+
+    ChunkJob* jobs;
+    int num_jobs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   // a job became claimable, or abort
+    pthread_cond_t done_cond;   // some job finished
+    int next_deflate;           // no pending deflate job before this
+    int consumer;               // chunk being written to the sink
+    int window;                 // how far past consumer workers may run
+    int abort;
+} ImagePatchPipeline;
+
+static int ParseChunkHeaders(const Value* patch, ChunkJob** jobs_out,
+                             int* num_jobs_out) {
     ssize_t pos = 12;
-    char* header = patch->data;
-    if (patch->size < 12) {
-        printf("patch too short to contain header\n");
+    int num_chunks = Read4(patch->data+8);
+    if (num_chunks < 0) {
+        printf("corrupt patch file header (chunk count)\n");
         return -1;
     }
-
-    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
-    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
-    // CHUNK_GZIP.)
-    if (memcmp(header, "IMGDIFF2", 8) != 0) {
-        printf("corrupt patch file header (magic number)\n");
+    ChunkJob* jobs = calloc(num_chunks > 0 ? num_chunks : 1, sizeof(ChunkJob));
+    if (jobs == NULL) {
+        printf("failed to allocate %d chunk records\n", num_chunks);
         return -1;
     }
 
-    int num_chunks = Read4(header+8);
-
     int i;
     for (i = 0; i < num_chunks; ++i) {
+        ChunkJob* job = jobs+i;
+
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto fail;
         }
-        int type = Read4(patch->data + pos);
+        job->type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (job->type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            job->src_start = Read8(normal_header);
+            job->src_len = Read8(normal_header+8);
+            job->patch_offset = Read8(normal_header+16);
+        } else if (job->type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            ssize_t data_len = Read4(raw_header);
+            job->raw_len = Read4(raw_header);
+            job->raw_offset = pos;
 
-            if (pos + data_len > patch->size) {
+            if (job->raw_len < 0 || pos + job->raw_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
-            }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
+                goto fail;
             }
-            pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+            pos += job->raw_len;
+        } else if (job->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %d bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
-            }
+            job->src_start = Read8(deflate_header);
+            job->src_len = Read8(deflate_header+8);
+            job->patch_offset = Read8(deflate_header+16);
+            job->expanded_len = Read8(deflate_header+24);
+            job->target_len = Read8(deflate_header+32);
+            job->level = Read4(deflate_header+40);
+            job->method = Read4(deflate_header+44);
+            job->windowBits = Read4(deflate_header+48);
+            job->memLevel = Read4(deflate_header+52);
+            job->strategy = Read4(deflate_header+56);
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, job->type);
+            goto fail;
+        }
+    }
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
-            }
+    *jobs_out = jobs;
+    *num_jobs_out = num_chunks;
+    return 0;
+
+fail:
+    free(jobs);
+    return -1;
+}
+
+/*
+ * Expand the source of a deflate chunk, apply its bsdiff patch, and
+ * recompress the result with the recorded encoder parameters into
+ * job->output.  Safe to run on any thread.  Returns 0 on success.
+ */
+static int PatchDeflateChunk(const unsigned char* old_data, ssize_t old_size,
+                             const Value* patch, ChunkJob* job) {
+    if (job->src_start > (size_t)old_size ||
+        job->src_len > (size_t)old_size - job->src_start) {
+        printf("deflate chunk source is outside the source file\n");
+        return -1;
+    }
+
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    unsigned char* expanded_source = malloc(job->expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %d bytes for expanded_source\n",
+               job->expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = job->src_len;
+    strm.next_in = (unsigned char*)(old_data + job->src_start);
+    strm.avail_out = job->expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        inflateEnd(&strm);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly.
+    if (strm.avail_out != 0) {
+        printf("source inflation short by %d bytes\n", strm.avail_out);
+        inflateEnd(&strm);
+        free(expanded_source);
+        return -1;
+    }
+    inflateEnd(&strm);
+
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    int result = ApplyBSDiffPatchMem(expanded_source, job->expanded_len,
+                                     patch, job->patch_offset,
+                                     &uncompressed_target_data,
+                                     &uncompressed_target_size);
+    free(expanded_source);
+    if (result != 0) {
+        return -1;
+    }
+
+    // Now compress the target data into the job's output buffer.  The
+    // compressed bits don't depend on how the output space is handed
+    // to deflate, so sizing the buffer up front gives the same result
+    // as streaming it out 32k at a time.
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    ret = deflateInit2(&strm, job->level, job->method, job->windowBits,
+                       job->memLevel, job->strategy);
+    if (ret != Z_OK) {
+        printf("failed to init deflate: %d\n", ret);
+        free(uncompressed_target_data);
+        return -1;
+    }
+
+    ssize_t alloc = deflateBound(&strm, uncompressed_target_size);
+    job->output = malloc(alloc);
+    job->output_size = 0;
+    do {
+        if (job->output == NULL) {
+            printf("failed to allocate %ld bytes for deflate output\n",
+                   (long)alloc);
+            deflateEnd(&strm);
+            free(uncompressed_target_data);
+            return -1;
+        }
+        strm.avail_out = alloc - job->output_size;
+        strm.next_out = job->output + job->output_size;
+        ret = deflate(&strm, Z_FINISH);
+        job->output_size = alloc - strm.avail_out;
+        if (ret != Z_STREAM_END) {
+            alloc *= 2;
+            job->output = realloc(job->output, alloc);
+        }
+    } while (ret != Z_STREAM_END);
+    deflateEnd(&strm);
+
+    free(uncompressed_target_data);
+    return 0;
+}
+
+// Claim the next pending deflate job that's within the window of the
+// consumer, or return NULL.  Call with the lock held.
+static ChunkJob* ClaimNextDeflate(ImagePatchPipeline* p) {
+    while (p->next_deflate < p->num_jobs &&
+           (p->jobs[p->next_deflate].type != CHUNK_DEFLATE ||
+            p->jobs[p->next_deflate].state != JOB_PENDING)) {
+        ++p->next_deflate;
+    }
+    if (p->next_deflate >= p->num_jobs ||
+        p->next_deflate > p->consumer + p->window) {
+        return NULL;
+    }
+    ChunkJob* job = p->jobs + p->next_deflate++;
+    job->state = JOB_RUNNING;
+    return job;
+}
+
+// Run a claimed job and publish the result.  Call with the lock held;
+// it's dropped while the job runs.
+static void RunDeflateJob(ImagePatchPipeline* p, ChunkJob* job) {
+    pthread_mutex_unlock(&p->lock);
+    int status = PatchDeflateChunk(p->old_data, p->old_size, p->patch, job);
+    pthread_mutex_lock(&p->lock);
+    job->status = status;
+    job->state = JOB_DONE;
+    pthread_cond_broadcast(&p->done_cond);
+}
+
+static void* DeflateWorker(void* cookie) {
+    ImagePatchPipeline* p = (ImagePatchPipeline*)cookie;
+    pthread_mutex_lock(&p->lock);
+    while (!p->abort) {
+        ChunkJob* job = ClaimNextDeflate(p);
+        if (job == NULL) {
+            if (p->next_deflate >= p->num_jobs) break;   // nothing left
+            pthread_cond_wait(&p->work_cond, &p->lock);
+            continue;
+        }
+        RunDeflateJob(p, job);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Return 0 on success.
+ *
+ * Deflate chunks are expanded, patched and recompressed on a pool of
+ * worker threads (one per CPU, none on a single-CPU device), a few
+ * chunks ahead of the one being written.  Output still goes to the
+ * sink strictly in chunk order, so the result is identical to
+ * patching one chunk at a time.
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, Sha1Ctx* ctx) {
+    char* header = patch->data;
+    if (patch->size < 12) {
+        printf("patch too short to contain header\n");
+        return -1;
+    }
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
+    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
+    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
+    // CHUNK_GZIP.)
+    if (memcmp(header, "IMGDIFF2", 8) != 0) {
+        printf("corrupt patch file header (magic number)\n");
+        return -1;
+    }
+
+    ImagePatchPipeline p;
+    memset(&p, 0, sizeof(p));
+    p.old_data = old_data;
+    p.old_size = old_size;
+    p.patch = patch;
+    if (ParseChunkHeaders(patch, &p.jobs, &p.num_jobs) != 0) {
+        return -1;
+    }
+
+    int i;
+    int num_deflate = 0;
+    for (i = 0; i < p.num_jobs; ++i) {
+        if (p.jobs[i].type == CHUNK_DEFLATE) ++num_deflate;
+    }
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 2) num_threads = 0;
+    if (num_threads > num_deflate) num_threads = num_deflate;
+    // Each chunk in flight holds its recompressed output until the
+    // writer gets to it; don't let workers get too far ahead.
+    p.window = num_threads * 2;
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.work_cond, NULL);
+    pthread_cond_init(&p.done_cond, NULL);
+
+    pthread_t* threads = malloc((num_threads > 0 ? num_threads : 1) *
+                                sizeof(pthread_t));
+    int started = 0;
+    while (started < num_threads &&
+           pthread_create(threads+started, NULL, DeflateWorker, &p) == 0) {
+        ++started;
+    }
+
+    int result = 0;
+    for (i = 0; i < p.num_jobs && result == 0; ++i) {
+        ChunkJob* job = p.jobs+i;
+
+        pthread_mutex_lock(&p.lock);
+        p.consumer = i;
+        pthread_cond_broadcast(&p.work_cond);
+        pthread_mutex_unlock(&p.lock);
+
+        if (job->type == CHUNK_NORMAL) {
+            if (job->src_start > (size_t)old_size ||
+                job->src_len > (size_t)old_size - job->src_start) {
+                printf("normal chunk source is outside the source file\n");
+                result = -1;
+            } else if (ApplyBSDiffPatch(old_data + job->src_start,
+                                        job->src_len, patch, job->patch_offset,
+                                        sink, token, ctx) != 0) {
+                printf("failed to patch chunk %d\n", i);
+                result = -1;
             }
-            // We should have filled the output buffer exactly.
-            if (strm.avail_out != 0) {
-                printf("source inflation short by %d bytes\n", strm.avail_out);
-                return -1;
+        } else if (job->type == CHUNK_RAW) {
+            Sha1Update(ctx, patch->data + job->raw_offset, job->raw_len);
+            if (sink((unsigned char*)patch->data + job->raw_offset,
+                     job->raw_len, token) != job->raw_len) {
+                printf("failed to write chunk %d raw data\n", i);
+                result = -1;
             }
-            inflateEnd(&strm);
-
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
+        } else if (job->type == CHUNK_DEFLATE) {
+            pthread_mutex_lock(&p.lock);
+            if (job->state == JOB_PENDING) {
+                // No worker has gotten to it yet; do it here.
+                p.next_deflate = i;
+                ChunkJob* claimed = ClaimNextDeflate(&p);
+                RunDeflateJob(&p, claimed);
             }
-
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
+            while (job->state != JOB_DONE) {
+                pthread_cond_wait(&p.done_cond, &p.lock);
             }
+            pthread_mutex_unlock(&p.lock);
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
+            if (job->status != 0) {
+                result = -1;
+            } else {
+                if (sink(job->output, job->output_size, token) !=
+                    job->output_size) {
                     printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
+                           (long)job->output_size);
+                    result = -1;
                 }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
-        } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+                Sha1Update(ctx, job->output, job->output_size);
+            }
+            free(job->output);
+            job->output = NULL;
         }
     }
 
-    return 0;
+    pthread_mutex_lock(&p.lock);
+    p.abort = 1;
+    pthread_cond_broadcast(&p.work_cond);
+    pthread_mutex_unlock(&p.lock);
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    // Chunks finished ahead of a failure are never written.
+    for (i = 0; i < p.num_jobs; ++i) {
+        free(p.jobs[i].output);
+    }
+    free(p.jobs);
+    pthread_cond_destroy(&p.done_cond);
+    pthread_cond_destroy(&p.work_cond);
+    pthread_mutex_destroy(&p.lock);
+
+    return result;
 }
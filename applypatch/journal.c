@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A small append-only log on /cache of the patches an OTA package
+// has finished applying.  If the install is interrupted (battery
+// pull, crash) and the same package is run again, files already
+// recorded as done are skipped without being read back and hashed,
+// and work resumes at the file that was in flight.
+//
+// The journal is a text file:
+//
+//   journal2 <package id>
+//   B <target sha1> <filename>     patching of <filename> has begun
+//   D <target sha1> <fingerprint> <filename>
+//                                  <filename> now has <target sha1>
+//
+// The fingerprint is FileFingerprint() of the file as we left it, or
+// "-".  The journal outlives a failed install, and anything may
+// happen to the file before the package is run again (a nandroid
+// restore, a write_raw_image(), a fix by hand), so a "done" record
+// only counts while the file still has the same fingerprint.
+//
+// Every record is fsync()ed before we act on it.  A torn last line
+// (no trailing newline) is ignored on load.  A journal for a
+// different package id, or in an older format, is discarded.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mincrypt/sha.h"
+#include "applypatch.h"
+
+typedef struct {
+    char* filename;        // NULL for an empty slot
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    char* fingerprint;     // NULL if unknown
+} JournalEntry;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* journal_path = NULL;
+static int journal_fd = -1;
+
+// Completed files, in an open-addressed table keyed by filename.
+static JournalEntry* done_table = NULL;
+static int done_alloc = 0;         // always a power of two
+static int done_count = 0;
+
+static char* inflight = NULL;
+
+static unsigned int HashFilename(const char* s) {
+    unsigned int h = 2166136261u;
+    for (; *s; ++s) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+static JournalEntry* FindSlot(JournalEntry* table, int alloc,
+                              const char* filename) {
+    unsigned int i = HashFilename(filename) & (alloc - 1);
+    while (table[i].filename != NULL &&
+           strcmp(table[i].filename, filename) != 0) {
+        i = (i + 1) & (alloc - 1);
+    }
+    return table + i;
+}
+
+static void RecordDone(const char* filename, const uint8_t* sha1,
+                       const char* fingerprint) {
+    if ((done_count + 1) * 2 > done_alloc) {
+        int new_alloc = done_alloc ? done_alloc * 2 : 64;
+        JournalEntry* t = calloc(new_alloc, sizeof(JournalEntry));
+        int i;
+        for (i = 0; i < done_alloc; ++i) {
+            if (done_table[i].filename != NULL) {
+                *FindSlot(t, new_alloc, done_table[i].filename) = done_table[i];
+            }
+        }
+        free(done_table);
+        done_table = t;
+        done_alloc = new_alloc;
+    }
+    JournalEntry* e = FindSlot(done_table, done_alloc, filename);
+    if (e->filename == NULL) {
+        e->filename = strdup(filename);
+        ++done_count;
+    }
+    memcpy(e->sha1, sha1, SHA_DIGEST_SIZE);
+    free(e->fingerprint);
+    e->fingerprint = fingerprint ? strdup(fingerprint) : NULL;
+}
+
+static void ResetState() {
+    int i;
+    for (i = 0; i < done_alloc; ++i) {
+        free(done_table[i].filename);
+        free(done_table[i].fingerprint);
+    }
+    free(done_table);
+    done_table = NULL;
+    done_alloc = done_count = 0;
+    free(inflight);
+    inflight = NULL;
+}
+
+static void FormatSha1(const uint8_t* sha1, char* out) {
+    static const char hex[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        out[i*2] = hex[sha1[i] >> 4];
+        out[i*2+1] = hex[sha1[i] & 0xf];
+    }
+    out[SHA_DIGEST_SIZE*2] = '\0';
+}
+
+// Replay one "B" or "D" record.  Returns 0 if it parsed.
+static int ReplayRecord(char* line) {
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    if ((line[0] != 'B' && line[0] != 'D') || line[1] != ' ') return -1;
+    char* sha = line + 2;
+    char* name = strchr(sha, ' ');
+    if (name == NULL) return -1;
+    *name++ = '\0';
+    if (ParseSha1(sha, sha1) != 0) return -1;
+
+    char* fingerprint = NULL;
+    if (line[0] == 'D') {
+        fingerprint = name;
+        name = strchr(fingerprint, ' ');
+        if (name == NULL) return -1;
+        *name++ = '\0';
+        if (strcmp(fingerprint, "-") == 0) fingerprint = NULL;
+    }
+    if (*name == '\0') return -1;
+
+    if (line[0] == 'B') {
+        free(inflight);
+        inflight = strdup(name);
+    } else {
+        RecordDone(name, sha1, fingerprint);
+        if (inflight != NULL && strcmp(inflight, name) == 0) {
+            free(inflight);
+            inflight = NULL;
+        }
+    }
+    return 0;
+}
+
+// Load an existing journal for package_id.  Returns 0 if one was
+// found and replayed.
+static int LoadJournal(const char* path, const char* package_id) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return -1;
+
+    char line[PATH_MAX + FINGERPRINT_MAX + 64];
+    int ok = 0;
+    if (fgets(line, sizeof(line), f) != NULL &&
+        strncmp(line, "journal2 ", 9) == 0) {
+        line[strcspn(line, "\n")] = '\0';
+        ok = strcmp(line + 9, package_id) == 0;
+    }
+    while (ok && fgets(line, sizeof(line), f) != NULL) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len-1] != '\n') break;    // torn write
+        line[len-1] = '\0';
+        if (ReplayRecord(line) != 0) {
+            printf("ignoring bad journal record \"%s\"\n", line);
+        }
+    }
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+static int AppendRecord(const char* record, size_t len) {
+    while (len > 0) {
+        ssize_t wrote = write(journal_fd, record, len);
+        if (wrote < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        record += wrote;
+        len -= wrote;
+    }
+    return fsync(journal_fd);
+}
+
+// Append a "B" record, or a "D" one if fingerprint isn't NULL.
+static void AppendStep(char kind, const char* filename,
+                       const uint8_t* sha1, const char* fingerprint) {
+    char hex[SHA_DIGEST_SIZE*2+1];
+    FormatSha1(sha1, hex);
+    size_t len = strlen(filename) + sizeof(hex) + FINGERPRINT_MAX + 5;
+    char* record = malloc(len);
+    if (fingerprint != NULL) {
+        snprintf(record, len, "%c %s %s %s\n",
+                 kind, hex, fingerprint, filename);
+    } else {
+        snprintf(record, len, "%c %s %s\n", kind, hex, filename);
+    }
+    if (AppendRecord(record, strlen(record)) != 0) {
+        // Carry on without it; the journal only ever saves work.
+        printf("failed to write journal %s: %s\n",
+               journal_path, strerror(errno));
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    free(record);
+}
+
+// Start journaling for the package identified by package_id (any
+// string without a newline that changes whenever the package's
+// contents do).  Steps already recorded under that id are loaded;
+// a journal left by any other package is thrown away.  Returns 0 if
+// the journal is usable; otherwise journaling is simply off.
+int OpenPatchJournal(const char* path, const char* package_id) {
+    pthread_mutex_lock(&journal_lock);
+    ResetState();
+    free(journal_path);
+    journal_path = strdup(path);
+
+    int resumed = (LoadJournal(path, package_id) == 0);
+    if (resumed) {
+        journal_fd = open(path, O_WRONLY | O_APPEND);
+    } else {
+        ResetState();
+        journal_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (journal_fd >= 0) {
+            size_t len = strlen(package_id) + 11;
+            char* header = malloc(len);
+            snprintf(header, len, "journal2 %s\n", package_id);
+            if (AppendRecord(header, strlen(header)) != 0) {
+                close(journal_fd);
+                journal_fd = -1;
+            }
+            free(header);
+        }
+    }
+
+    int result = 0;
+    if (journal_fd < 0) {
+        printf("not journaling to %s: %s\n", path, strerror(errno));
+        ResetState();
+        result = -1;
+    } else if (resumed) {
+        printf("resuming from journal: %d file(s) already patched\n",
+               done_count);
+        if (inflight != NULL) {
+            printf("interrupted while patching \"%s\"\n", inflight);
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+// Stop journaling.  If the install completed, the journal is
+// deleted; otherwise it's left for the next attempt.
+void ClosePatchJournal(int completed) {
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0) {
+        close(journal_fd);
+        journal_fd = -1;
+        if (completed) unlink(journal_path);
+    }
+    ResetState();
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Returns 1 if a previous run of this package already left filename
+// with contents sha1, and nothing has touched it since.  Otherwise
+// the caller has to look at the file itself.
+int PatchJournalIsDone(const char* filename, const uint8_t* sha1) {
+    char* recorded = NULL;
+    pthread_mutex_lock(&journal_lock);
+    if (done_count > 0) {
+        JournalEntry* e = FindSlot(done_table, done_alloc, filename);
+        if (e->filename != NULL && e->fingerprint != NULL &&
+            memcmp(e->sha1, sha1, SHA_DIGEST_SIZE) == 0) {
+            recorded = strdup(e->fingerprint);
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    if (recorded == NULL) return 0;
+
+    char now[FINGERPRINT_MAX];
+    int done = FileFingerprint(filename, now, sizeof(now)) == 0 &&
+               strcmp(now, recorded) == 0;
+    if (!done) {
+        printf("\"%s\" changed since it was journaled; checking it\n",
+               filename);
+    }
+    free(recorded);
+    return done;
+}
+
+// Returns 1 if filename was being patched when a previous run of
+// this package was interrupted.
+int PatchJournalIsInflight(const char* filename) {
+    pthread_mutex_lock(&journal_lock);
+    int result = inflight != NULL && strcmp(inflight, filename) == 0;
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+// Note that we're about to start rewriting filename.
+void PatchJournalBegin(const char* filename, const uint8_t* target_sha1) {
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0) {
+        AppendStep('B', filename, target_sha1, NULL);
+        free(inflight);
+        inflight = strdup(filename);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Note that filename now holds target_sha1.  The directory holding
+// it is synced first, so a "done" record never outlives the rename
+// it describes.
+void PatchJournalFinish(const char* filename, const uint8_t* target_sha1) {
+    char fingerprint[FINGERPRINT_MAX];
+    if (FileFingerprint(filename, fingerprint, sizeof(fingerprint)) != 0) {
+        strcpy(fingerprint, "-");
+    }
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0) {
+        if (strncmp(filename, "MTD:", 4) != 0) {
+            char* copy = strdup(filename);
+            int dfd = open(dirname(copy), O_RDONLY);
+            if (dfd >= 0) {
+                fsync(dfd);
+                close(dfd);
+            }
+            free(copy);
+        }
+        AppendStep('D', filename, target_sha1, fingerprint);
+        RecordDone(filename, target_sha1,
+                   strcmp(fingerprint, "-") ? fingerprint : NULL);
+        if (inflight != NULL && strcmp(inflight, filename) == 0) {
+            free(inflight);
+            inflight = NULL;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Linear-time suffix array construction, following
+//
+//   G. Nong, S. Zhang, W. H. Chan, "Two Efficient Algorithms for
+//   Linear Time Suffix Array Construction", IEEE Trans. Computers, 2011.
+//
+// The input is treated as if it had a unique, smallest sentinel
+// appended, so the result has the empty suffix in SA[0] exactly like
+// qsufsort() in bsdiff.c.  All indices are 32 bits, which is what
+// saves the memory: besides SA itself we only need one bit per input
+// byte for the L/S types and a bucket table per recursion level.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsdiff.h"
+
+// At the top level the "string" is the input bytes shifted up by one,
+// with a virtual 0 at the end; below that it's an int32_t array of
+// names that already ends in its own unique 0.
+typedef struct {
+  const unsigned char* bytes;
+  const int32_t* ints;
+  int32_t n;
+} Text;
+
+static inline int32_t chr(const Text* s, int32_t i) {
+  if (s->bytes != NULL) {
+    return i == s->n - 1 ? 0 : s->bytes[i] + 1;
+  }
+  return s->ints[i];
+}
+
+static const unsigned char mask[] = { 0x80, 0x40, 0x20, 0x10,
+                                      0x08, 0x04, 0x02, 0x01 };
+#define tget(i) ((t[(i)/8] & mask[(i)%8]) ? 1 : 0)
+#define tset(i, b) t[(i)/8] = (b) ? (mask[(i)%8] | t[(i)/8]) \
+                                  : ((~mask[(i)%8]) & t[(i)/8])
+#define isLMS(i) ((i) > 0 && tget(i) && !tget((i)-1))
+
+static void GetBuckets(const Text* s, int32_t* bkt, int32_t K, int end) {
+  int32_t i, sum = 0;
+  memset(bkt, 0, (K+1) * sizeof(int32_t));
+  for (i = 0; i < s->n; ++i) {
+    ++bkt[chr(s, i)];
+  }
+  for (i = 0; i <= K; ++i) {
+    sum += bkt[i];
+    bkt[i] = end ? sum : sum - bkt[i];
+  }
+}
+
+static void InduceL(const unsigned char* t, int32_t* SA, const Text* s,
+                    int32_t* bkt, int32_t K) {
+  int32_t i, j;
+  GetBuckets(s, bkt, K, 0);
+  for (i = 0; i < s->n; ++i) {
+    j = SA[i] - 1;
+    if (j >= 0 && !tget(j)) {
+      SA[bkt[chr(s, j)]++] = j;
+    }
+  }
+}
+
+static void InduceS(const unsigned char* t, int32_t* SA, const Text* s,
+                    int32_t* bkt, int32_t K) {
+  int32_t i, j;
+  GetBuckets(s, bkt, K, 1);
+  for (i = s->n - 1; i >= 0; --i) {
+    j = SA[i] - 1;
+    if (j >= 0 && tget(j)) {
+      SA[--bkt[chr(s, j)]] = j;
+    }
+  }
+}
+
+// Sorts the suffixes of s (whose characters are in [0, K]) into SA.
+static int SAIS(const Text* s, int32_t* SA, int32_t K) {
+  int32_t n = s->n;
+  int32_t i, j;
+
+  unsigned char* t = calloc(n/8 + 1, 1);
+  int32_t* bkt = malloc((K+1) * sizeof(int32_t));
+  if (t == NULL || bkt == NULL) {
+    free(t);
+    free(bkt);
+    return -1;
+  }
+
+  // Classify each position as S-type (1) or L-type (0).  The sentinel
+  // is S, and the character before it is always L.
+  tset(n-1, 1);
+  if (n > 1) {
+    tset(n-2, 0);
+  }
+  for (i = n-3; i >= 0; --i) {
+    int32_t a = chr(s, i), b = chr(s, i+1);
+    tset(i, (a < b || (a == b && tget(i+1))) ? 1 : 0);
+  }
+
+  // Stage 1: sort the LMS substrings by inducing from their buckets.
+  GetBuckets(s, bkt, K, 1);
+  for (i = 0; i < n; ++i) {
+    SA[i] = -1;
+  }
+  for (i = 1; i < n; ++i) {
+    if (isLMS(i)) {
+      SA[--bkt[chr(s, i)]] = i;
+    }
+  }
+  InduceL(t, SA, s, bkt, K);
+  InduceS(t, SA, s, bkt, K);
+  free(bkt);
+
+  // Pack the sorted LMS substrings into the front of SA.
+  int32_t n1 = 0;
+  for (i = 0; i < n; ++i) {
+    if (isLMS(SA[i])) {
+      SA[n1++] = SA[i];
+    }
+  }
+
+  // Name them; equal substrings get equal names.  Names are stored at
+  // SA[n1 + pos/2], which can't collide since LMS positions are at
+  // least two apart.
+  for (i = n1; i < n; ++i) {
+    SA[i] = -1;
+  }
+  int32_t name = 0, prev = -1;
+  for (i = 0; i < n1; ++i) {
+    int32_t pos = SA[i];
+    int diff = 0;
+    int32_t d;
+    for (d = 0; d < n; ++d) {
+      if (prev == -1 || chr(s, pos+d) != chr(s, prev+d) ||
+          tget(pos+d) != tget(prev+d)) {
+        diff = 1;
+        break;
+      } else if (d > 0 && (isLMS(pos+d) || isLMS(prev+d))) {
+        break;
+      }
+    }
+    if (diff) {
+      ++name;
+      prev = pos;
+    }
+    SA[n1 + pos/2] = name - 1;
+  }
+  for (i = n-1, j = n-1; i >= n1; --i) {
+    if (SA[i] >= 0) {
+      SA[j--] = SA[i];
+    }
+  }
+
+  // Stage 2: sort the reduced string, recursing if names repeat.
+  int32_t* SA1 = SA;
+  int32_t* s1 = SA + n - n1;
+  if (name < n1) {
+    Text reduced = { NULL, s1, n1 };
+    if (SAIS(&reduced, SA1, name - 1) != 0) {
+      free(t);
+      return -1;
+    }
+  } else {
+    for (i = 0; i < n1; ++i) {
+      SA1[s1[i]] = i;
+    }
+  }
+
+  // Stage 3: induce the full order from the sorted LMS suffixes.
+  bkt = malloc((K+1) * sizeof(int32_t));
+  if (bkt == NULL) {
+    free(t);
+    return -1;
+  }
+  GetBuckets(s, bkt, K, 1);
+  for (i = 1, j = 0; i < n; ++i) {
+    if (isLMS(i)) {
+      s1[j++] = i;
+    }
+  }
+  for (i = 0; i < n1; ++i) {
+    SA1[i] = s1[SA1[i]];
+  }
+  for (i = n1; i < n; ++i) {
+    SA[i] = -1;
+  }
+  for (i = n1-1; i >= 0; --i) {
+    j = SA[i];
+    SA[i] = -1;
+    SA[--bkt[chr(s, j)]] = j;
+  }
+  InduceL(t, SA, s, bkt, K);
+  InduceS(t, SA, s, bkt, K);
+
+  free(bkt);
+  free(t);
+  return 0;
+}
+
+int sais(const unsigned char* data, int32_t size, int32_t* SA) {
+  if (size < 0 || size == INT32_MAX) {
+    return -1;
+  }
+  if (size == 0) {
+    SA[0] = 0;
+    return 0;
+  }
+  Text s = { data, NULL, size + 1 };
+  return SAIS(&s, SA, 256);
+}
@@ -35,9 +35,12 @@
 #include "cutils/misc.h"
 #include "cutils/properties.h"
 #include "firmware.h"
+#include "hashutils/dirhash.h"
 #include "minzip/DirUtil.h"
 #include "minzip/Zip.h"
+#include "mtdutils/mounts.h"
 #include "roots.h"
+#include "spawnutils/spawn.h"
 
 #include "extendedcommands.h"
 
@@ -397,15 +400,9 @@ cmd_run_program(const char *name, void *cookie, int argc, const char *argv[],
     memcpy(args, argv, sizeof(char*) * argc);
     args[argc] = NULL;
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        execv(binary, args);
-        fprintf(stderr, "E:Can't run %s\n(%s)\n", binary, strerror(errno));
-        _exit(-1);
-    }
-
-    int status;
-    waitpid(pid, &status, 0);
+    int status = RunProgram(binary, args);
+    free(args);
+    invalidate_mounted_volumes();
     if (WIFEXITED(status) && WEXITSTATUS(status) == 0 || !script_assert_enabled) {
         return 0;
     } else {
@@ -984,6 +981,8 @@ fn_get_mark(const char *name, void *cookie, int argc, const char *argv[],
 }
 
 /* hash_dir(<path-to-directory>)
+ * Returns the hex SHA-1 of the tree under the directory; see
+ * hashutils/dirhash.h for what it covers.
  */
 static int
 fn_hash_dir(const char *name, void *cookie, int argc, const char *argv[],
@@ -1015,8 +1014,16 @@ fn_hash_dir(const char *name, void *cookie, int argc, const char *argv[],
         }
         ret = addPermissionRequestToList(permissions, dir, true, PERM_READ);
     } else {
-//xxx build and return the string
-        *result = strdup("hashvalue");
+        uint8_t digest[SHA1_DIGEST_SIZE];
+        if (HashDir(dir, digest) != 0) {
+            fprintf(stderr, "%s: can't hash %s\n", name, dir);
+            return 1;
+        }
+        *result = malloc(SHA1_DIGEST_SIZE * 2 + 1);
+        int i;
+        for (i = 0; i < SHA1_DIGEST_SIZE; i++) {
+            sprintf(*result + i * 2, "%02x", digest[i]);
+        }
         if (resultLen != NULL) {
             *resultLen = strlen(*result);
         }
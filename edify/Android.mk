@@ -5,7 +5,9 @@ LOCAL_PATH := $(call my-dir)
 edify_src_files := \
 	lexer.l \
 	parser.y \
-	expr.c
+	expr.c \
+	bytecode.c \
+	image.c
 
 # "-x c" forces the lex/yacc files to be compiled as c;
 # the build system otherwise forces them to be c++.
@@ -23,6 +25,9 @@ LOCAL_SRC_FILES := \
 LOCAL_CFLAGS := $(edify_cflags) -g -O0
 LOCAL_MODULE := edify
 LOCAL_YACCFLAGS := -v
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES := libhashutils libtraceutils
+LOCAL_LDLIBS += -lpthread -lrt
 
 include $(BUILD_HOST_EXECUTABLE)
 
@@ -35,5 +40,6 @@ LOCAL_SRC_FILES := $(edify_src_files)
 
 LOCAL_CFLAGS := $(edify_cflags)
 LOCAL_MODULE := libedify
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 
 include $(BUILD_STATIC_LIBRARY)
@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A bytecode compiler and stack VM for edify's operators.
+//
+// Sequences, literals, ==, !=, +, &&, ||, !, ifelse and is_substring
+// are compiled into flat instruction arrays and run without a
+// function call, or an allocation, per node.  Literals become
+// interned constants; intermediate strings (concatenations, the
+// "t"/"" of comparisons) live in a per-thread arena that is reset as
+// each run finishes.  Only a run's final result is copied out into
+// a malloc'd Value.
+//
+// Anything else is a registered Function, and is called exactly as
+// the tree walker would call it:  with its name, the State, and its
+// unevaluated Expr* arguments.  Those arguments are compiled too, so
+// when the function evaluates one it also runs bytecode.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+
+enum {
+    OP_END,
+    OP_CONST,       // push constant arg
+    OP_CALL,        // call calls[arg], push its result
+    OP_POP,
+    OP_STR,         // abort unless the top of the stack is a string
+    OP_JUMP,        // jump to arg
+    OP_AND,         // top false: keep it, jump to arg; else pop
+    OP_OR,          // top true: keep it, jump to arg; else pop
+    OP_BRANCH,      // pop; if it was false, jump to arg
+    OP_NOT,
+    OP_EQ,
+    OP_NE,
+    OP_SUBSTR,      // push whether the top is a substring of the one below
+    OP_CONCAT,      // replace the top arg strings with their concatenation
+};
+
+#define INSN(op, arg)  ((uint32_t)(op) | ((uint32_t)(arg) << 8))
+#define INSN_OP(insn)  ((insn) & 0xff)
+#define INSN_ARG(insn) ((insn) >> 8)
+
+struct Code {
+    uint32_t* insns;
+    Expr** calls;
+    int max_stack;
+};
+
+// -----------------------------------------------------------------
+//   interned constants
+// -----------------------------------------------------------------
+
+typedef struct {
+    char* data;
+    ssize_t size;
+} Constant;
+
+static Constant* constants = NULL;
+static int constants_count = 0;
+static int constants_alloc = 0;
+static int* intern_table = NULL;    // open addressing; -1 is empty
+static int intern_alloc = 0;
+
+#define CONST_FALSE 0
+#define CONST_TRUE  1
+
+static unsigned int HashString(const char* s) {
+    unsigned int h = 2166136261u;
+    for (; *s; ++s) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+static int* InternSlot(int* table, int alloc, const char* s) {
+    unsigned int i = HashString(s) & (alloc - 1);
+    while (table[i] >= 0 && strcmp(constants[table[i]].data, s) != 0) {
+        i = (i + 1) & (alloc - 1);
+    }
+    return table + i;
+}
+
+static int Intern(const char* s) {
+    if ((constants_count + 1) * 2 > intern_alloc) {
+        int new_alloc = intern_alloc ? intern_alloc * 2 : 256;
+        int* table = malloc(new_alloc * sizeof(int));
+        int i;
+        for (i = 0; i < new_alloc; ++i) table[i] = -1;
+        for (i = 0; i < constants_count; ++i) {
+            *InternSlot(table, new_alloc, constants[i].data) = i;
+        }
+        free(intern_table);
+        intern_table = table;
+        intern_alloc = new_alloc;
+    }
+    int* slot = InternSlot(intern_table, intern_alloc, s);
+    if (*slot < 0) {
+        if (constants_count >= constants_alloc) {
+            constants_alloc = constants_alloc * 2 + 64;
+            constants = realloc(constants, constants_alloc * sizeof(Constant));
+        }
+        constants[constants_count].data = strdup(s);
+        constants[constants_count].size = strlen(s);
+        *slot = constants_count++;
+    }
+    return *slot;
+}
+
+// -----------------------------------------------------------------
+//   per-thread arena
+// -----------------------------------------------------------------
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;
+    size_t used;
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk* first;
+    ArenaChunk* current;
+} Arena;
+
+typedef struct {
+    ArenaChunk* chunk;
+    size_t used;
+} ArenaMark;
+
+#define ARENA_CHUNK_SIZE 16384
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void FreeArena(void* cookie) {
+    Arena* arena = (Arena*)cookie;
+    ArenaChunk* c = arena->first;
+    while (c != NULL) {
+        ArenaChunk* next = c->next;
+        free(c);
+        c = next;
+    }
+    free(arena);
+}
+
+static void CreateArenaKey() {
+    pthread_key_create(&arena_key, FreeArena);
+}
+
+static Arena* ThreadArena() {
+    pthread_once(&arena_once, CreateArenaKey);
+    Arena* arena = pthread_getspecific(arena_key);
+    if (arena == NULL) {
+        arena = malloc(sizeof(Arena));
+        arena->first = arena->current = malloc(sizeof(ArenaChunk) + ARENA_CHUNK_SIZE);
+        arena->first->next = NULL;
+        arena->first->size = ARENA_CHUNK_SIZE;
+        arena->first->used = 0;
+        pthread_setspecific(arena_key, arena);
+    }
+    return arena;
+}
+
+static void* ArenaAlloc(Arena* arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaChunk* c = arena->current;
+    while (c->used + size > c->size) {
+        // Chunks past the current one are left over from earlier
+        // runs; reuse them if they're big enough.
+        if (c->next == NULL || c->next->size < size) {
+            size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+            ArenaChunk* n = malloc(sizeof(ArenaChunk) + chunk_size);
+            n->next = c->next;
+            n->size = chunk_size;
+            c->next = n;
+        }
+        c = c->next;
+        c->used = 0;
+    }
+    arena->current = c;
+    void* p = (char*)(c + 1) + c->used;
+    c->used += size;
+    return p;
+}
+
+static ArenaMark ArenaSave(Arena* arena) {
+    ArenaMark m;
+    m.chunk = arena->current;
+    m.used = arena->current->used;
+    return m;
+}
+
+static void ArenaRestore(Arena* arena, ArenaMark m) {
+    arena->current = m.chunk;
+    m.chunk->used = m.used;
+}
+
+// -----------------------------------------------------------------
+//   compiler
+// -----------------------------------------------------------------
+
+typedef struct {
+    uint32_t* insns;
+    int count;
+    int alloc;
+    Expr** calls;
+    int calls_count;
+    int calls_alloc;
+    int depth;
+    int max_depth;
+} Builder;
+
+static int Emit(Builder* b, int op, int arg) {
+    if (b->count >= b->alloc) {
+        b->alloc = b->alloc * 2 + 16;
+        b->insns = realloc(b->insns, b->alloc * sizeof(uint32_t));
+    }
+    b->insns[b->count] = INSN(op, arg);
+    return b->count++;
+}
+
+static void Patch(Builder* b, int at) {
+    b->insns[at] = INSN(INSN_OP(b->insns[at]), b->count);
+}
+
+static void Push(Builder* b) {
+    if (++b->depth > b->max_depth) b->max_depth = b->depth;
+}
+
+static void AddCall(Builder* b, Expr* e) {
+    if (b->calls_count >= b->calls_alloc) {
+        b->calls_alloc = b->calls_alloc * 2 + 8;
+        b->calls = realloc(b->calls, b->calls_alloc * sizeof(Expr*));
+    }
+    b->calls[b->calls_count++] = e;
+}
+
+static int IsNative(Expr* e) {
+    if (e->fn == Literal || e->fn == SequenceFn ||
+        e->fn == LogicalAndFn || e->fn == LogicalOrFn ||
+        e->fn == EqualityFn || e->fn == InequalityFn ||
+        e->fn == ConcatFn) {
+        return 1;
+    }
+    return (e->fn == LogicalNotFn && e->argc == 1) ||
+           (e->fn == SubstringFn && e->argc == 2) ||
+           (e->fn == IfElseFn && (e->argc == 2 || e->argc == 3));
+}
+
+static void EmitExpr(Builder* b, Expr* e);
+
+// Operands that the tree walker reads with Evaluate() (rather than
+// EvaluateValue()) must be strings.
+static void EmitString(Builder* b, Expr* e) {
+    EmitExpr(b, e);
+    Emit(b, OP_STR, 0);
+}
+
+static void EmitExpr(Builder* b, Expr* e) {
+    int i, at, at2;
+
+    if (e->fn == SequenceFn) {
+        // Scripts are long chains of "a; b; c; ...", which parse as
+        // (((a; b); c); ...).  Walk down the left spine iteratively
+        // rather than recursing once per statement.
+        int n = 0;
+        Expr* p;
+        for (p = e; p->fn == SequenceFn; p = p->argv[0]) ++n;
+        Expr** rights = malloc(n * sizeof(Expr*));
+        for (i = n-1, p = e; p->fn == SequenceFn; p = p->argv[0], --i) {
+            rights[i] = p->argv[1];
+        }
+        EmitExpr(b, p);
+        for (i = 0; i < n; ++i) {
+            Emit(b, OP_POP, 0);
+            --b->depth;
+            EmitExpr(b, rights[i]);
+        }
+        free(rights);
+        return;
+    }
+
+    if (e->fn == Literal) {
+        Emit(b, OP_CONST, Intern(e->name));
+        Push(b);
+    } else if (e->fn == ConcatFn) {
+        if (e->argc == 0) {
+            Emit(b, OP_CONST, CONST_FALSE);
+            Push(b);
+            return;
+        }
+        for (i = 0; i < e->argc; ++i) {
+            EmitString(b, e->argv[i]);
+        }
+        Emit(b, OP_CONCAT, e->argc);
+        b->depth -= e->argc - 1;
+    } else if (e->fn == LogicalAndFn || e->fn == LogicalOrFn ||
+               (e->fn == IfElseFn && e->argc == 2)) {
+        // ifelse(c, x) is c && x:  a false c is returned as is.
+        EmitString(b, e->argv[0]);
+        at = Emit(b, e->fn == LogicalOrFn ? OP_OR : OP_AND, 0);
+        --b->depth;
+        EmitExpr(b, e->argv[1]);
+        Patch(b, at);
+    } else if (e->fn == IfElseFn && e->argc == 3) {
+        EmitString(b, e->argv[0]);
+        at = Emit(b, OP_BRANCH, 0);
+        --b->depth;
+        EmitExpr(b, e->argv[1]);
+        at2 = Emit(b, OP_JUMP, 0);
+        --b->depth;
+        Patch(b, at);
+        EmitExpr(b, e->argv[2]);
+        Patch(b, at2);
+    } else if (e->fn == LogicalNotFn && e->argc == 1) {
+        EmitString(b, e->argv[0]);
+        Emit(b, OP_NOT, 0);
+    } else if (e->fn == EqualityFn || e->fn == InequalityFn ||
+               (e->fn == SubstringFn && e->argc == 2)) {
+        EmitString(b, e->argv[0]);
+        EmitString(b, e->argv[1]);
+        Emit(b, e->fn == EqualityFn ? OP_EQ :
+                e->fn == InequalityFn ? OP_NE : OP_SUBSTR, 0);
+        --b->depth;
+    } else {
+        AddCall(b, e);
+        Emit(b, OP_CALL, b->calls_count - 1);
+        Push(b);
+        for (i = 0; i < e->argc; ++i) {
+            CompileExpr(e->argv[i]);
+        }
+    }
+}
+
+void CompileExpr(Expr* expr) {
+    // Literals and plain calls gain nothing from a trip through the
+    // VM; only operator trees get code.
+    if (expr->code != NULL || expr->fn == Literal) return;
+    if (!IsNative(expr)) {
+        int i;
+        for (i = 0; i < expr->argc; ++i) {
+            CompileExpr(expr->argv[i]);
+        }
+        return;
+    }
+
+    if (constants_count == 0) {
+        Intern("");       // CONST_FALSE
+        Intern("t");      // CONST_TRUE
+    }
+
+    Builder b;
+    memset(&b, 0, sizeof(b));
+    EmitExpr(&b, expr);
+    Emit(&b, OP_END, 0);
+
+    Code* code = malloc(sizeof(Code));
+    code->insns = realloc(b.insns, b.count * sizeof(uint32_t));
+    code->calls = b.calls;
+    code->max_stack = b.max_depth;
+    expr->code = code;
+}
+
+// -----------------------------------------------------------------
+//   VM
+// -----------------------------------------------------------------
+
+typedef struct {
+    int type;
+    ssize_t size;
+    char* data;
+    Value* owned;     // set if this came from a Function and is ours to free
+} Slot;
+
+static void DropSlot(Slot* s) {
+    FreeValue(s->owned);
+}
+
+static void SetConstant(Slot* s, int index) {
+    s->type = VAL_STRING;
+    s->size = constants[index].size;
+    s->data = constants[index].data;
+    s->owned = NULL;
+}
+
+Value* RunCode(State* state, Code* code) {
+    Arena* arena = ThreadArena();
+    ArenaMark mark = ArenaSave(arena);
+    Slot* stack = ArenaAlloc(arena, code->max_stack * sizeof(Slot));
+    Slot* top = stack - 1;
+    const uint32_t* pc = code->insns;
+    Value* result = NULL;
+    int b;
+
+    for (;;) {
+        uint32_t insn = *pc++;
+        switch (INSN_OP(insn)) {
+            case OP_CONST:
+                SetConstant(++top, INSN_ARG(insn));
+                break;
+
+            case OP_CALL: {
+                Expr* e = code->calls[INSN_ARG(insn)];
+                Value* v = CallFunction(state, e);
+                if (v == NULL) goto done;
+                ++top;
+                top->type = v->type;
+                top->size = v->size;
+                top->data = v->data;
+                top->owned = v;
+                break;
+            }
+
+            case OP_POP:
+                DropSlot(top--);
+                break;
+
+            case OP_STR:
+                if (top->type != VAL_STRING) {
+                    ErrorAbort(state, "expecting string, got value type %d",
+                               top->type);
+                    goto done;
+                }
+                break;
+
+            case OP_JUMP:
+                pc = code->insns + INSN_ARG(insn);
+                break;
+
+            case OP_AND:
+            case OP_OR:
+                b = top->data[0] != '\0';
+                if (b == (INSN_OP(insn) == OP_OR)) {
+                    pc = code->insns + INSN_ARG(insn);
+                } else {
+                    DropSlot(top--);
+                }
+                break;
+
+            case OP_BRANCH:
+                b = top->data[0] != '\0';
+                DropSlot(top--);
+                if (!b) pc = code->insns + INSN_ARG(insn);
+                break;
+
+            case OP_NOT:
+                b = top->data[0] != '\0';
+                DropSlot(top);
+                SetConstant(top, b ? CONST_FALSE : CONST_TRUE);
+                break;
+
+            case OP_EQ:
+            case OP_NE:
+            case OP_SUBSTR:
+                if (INSN_OP(insn) == OP_SUBSTR) {
+                    // is_substring(needle, haystack)
+                    b = strstr(top->data, top[-1].data) != NULL;
+                } else {
+                    b = (strcmp(top[-1].data, top->data) == 0) ==
+                        (INSN_OP(insn) == OP_EQ);
+                }
+                DropSlot(top--);
+                DropSlot(top);
+                SetConstant(top, b ? CONST_TRUE : CONST_FALSE);
+                break;
+
+            case OP_CONCAT: {
+                int n = INSN_ARG(insn);
+                Slot* first = top - n + 1;
+                Slot* s;
+                size_t length = 0;
+                for (s = first; s <= top; ++s) {
+                    length += strlen(s->data);
+                }
+                char* out = ArenaAlloc(arena, length + 1);
+                char* p = out;
+                for (s = first; s <= top; ++s) {
+                    size_t len = strlen(s->data);
+                    memcpy(p, s->data, len);
+                    p += len;
+                    DropSlot(s);
+                }
+                *p = '\0';
+                top = first;
+                top->type = VAL_STRING;
+                top->size = length;
+                top->data = out;
+                top->owned = NULL;
+                break;
+            }
+
+            case OP_END:
+                if (top->owned != NULL) {
+                    result = top->owned;
+                } else {
+                    // Constants and arena strings don't outlive the
+                    // run; the caller gets its own copy.
+                    result = malloc(sizeof(Value));
+                    result->type = top->type;
+                    result->size = top->size;
+                    result->data = malloc(top->size + 1);
+                    memcpy(result->data, top->data, top->size + 1);
+                }
+                --top;
+                goto done;
+        }
+    }
+
+  done:
+    while (top >= stack) {
+        DropSlot(top--);
+    }
+    ArenaRestore(arena, mark);
+    return result;
+}
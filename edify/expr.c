@@ -19,9 +19,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "expr.h"
+#include "traceutils/trace.h"
 
 // Functions should:
 //
@@ -33,7 +35,7 @@ int BooleanString(const char* s) {
 }
 
 char* Evaluate(State* state, Expr* expr) {
-    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    Value* v = EvaluateValue(state, expr);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
@@ -46,7 +48,64 @@ char* Evaluate(State* state, Expr* expr) {
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    if (expr->code != NULL) {
+        return RunCode(state, expr->code);
+    }
+    return CallFunction(state, expr);
+}
+
+// Line starts of the last script we traced, for turning Expr offsets
+// into line and column.
+static pthread_mutex_t position_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char* position_script = NULL;
+static int* line_starts = NULL;
+static int line_count = 0;
+
+static void ScriptPosition(const char* script, int offset,
+                           int* line, int* column) {
+    pthread_mutex_lock(&position_lock);
+    if (script != position_script) {
+        int alloc = 64;
+        free(line_starts);
+        line_starts = malloc(alloc * sizeof(int));
+        line_starts[0] = 0;
+        line_count = 1;
+        const char* p;
+        for (p = script; *p; ++p) {
+            if (*p != '\n') continue;
+            if (line_count >= alloc) {
+                alloc *= 2;
+                line_starts = realloc(line_starts, alloc * sizeof(int));
+            }
+            line_starts[line_count++] = p - script + 1;
+        }
+        position_script = script;
+    }
+    int lo = 0, hi = line_count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (line_starts[mid] <= offset) lo = mid; else hi = mid - 1;
+    }
+    *line = lo + 1;
+    *column = offset - line_starts[lo] + 1;
+    pthread_mutex_unlock(&position_lock);
+}
+
+Value* CallFunction(State* state, Expr* expr) {
+    if (!gTraceEnabled || expr->fn == Literal ||
+        strcmp(expr->name, "(operator)") == 0) {
+        return expr->fn(expr->name, state, expr->argc, expr->argv);
+    }
+
+    TraceSpan span;
+    TraceBegin(&span);
+    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    int line = 0, column = 0;
+    if (state->script != NULL) {
+        ScriptPosition(state->script, expr->start, &line, &column);
+    }
+    TraceEnd(&span, expr->name, "edify", line, column);
+    return v;
 }
 
 Value* StringValue(char* str) {
@@ -58,9 +117,79 @@ Value* StringValue(char* str) {
     return v;
 }
 
+// Data pointers handed out by BorrowedBlobValue() and not yet freed,
+// with the source each one holds a reference to.  Only a handful are
+// ever live at once, so a flat array does.
+typedef struct {
+    const char* data;
+    BlobSource* source;
+} Borrowed;
+
+static pthread_mutex_t borrowed_lock = PTHREAD_MUTEX_INITIALIZER;
+static Borrowed* borrowed = NULL;
+static int borrowed_count = 0;
+static int borrowed_alloc = 0;
+
+Value* BorrowedBlobValue(char* data, ssize_t size, BlobSource* source) {
+    Value* v = malloc(sizeof(Value));
+    v->type = VAL_BLOB;
+    v->size = size;
+    v->data = data;
+    RetainBlobSource(source);
+
+    pthread_mutex_lock(&borrowed_lock);
+    if (borrowed_count == borrowed_alloc) {
+        borrowed_alloc = borrowed_alloc * 2 + 8;
+        borrowed = realloc(borrowed, borrowed_alloc * sizeof(Borrowed));
+    }
+    borrowed[borrowed_count].data = data;
+    borrowed[borrowed_count].source = source;
+    __sync_fetch_and_add(&borrowed_count, 1);
+    pthread_mutex_unlock(&borrowed_lock);
+    return v;
+}
+
+// If 'data' came from BorrowedBlobValue(), forget it and return the
+// source it was borrowed from; otherwise return NULL.
+static BlobSource* TakeBorrowed(const char* data) {
+    // Most Values are never borrowed; don't take the lock for them.
+    if (data == NULL || __sync_fetch_and_add(&borrowed_count, 0) == 0) {
+        return NULL;
+    }
+    BlobSource* source = NULL;
+    pthread_mutex_lock(&borrowed_lock);
+    int i;
+    for (i = borrowed_count - 1; i >= 0; --i) {
+        if (borrowed[i].data == data) {
+            source = borrowed[i].source;
+            borrowed[i] = borrowed[borrowed_count - 1];
+            __sync_fetch_and_sub(&borrowed_count, 1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&borrowed_lock);
+    return source;
+}
+
+void RetainBlobSource(BlobSource* source) {
+    __sync_fetch_and_add(&source->refcount, 1);
+}
+
+void ReleaseBlobSource(BlobSource* source) {
+    if (__sync_sub_and_fetch(&source->refcount, 1) == 0 &&
+        source->release != NULL) {
+        source->release(source);
+    }
+}
+
 void FreeValue(Value* v) {
     if (v == NULL) return;
-    free(v->data);
+    BlobSource* source = TakeBorrowed(v->data);
+    if (source != NULL) {
+        ReleaseBlobSource(source);
+    } else {
+        free(v->data);
+    }
     free(v);
 }
 
@@ -339,6 +468,7 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     va_end(v);
     e->start = loc.start;
     e->end = loc.end;
+    e->code = NULL;
     return e;
 }
 
@@ -349,6 +479,7 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
 static int fn_entries = 0;
 static int fn_size = 0;
 NamedFunction* fn_table = NULL;
+static Function unknown_fn = NULL;
 
 void RegisterFunction(const char* name, Function fn) {
     if (fn_entries >= fn_size) {
@@ -376,11 +507,15 @@ Function FindFunction(const char* name) {
     NamedFunction* nf = bsearch(&key, fn_table, fn_entries,
                                 sizeof(NamedFunction), fn_entry_compare);
     if (nf == NULL) {
-        return NULL;
+        return unknown_fn;
     }
     return nf->fn;
 }
 
+void SetUnknownFunction(Function fn) {
+    unknown_fn = fn;
+}
+
 void RegisterBuiltins() {
     RegisterFunction("ifelse", IfElseFn);
     RegisterFunction("abort", AbortFn);
@@ -399,11 +534,16 @@ void RegisterBuiltins() {
 //   convenience methods for functions
 // -----------------------------------------------------------------
 
+// Most functions take only a few arguments; read those without
+// allocating.
+#define READ_ARGS_INLINE 8
+
 // Evaluate the expressions in argv, giving 'count' char* (the ... is
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
+    char* small[READ_ARGS_INLINE];
+    char** args = count <= READ_ARGS_INLINE ? small : malloc(count * sizeof(char*));
     va_list v;
     va_start(v, count);
     int i;
@@ -415,13 +555,13 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
             for (j = 0; j < i; ++j) {
                 free(args[j]);
             }
-            free(args);
+            if (args != small) free(args);
             return -1;
         }
         *(va_arg(v, char**)) = args[i];
     }
     va_end(v);
-    free(args);
+    if (args != small) free(args);
     return 0;
 }
 
@@ -429,7 +569,8 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
+    Value* small[READ_ARGS_INLINE];
+    Value** args = count <= READ_ARGS_INLINE ? small : malloc(count * sizeof(Value*));
     va_list v;
     va_start(v, count);
     int i;
@@ -441,13 +582,13 @@ int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
             for (j = 0; j < i; ++j) {
                 FreeValue(args[j]);
             }
-            free(args);
+            if (args != small) free(args);
             return -1;
         }
         *(va_arg(v, Value**)) = args[i];
     }
     va_end(v);
-    free(args);
+    if (args != small) free(args);
     return 0;
 }
 
@@ -17,6 +17,8 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 
 #include "yydefs.h"
@@ -24,6 +26,7 @@
 #define MAX_STRING_LEN 1024
 
 typedef struct Expr Expr;
+typedef struct Code Code;
 
 typedef struct {
     // Optional pointer to app-specific data; the core of edify never
@@ -44,6 +47,14 @@ typedef struct {
 #define VAL_STRING  1  // data will be NULL-terminated; size doesn't count null
 #define VAL_BLOB    2
 
+// Whatever owns memory that blobs may point into without copying it
+// (such as the mapped package).  It stays alive until its last
+// reference is released.
+typedef struct BlobSource {
+    int refcount;
+    void (*release)(struct BlobSource* source);
+} BlobSource;
+
 typedef struct {
     int type;
     ssize_t size;
@@ -59,6 +70,7 @@ struct Expr {
     int argc;
     Expr** argv;
     int start, end;
+    Code* code;      // bytecode for this subtree, if CompileExpr() made any
 };
 
 // Take one of the Expr*s passed to the function as an argument,
@@ -92,6 +104,21 @@ Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]);
 // of arguments.
 Expr* Build(Function fn, YYLTYPE loc, int count, ...);
 
+// Compile the operators in the tree to bytecode (see bytecode.c), so
+// that Evaluate() and EvaluateValue() no longer walk them node by
+// node.  Registered Functions are still called with their Expr*
+// arguments.  Optional:  a tree that isn't compiled evaluates as
+// before.  Not thread-safe; compile before evaluating.
+void CompileExpr(Expr* expr);
+
+// Run the bytecode attached to an Expr; used by EvaluateValue().
+Value* RunCode(State* state, Code* code);
+
+// Call expr's Function with its (unevaluated) arguments, tracing the
+// call if tracing is on (see traceutils/trace.h).  Used by
+// EvaluateValue() and the bytecode VM.
+Value* CallFunction(State* state, Expr* expr);
+
 // Global builtins, registered by RegisterBuiltins().
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]);
@@ -125,6 +152,29 @@ void FinishRegistration();
 // exists.
 Function FindFunction(const char* name);
 
+// Make FindFunction() return fn, instead of NULL, for names that
+// aren't registered.  For host tools that parse scripts meant for a
+// device without knowing all its functions.
+void SetUnknownFunction(Function fn);
+
+
+// --- precompiled scripts (see image.c) ---
+
+#define SCRIPT_IMAGE_DIGEST_SIZE 20
+
+// Write a parsed script to f as an image that LoadScriptImage() can
+// turn back into a tree without parsing.  'digest' identifies the
+// source it was parsed from.  Returns 0 on success.
+int WriteScriptImage(FILE* f, Expr* root, const uint8_t* digest);
+
+// Rebuild the tree of a script from its image.  The tree's strings
+// point into 'data', which must outlive it.  Returns NULL if the
+// image is malformed, wasn't made from the source with the given
+// digest (which is script_len bytes long), or calls a function that
+// isn't registered.
+Expr* LoadScriptImage(const void* data, size_t size, const uint8_t* digest,
+                      size_t script_len);
+
 
 // --- convenience functions for use in functions ---
 
@@ -157,7 +207,18 @@ Value* ErrorAbort(State* state, char* format, ...);
 // Wrap a string into a Value, taking ownership of the string.
 Value* StringValue(char* str);
 
-// Free a Value object.
+// Make a blob of 'size' bytes at 'data' without copying them; the
+// Value holds a reference to 'source', which owns them.  The data is
+// read-only.  Borrowed data is remembered by address, so FreeValue()
+// knows not to free() it and Values built by hand need nothing new.
+Value* BorrowedBlobValue(char* data, ssize_t size, BlobSource* source);
+
+// Take or drop a reference to a BlobSource.  Dropping the last one
+// calls its release function.  Safe to call from several threads.
+void RetainBlobSource(BlobSource* source);
+void ReleaseBlobSource(BlobSource* source);
+
+// Free a Value object (or drop its reference, if it was borrowed).
 void FreeValue(Value* v);
 
 #endif  // _EXPRESSION_H
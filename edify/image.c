@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Script images:  a parsed edify tree, flattened so that it can be
+// shipped next to the script and loaded without lexing or parsing.
+//
+// Nothing in an image is a pointer and nothing is aligned, so it can
+// be used wherever it lands (e.g., in place in a package's mapping).
+//
+//   header   "EDIFYIM2", then 32-bit little-endian node count, arg
+//            count, size of the node stream and size of the strings,
+//            then the digest of the source script
+//   nodes    one record per node, in post-order
+//   strings  NUL-terminated names and literals, deduplicated
+//
+// A node record is a byte holding the kind and (up to 14) argc, with
+// argc following as a varint if it's bigger; then for literals and
+// calls the offset of the name in the strings; then start, as a
+// zigzag delta from the previous node's start, and end - start; then
+// for each argument, its distance back to that node.  Varints are
+// LEB128.  Post-order means every argument comes before its parent
+// and the root is the last node; most numbers are small, which keeps
+// images not much bigger than the scripts themselves.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+
+#define IMAGE_MAGIC "EDIFYIM2"
+#define IMAGE_MAGIC_SIZE 8
+#define HEADER_SIZE (IMAGE_MAGIC_SIZE + 4*4 + SCRIPT_IMAGE_DIGEST_SIZE)
+#define ARGC_ESCAPE 15
+
+enum {
+    KIND_LITERAL,
+    KIND_CALL,      // registered function, found by name
+    // The operators, built by the parser rather than named:
+    KIND_SEQUENCE,
+    KIND_CONCAT,
+    KIND_EQ,
+    KIND_NE,
+    KIND_AND,
+    KIND_OR,
+    KIND_NOT,
+    KIND_IFELSE,
+    KIND_COUNT
+};
+
+// Indexed by kind - KIND_SEQUENCE.
+static const Function operators[] = {
+    SequenceFn, ConcatFn, EqualityFn, InequalityFn,
+    LogicalAndFn, LogicalOrFn, LogicalNotFn, IfElseFn,
+};
+
+#define OPERATOR_NAME "(operator)"
+
+static void Put32(unsigned char* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t Get32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t Zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t Unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// -----------------------------------------------------------------
+//   writing
+// -----------------------------------------------------------------
+
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t alloc;
+} Buffer;
+
+static unsigned char* Grow(Buffer* b, size_t n) {
+    if (b->size + n > b->alloc) {
+        b->alloc = (b->size + n) * 2;
+        b->data = realloc(b->data, b->alloc);
+    }
+    unsigned char* p = b->data + b->size;
+    b->size += n;
+    return p;
+}
+
+static void PutVarint(Buffer* b, uint32_t v) {
+    while (v >= 0x80) {
+        *Grow(b, 1) = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *Grow(b, 1) = v;
+}
+
+typedef struct {
+    Buffer strings;
+    uint32_t* table;    // open addressing on string offsets; ~0 is empty
+    int alloc;
+    int count;
+} StringPool;
+
+static unsigned int HashString(const char* s) {
+    unsigned int h = 2166136261u;
+    for (; *s; ++s) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t* PoolSlot(StringPool* pool, uint32_t* table, int alloc,
+                          const char* s) {
+    unsigned int i = HashString(s) & (alloc - 1);
+    while (table[i] != ~0u &&
+           strcmp((char*)pool->strings.data + table[i], s) != 0) {
+        i = (i + 1) & (alloc - 1);
+    }
+    return table + i;
+}
+
+static uint32_t AddString(StringPool* pool, const char* s) {
+    if ((pool->count + 1) * 2 > pool->alloc) {
+        int new_alloc = pool->alloc ? pool->alloc * 2 : 256;
+        uint32_t* table = malloc(new_alloc * sizeof(uint32_t));
+        memset(table, 0xff, new_alloc * sizeof(uint32_t));
+        int i;
+        for (i = 0; i < pool->alloc; ++i) {
+            if (pool->table[i] == ~0u) continue;
+            *PoolSlot(pool, table, new_alloc,
+                      (char*)pool->strings.data + pool->table[i]) = pool->table[i];
+        }
+        free(pool->table);
+        pool->table = table;
+        pool->alloc = new_alloc;
+    }
+    uint32_t* slot = PoolSlot(pool, pool->table, pool->alloc, s);
+    if (*slot == ~0u) {
+        size_t len = strlen(s) + 1;
+        *slot = pool->strings.size;
+        memcpy(Grow(&pool->strings, len), s, len);
+        ++pool->count;
+    }
+    return *slot;
+}
+
+static int KindOf(Expr* e) {
+    if (e->fn == Literal) return KIND_LITERAL;
+    if (strcmp(e->name, OPERATOR_NAME) == 0) {
+        int k;
+        for (k = KIND_SEQUENCE; k < KIND_COUNT; ++k) {
+            if (e->fn == operators[k - KIND_SEQUENCE]) return k;
+        }
+    }
+    return KIND_CALL;
+}
+
+typedef struct {
+    Expr* e;
+    int next;           // next argument to visit
+} Frame;
+
+int WriteScriptImage(FILE* f, Expr* root, const uint8_t* digest) {
+    Buffer nodes;
+    StringPool pool;
+    memset(&nodes, 0, sizeof(nodes));
+    memset(&pool, 0, sizeof(pool));
+
+    // Walk the tree in post-order with explicit stacks, since scripts
+    // are long left-leaning chains of statements.  'done' holds the
+    // indices of finished nodes whose parent isn't finished yet.
+    int frames_alloc = 64, frames_count = 0;
+    Frame* frames = malloc(frames_alloc * sizeof(Frame));
+    int done_alloc = 64, done_count = 0;
+    uint32_t* done = malloc(done_alloc * sizeof(uint32_t));
+    uint32_t node_count = 0;
+    uint32_t arg_count = 0;
+    int prev_start = 0;
+
+    frames[frames_count].e = root;
+    frames[frames_count++].next = 0;
+    while (frames_count > 0) {
+        Frame* top = frames + frames_count - 1;
+        if (top->next < top->e->argc) {
+            Expr* child = top->e->argv[top->next++];
+            if (frames_count >= frames_alloc) {
+                frames_alloc *= 2;
+                frames = realloc(frames, frames_alloc * sizeof(Frame));
+            }
+            frames[frames_count].e = child;
+            frames[frames_count++].next = 0;
+            continue;
+        }
+
+        Expr* e = top->e;
+        --frames_count;
+
+        int kind = KindOf(e);
+        *Grow(&nodes, 1) = kind | ((e->argc < ARGC_ESCAPE ?
+                                    e->argc : ARGC_ESCAPE) << 4);
+        if (e->argc >= ARGC_ESCAPE) PutVarint(&nodes, e->argc);
+        if (kind == KIND_LITERAL || kind == KIND_CALL) {
+            PutVarint(&nodes, AddString(&pool, e->name));
+        }
+        PutVarint(&nodes, Zigzag(e->start - prev_start));
+        PutVarint(&nodes, e->end - e->start);
+        prev_start = e->start;
+
+        int i;
+        done_count -= e->argc;
+        for (i = 0; i < e->argc; ++i) {
+            PutVarint(&nodes, node_count - done[done_count + i]);
+        }
+        arg_count += e->argc;
+        if (done_count >= done_alloc) {
+            done_alloc *= 2;
+            done = realloc(done, done_alloc * sizeof(uint32_t));
+        }
+        done[done_count++] = node_count++;
+    }
+    free(frames);
+    free(done);
+
+    if (pool.strings.size == 0) {
+        *Grow(&pool.strings, 1) = '\0';
+    }
+
+    unsigned char header[HEADER_SIZE];
+    memcpy(header, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+    Put32(header + IMAGE_MAGIC_SIZE, node_count);
+    Put32(header + IMAGE_MAGIC_SIZE + 4, arg_count);
+    Put32(header + IMAGE_MAGIC_SIZE + 8, nodes.size);
+    Put32(header + IMAGE_MAGIC_SIZE + 12, pool.strings.size);
+    memcpy(header + IMAGE_MAGIC_SIZE + 16, digest, SCRIPT_IMAGE_DIGEST_SIZE);
+
+    int result = 0;
+    if (fwrite(header, 1, HEADER_SIZE, f) != HEADER_SIZE ||
+        fwrite(nodes.data, 1, nodes.size, f) != nodes.size ||
+        fwrite(pool.strings.data, 1, pool.strings.size, f) != pool.strings.size) {
+        result = -1;
+    }
+
+    free(nodes.data);
+    free(pool.strings.data);
+    free(pool.table);
+    return result;
+}
+
+// -----------------------------------------------------------------
+//   loading
+// -----------------------------------------------------------------
+
+// Read a varint from [*p, end); returns -1 if it runs off the end or
+// doesn't fit in 32 bits.
+static int GetVarint(const unsigned char** p, const unsigned char* end,
+                     uint32_t* v) {
+    uint32_t result = 0;
+    int shift;
+    for (shift = 0; shift < 35 && *p < end; shift += 7) {
+        unsigned char b = *(*p)++;
+        result |= (uint32_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *v = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// The operator functions trust the parser to give them the right
+// number of arguments; so must we.
+static int ValidArgc(uint32_t kind, uint32_t argc) {
+    switch (kind) {
+        case KIND_LITERAL: return argc == 0;
+        case KIND_CALL:
+        case KIND_CONCAT:  return 1;
+        case KIND_NOT:     return argc == 1;
+        case KIND_IFELSE:  return argc == 2 || argc == 3;
+        default:           return argc == 2;
+    }
+}
+
+Expr* LoadScriptImage(const void* data, size_t size, const uint8_t* digest,
+                      size_t script_len) {
+    const unsigned char* p = (const unsigned char*)data;
+    if (size < HEADER_SIZE || memcmp(p, IMAGE_MAGIC, IMAGE_MAGIC_SIZE) != 0) {
+        printf("not a script image\n");
+        return NULL;
+    }
+    uint32_t node_count = Get32(p + IMAGE_MAGIC_SIZE);
+    uint32_t arg_count = Get32(p + IMAGE_MAGIC_SIZE + 4);
+    uint32_t nodes_size = Get32(p + IMAGE_MAGIC_SIZE + 8);
+    uint32_t strings_size = Get32(p + IMAGE_MAGIC_SIZE + 12);
+    if (memcmp(p + IMAGE_MAGIC_SIZE + 16, digest,
+               SCRIPT_IMAGE_DIGEST_SIZE) != 0) {
+        printf("script image was made from a different script\n");
+        return NULL;
+    }
+
+    const unsigned char* n = p + HEADER_SIZE;
+    const unsigned char* nodes_end = n + nodes_size;
+    const char* strings = (const char*)nodes_end;
+    if (node_count == 0 || strings_size == 0 || script_len > INT32_MAX ||
+        (uint64_t)HEADER_SIZE + nodes_size + strings_size != size ||
+        strings[strings_size-1] != '\0') {
+        printf("script image is corrupt\n");
+        return NULL;
+    }
+
+    // One allocation for all the nodes and one for all the argument
+    // arrays; the strings stay where they are.
+    Expr* exprs = malloc(node_count * sizeof(Expr));
+    Expr** argvs = malloc((arg_count ? arg_count : 1) * sizeof(Expr*));
+    if (exprs == NULL || argvs == NULL) {
+        printf("failed to allocate script of %u nodes\n", node_count);
+        free(exprs);
+        free(argvs);
+        return NULL;
+    }
+
+    uint32_t i, j;
+    uint32_t args_used = 0;
+    uint32_t start = 0;
+    for (i = 0; i < node_count; ++i) {
+        Expr* e = exprs + i;
+        uint32_t kind, argc, v;
+
+        if (n >= nodes_end) goto corrupt;
+        kind = *n & 0x0f;
+        argc = *n++ >> 4;
+        if (kind >= KIND_COUNT) goto corrupt;
+        if (argc == ARGC_ESCAPE && GetVarint(&n, nodes_end, &argc) < 0) {
+            goto corrupt;
+        }
+        if (argc > arg_count - args_used || !ValidArgc(kind, argc)) {
+            goto corrupt;
+        }
+
+        if (kind == KIND_LITERAL || kind == KIND_CALL) {
+            if (GetVarint(&n, nodes_end, &v) < 0 || v >= strings_size) {
+                goto corrupt;
+            }
+            e->name = (char*)strings + v;
+        }
+        if (kind == KIND_LITERAL) {
+            e->fn = Literal;
+        } else if (kind == KIND_CALL) {
+            e->fn = FindFunction(e->name);
+            if (e->fn == NULL) {
+                printf("script image calls unknown function \"%s\"\n",
+                       e->name);
+                goto fail;
+            }
+        } else {
+            e->fn = operators[kind - KIND_SEQUENCE];
+            e->name = OPERATOR_NAME;
+        }
+
+        // Positions are used to quote the script (in assert()
+        // messages), so they must lie within it.
+        if (GetVarint(&n, nodes_end, &v) < 0) goto corrupt;
+        int32_t delta = Unzigzag(v);
+        if (delta < 0 ? (uint32_t)-(int64_t)delta > start
+                      : (uint32_t)delta > script_len - start) {
+            goto corrupt;
+        }
+        start += delta;
+        if (GetVarint(&n, nodes_end, &v) < 0 || v > script_len - start) {
+            goto corrupt;
+        }
+        e->start = start;
+        e->end = start + v;
+
+        e->argc = argc;
+        e->argv = argc ? argvs + args_used : NULL;
+        for (j = 0; j < argc; ++j) {
+            // Arguments come before their parent.
+            if (GetVarint(&n, nodes_end, &v) < 0 || v == 0 || v > i) {
+                goto corrupt;
+            }
+            argvs[args_used++] = exprs + i - v;
+        }
+        e->code = NULL;
+    }
+    if (n != nodes_end || args_used != arg_count) goto corrupt;
+
+    return exprs + node_count - 1;
+
+  corrupt:
+    printf("script image is corrupt\n");
+  fail:
+    free(exprs);
+    free(argvs);
+    return NULL;
+}
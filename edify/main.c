@@ -14,15 +14,59 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "expr.h"
 #include "parser.h"
+#include "hashutils/sha1.h"
 
 extern int yyparse(Expr** root, int* error_count);
 
+static const uint8_t test_digest[SCRIPT_IMAGE_DIGEST_SIZE] = "0123456789abcdefghi";
+
+// Write e out as a script image and read it back into *image.
+static int WriteTestImage(Expr* e, char** image, size_t* size) {
+    FILE* f = tmpfile();
+    if (f == NULL || WriteScriptImage(f, e, test_digest) != 0) {
+        if (f) fclose(f);
+        return -1;
+    }
+    *size = ftell(f);
+    *image = malloc(*size);
+    rewind(f);
+    int ok = fread(*image, 1, *size, f) == *size;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+static int check(const char* expr_str, const char* how, char* result,
+                 const char* expected, int* errors) {
+    if (result == NULL && expected != NULL) {
+        fprintf(stderr, "error evaluating \"%s\" (%s)\n", expr_str, how);
+        ++*errors;
+        return 0;
+    }
+
+    if (result == NULL && expected == NULL) {
+        return 1;
+    }
+
+    if (expected == NULL || strcmp(result, expected) != 0) {
+        fprintf(stderr, "evaluating \"%s\" (%s): expected \"%s\", got \"%s\"\n",
+                expr_str, how, expected, result);
+        ++*errors;
+        free(result);
+        return 0;
+    }
+
+    free(result);
+    return 1;
+}
+
 int expect(const char* expr_str, const char* expected, int* errors) {
     Expr* e;
     int error;
@@ -45,29 +89,91 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     state.script = strdup(expr_str);
     state.errmsg = NULL;
 
+    // Walk the tree; then check that the same tree loaded from a
+    // script image, and that tree compiled to bytecode, agree.
     result = Evaluate(&state, e);
     free(state.errmsg);
-    free(state.script);
-    if (result == NULL && expected != NULL) {
-        fprintf(stderr, "error evaluating \"%s\"\n", expr_str);
-        ++*errors;
+    state.errmsg = NULL;
+    if (!check(expr_str, "tree", result, expected, errors)) {
+        free(state.script);
         return 0;
     }
 
-    if (result == NULL && expected == NULL) {
-        return 1;
+    char* image;
+    size_t image_size;
+    if (WriteTestImage(e, &image, &image_size) != 0 ||
+        (e = LoadScriptImage(image, image_size, test_digest,
+                            strlen(expr_str))) == NULL) {
+        fprintf(stderr, "failed to make an image of \"%s\"\n", expr_str);
+        ++*errors;
+        free(state.script);
+        return 0;
+    }
+    result = Evaluate(&state, e);
+    free(state.errmsg);
+    state.errmsg = NULL;
+    if (!check(expr_str, "image", result, expected, errors)) {
+        free(state.script);
+        return 0;
     }
 
-    if (strcmp(result, expected) != 0) {
-        fprintf(stderr, "evaluating \"%s\": expected \"%s\", got \"%s\"\n",
-                expr_str, expected, result);
+    CompileExpr(e);
+    result = Evaluate(&state, e);
+    free(state.errmsg);
+    free(state.script);
+    // (The loaded tree, which points into image, is leaked like
+    // the parsed ones.)
+    return check(expr_str, "bytecode", result, expected, errors);
+}
+
+// Images that don't match their script, or are damaged, must be
+// refused rather than run.
+static void expect_rejected_images(int* errors) {
+    const char* script = "a; concat(b, c) + d";
+    Expr* e;
+    int error_count = 0;
+    yy_scan_string(script);
+    yyparse(&e, &error_count);
+
+    char* image;
+    size_t size;
+    if (WriteTestImage(e, &image, &size) != 0) {
+        fprintf(stderr, "failed to write image\n");
         ++*errors;
-        free(result);
-        return 0;
+        return;
     }
 
-    free(result);
-    return 1;
+    uint8_t other_digest[SCRIPT_IMAGE_DIGEST_SIZE];
+    memcpy(other_digest, test_digest, sizeof(other_digest));
+    other_digest[0] ^= 1;
+    size_t len = strlen(script);
+    if (LoadScriptImage(image, size, other_digest, len) != NULL) {
+        fprintf(stderr, "image loaded with the wrong digest\n");
+        ++*errors;
+    }
+    if (LoadScriptImage(image, size - 1, test_digest, len) != NULL) {
+        fprintf(stderr, "truncated image loaded\n");
+        ++*errors;
+    }
+    // Its nodes' positions must lie within the script they came from.
+    if (LoadScriptImage(image, size, test_digest, len - 1) != NULL) {
+        fprintf(stderr, "image reaching past its script loaded\n");
+        ++*errors;
+    }
+    if (LoadScriptImage(image, size, test_digest, len) == NULL) {
+        fprintf(stderr, "image of the right length refused\n");
+        ++*errors;
+    }
+    // The last byte of the node stream is the root's last argument,
+    // as a distance back from the root.  Make it point at the root
+    // itself.
+    size_t nodes_size = (unsigned char)image[16] | ((unsigned char)image[17] << 8);
+    image[8 + 4*4 + SCRIPT_IMAGE_DIGEST_SIZE + nodes_size - 1] = 0;
+    if (LoadScriptImage(image, size, test_digest, len) != NULL) {
+        fprintf(stderr, "image with a cycle loaded\n");
+        ++*errors;
+    }
+    free(image);
 }
 
 int test() {
@@ -144,6 +250,28 @@ int test() {
     expect("if \"\" then yes endif", "", &errors);
     expect("if \"\"; t then yes endif", "yes", &errors);
 
+    // long chains of statements, and of concatenations
+    char* script = malloc(20000 * 4 + 16);
+    char* p = script;
+    int i;
+    for (i = 0; i < 20000; ++i) {
+        p += sprintf(p, "%c; ", 'a' + i % 26);
+    }
+    strcpy(p, "end");
+    expect(script, "end", &errors);
+    p = script;
+    for (i = 0; i < 2000; ++i) {
+        p += sprintf(p, "%s%c", i ? " + " : "", 'a' + i % 2);
+    }
+    char* expected = malloc(2001);
+    for (i = 0; i < 2000; ++i) {
+        expected[i] = 'a' + i % 2;
+    }
+    expected[2000] = '\0';
+    expect(script, expected, &errors);
+    free(expected);
+    free(script);
+
     // numeric comparisons
     expect("less_than_int(3, 14)", "t", &errors);
     expect("less_than_int(14, 3)", "", &errors);
@@ -154,6 +282,8 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    expect_rejected_images(&errors);
+
     printf("\n");
 
     return errors;
@@ -173,6 +303,59 @@ void ExprDump(int depth, Expr* n, char* script) {
     }
 }
 
+// Stands in for the device's functions when precompiling a script.
+static Value* DeviceFn(const char* name, State* state,
+                       int argc, Expr* argv[]) {
+    return ErrorAbort(state, "%s() is only available on the device", name);
+}
+
+// edify -c <script> <image>:  parse a script and write the image
+// of it that the updater can load in place of parsing.
+static int PrecompileScript(const char* script_path, const char* image_path) {
+    FILE* f = fopen(script_path, "rb");
+    if (f == NULL) {
+        printf("can't open %s: %s\n", script_path, strerror(errno));
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char* buffer = malloc(size + 1);
+    if (fread(buffer, 1, size, f) != (size_t)size) {
+        printf("failed to read %s\n", script_path);
+        return 1;
+    }
+    fclose(f);
+    buffer[size] = '\0';
+
+    // The device registers functions we don't know about here.
+    SetUnknownFunction(DeviceFn);
+
+    Expr* root;
+    int error_count = 0;
+    yy_scan_bytes(buffer, size);
+    int error = yyparse(&root, &error_count);
+    if (error != 0 || error_count > 0) {
+        printf("%d parse errors\n", error_count);
+        return 1;
+    }
+
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    Sha1(buffer, size, digest);
+
+    f = fopen(image_path, "wb");
+    if (f == NULL) {
+        printf("can't open %s: %s\n", image_path, strerror(errno));
+        return 1;
+    }
+    if (WriteScriptImage(f, root, digest) != 0 || fclose(f) != 0) {
+        printf("failed to write %s\n", image_path);
+        unlink(image_path);
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
     RegisterBuiltins();
     FinishRegistration();
@@ -181,6 +364,10 @@ int main(int argc, char** argv) {
         return test() != 0;
     }
 
+    if (argc == 4 && strcmp(argv[1], "-c") == 0) {
+        return PrecompileScript(argv[2], argv[3]);
+    }
+
     FILE* f = fopen(argv[1], "r");
     if (f == NULL) {
         printf("%s: %s: No such file or directory\n", argv[0], argv[1]);
@@ -199,6 +386,7 @@ int main(int argc, char** argv) {
     if (error == 0 || error_count > 0) {
 
         ExprDump(0, root, buffer);
+        CompileExpr(root);
 
         State state;
         state.cookie = NULL;
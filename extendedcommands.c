@@ -33,13 +33,17 @@
 
 #include "commands.h"
 #include "amend/amend.h"
+#include "traceutils/trace.h"
+#include "spawnutils/spawn.h"
 
 #include "mtdutils/mtdutils.h"
+#include "mtdutils/mounts.h"
 #include "mtdutils/dump_image.h"
 #include "../../external/yaffs2/yaffs2/utils/mkyaffs2image.h"
 #include "../../external/yaffs2/yaffs2/utils/unyaffs.h"
 
 #include "extendedcommands.h"
+#include "fileops.h"
 #include "nandroid.h"
 
 int signature_check_enabled = 1;
@@ -139,15 +143,106 @@ void free_string_array(char** array)
     free(array);
 }
 
+static int compare_string_ptrs(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static char** copy_string_array(char** array, int count)
+{
+    if (array == NULL)
+        return NULL;
+    char** copy = (char**) malloc((count+1)*sizeof(char*));
+    int i;
+    for (i = 0; i < count; i++)
+        copy[i] = strdup(array[i]);
+    copy[count] = NULL;
+    return copy;
+}
+
+// Listings of the last few directories we showed, keyed by the
+// directory's mtime.  Adding, removing or renaming an entry bumps the
+// mtime, so a match means the listing is still good.
+typedef struct {
+    char* directory;
+    char* filter;       // the extension, or NULL for a directory listing
+    time_t mtime;
+    char** files;
+    int numFiles;
+} DirListing;
+
+#define DIR_LISTING_CACHE_SIZE 8
+static DirListing dir_listing_cache[DIR_LISTING_CACHE_SIZE];
+static int dir_listing_cache_next = 0;
+
+static int same_filter(const char* a, const char* b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static DirListing* find_dir_listing(const char* directory, const char* filter)
+{
+    int i;
+    for (i = 0; i < DIR_LISTING_CACHE_SIZE; i++) {
+        DirListing* l = &dir_listing_cache[i];
+        if (l->directory != NULL && strcmp(l->directory, directory) == 0 && same_filter(l->filter, filter))
+            return l;
+    }
+    return NULL;
+}
+
+static void clear_dir_listing(DirListing* l)
+{
+    free(l->directory);
+    free(l->filter);
+    free_string_array(l->files);
+    memset(l, 0, sizeof(*l));
+}
+
+// Forget the listings of everything under prefix, or all of them if
+// prefix is NULL.
+void invalidate_dir_listing_cache(const char* prefix)
+{
+    int i;
+    for (i = 0; i < DIR_LISTING_CACHE_SIZE; i++) {
+        DirListing* l = &dir_listing_cache[i];
+        if (l->directory == NULL)
+            continue;
+        if (prefix == NULL || strncmp(l->directory, prefix, strlen(prefix)) == 0)
+            clear_dir_listing(l);
+    }
+}
+
+static void store_dir_listing(const char* directory, const char* filter, time_t mtime, char** files, int numFiles)
+{
+    // Directory mtimes only have a resolution of a second (two on vfat), so
+    // a listing taken in the same tick as a change could miss it and still
+    // look current later.  Don't remember those.
+    if (mtime + 2 >= time(NULL))
+        return;
+    DirListing* l = find_dir_listing(directory, filter);
+    if (l == NULL) {
+        l = &dir_listing_cache[dir_listing_cache_next];
+        dir_listing_cache_next = (dir_listing_cache_next + 1) % DIR_LISTING_CACHE_SIZE;
+    }
+    clear_dir_listing(l);
+    l->directory = strdup(directory);
+    l->filter = filter == NULL ? NULL : strdup(filter);
+    l->mtime = mtime;
+    l->files = copy_string_array(files, numFiles);
+    l->numFiles = numFiles;
+}
+
 char** gather_files(const char* directory, const char* fileExtensionOrDirectory, int* numFiles)
 {
-    char path[PATH_MAX] = "";
     DIR *dir;
     struct dirent *de;
+    struct stat dir_info;
     int total = 0;
-    int i;
+    int allocd = 0;
     char** files = NULL;
-    int pass;
     *numFiles = 0;
     int dirLen = strlen(directory);
 
@@ -156,62 +251,61 @@ char** gather_files(const char* directory, const char* fileExtensionOrDirectory,
         ui_print("Couldn't open directory.\n");
         return NULL;
     }
-  
+
+    int have_mtime = fstat(dirfd(dir), &dir_info) == 0;
+    if (have_mtime) {
+        DirListing* l = find_dir_listing(directory, fileExtensionOrDirectory);
+        if (l != NULL && l->mtime == dir_info.st_mtime) {
+            closedir(dir);
+            *numFiles = l->numFiles;
+            return copy_string_array(l->files, l->numFiles);
+        }
+    }
+
     int extension_length = 0;
     if (fileExtensionOrDirectory != NULL)
         extension_length = strlen(fileExtensionOrDirectory);
-  
-    int isCounting = 1;
-    i = 0;
-    for (pass = 0; pass < 2; pass++) {
-        while ((de=readdir(dir)) != NULL) {
-            // skip hidden files
-            if (de->d_name[0] == '.')
+
+    while ((de=readdir(dir)) != NULL) {
+        // skip hidden files
+        if (de->d_name[0] == '.')
+            continue;
+
+        int nameLen = strlen(de->d_name);
+        // NULL means that we are gathering directories, so skip this
+        if (fileExtensionOrDirectory != NULL)
+        {
+            // make sure that we can have the desired extension (prevent seg fault)
+            if (nameLen < extension_length)
                 continue;
-            
-            // NULL means that we are gathering directories, so skip this
-            if (fileExtensionOrDirectory != NULL)
-            {
-                // make sure that we can have the desired extension (prevent seg fault)
-                if (strlen(de->d_name) < extension_length)
-                    continue;
-                // compare the extension
-                if (strcmp(de->d_name + strlen(de->d_name) - extension_length, fileExtensionOrDirectory) != 0)
-                    continue;
-            }
-            else
-            {
-                struct stat info;
-                char fullFileName[PATH_MAX];
-                strcpy(fullFileName, directory);
-                strcat(fullFileName, de->d_name);
-                stat(fullFileName, &info);
-                // make sure it is a directory
-                if (!(S_ISDIR(info.st_mode)))
-                    continue;
-            }
-            
-            if (pass == 0)
-            {
-                total++;
+            // compare the extension
+            if (strcmp(de->d_name + nameLen - extension_length, fileExtensionOrDirectory) != 0)
                 continue;
-            }
-            
-            files[i] = (char*) malloc(dirLen + strlen(de->d_name) + 2);
-            strcpy(files[i], directory);
-            strcat(files[i], de->d_name);
-            if (fileExtensionOrDirectory == NULL)
-                strcat(files[i], "/");
-            i++;
         }
-        if (pass == 1)
-            break;
-        if (total == 0)
-            break;
-        rewinddir(dir);
-        *numFiles = total;
-        files = (char**) malloc((total+1)*sizeof(char*));
-        files[total]=NULL;
+        else if (de->d_type != DT_DIR)
+        {
+            // the filesystem didn't tell us, or it's a symlink that may
+            // point at a directory; fall back to stat
+            if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
+                continue;
+            struct stat info;
+            char fullFileName[PATH_MAX];
+            snprintf(fullFileName, PATH_MAX, "%s%s", directory, de->d_name);
+            // make sure it is a directory
+            if (stat(fullFileName, &info) != 0 || !(S_ISDIR(info.st_mode)))
+                continue;
+        }
+
+        if (total + 1 >= allocd) {
+            allocd = allocd == 0 ? 64 : allocd * 2;
+            files = (char**) realloc(files, allocd*sizeof(char*));
+        }
+        files[total] = (char*) malloc(dirLen + nameLen + 2);
+        memcpy(files[total], directory, dirLen);
+        memcpy(files[total] + dirLen, de->d_name, nameLen + 1);
+        if (fileExtensionOrDirectory == NULL)
+            strcpy(files[total] + dirLen + nameLen, "/");
+        total++;
     }
 
     if(closedir(dir) < 0) {
@@ -219,23 +313,17 @@ char** gather_files(const char* directory, const char* fileExtensionOrDirectory,
     }
 
     if (total==0) {
-        return NULL;
+        free(files);
+        files = NULL;
+    } else {
+        files[total] = NULL;
+        // sort the result
+        qsort(files, total, sizeof(char*), compare_string_ptrs);
     }
+    *numFiles = total;
 
-	// sort the result
-	if (files != NULL) {
-		for (i = 0; i < total; i++) {
-			int curMax = -1;
-			int j;
-			for (j = 0; j < total - i; j++) {
-				if (curMax == -1 || strcmp(files[curMax], files[j]) < 0)
-					curMax = j;
-			}
-			char* temp = files[curMax];
-			files[curMax] = files[total - i - 1];
-			files[total - i - 1] = temp;
-		}
-	}
+    if (have_mtime)
+        store_dir_listing(directory, fileExtensionOrDirectory, dir_info.st_mtime, files, total);
 
     return files;
 }
@@ -369,6 +457,8 @@ __system(const char *command)
     sigprocmask(SIG_SETMASK, &omask, NULL);
     (void)bsd_signal(SIGINT, intsave);
     (void)bsd_signal(SIGQUIT, quitsave);
+    // the command may have mounted or unmounted something
+    invalidate_mounted_volumes();
     return (pid == -1 ? -1 : pstat);
 }
 
@@ -392,11 +482,93 @@ void show_nandroid_restore_menu()
         nandroid_restore(file, 1, 1, 1, 1, 1);
 }
 
+#ifndef BOARD_UMS_LUNFILE
+#define BOARD_UMS_LUNFILE "/sys/devices/platform/s3c-usbgadget/gadget/lun1/file"
+#endif
+
+// A root handed to the USB gadget, and whether it has to be mounted
+// again when we take it back.
+typedef struct {
+    const char* root;
+    const char* lunfile;
+    int was_mounted;
+    int exported;
+} UmsExport;
+
+static UmsExport ums_exports[] = {
+    { "SDCARD:", BOARD_UMS_LUNFILE, 0, 0 },
+};
+#define NUM_UMS_EXPORTS (sizeof(ums_exports) / sizeof(ums_exports[0]))
+
+// Write straight to sysfs rather than through the shell, so that we
+// don't have to throw away the mount table afterwards.
+static int write_lun_file(const char* lunfile, const char* value)
+{
+    int fd = open(lunfile, O_WRONLY);
+    if (fd < 0) {
+        LOGE("Unable to open %s\n(%s)\n", lunfile, strerror(errno));
+        return -1;
+    }
+    int len = strlen(value);
+    int ret = write(fd, value, len) == len ? 0 : -1;
+    if (ret != 0)
+        LOGE("Unable to write %s\n(%s)\n", lunfile, strerror(errno));
+    close(fd);
+    return ret;
+}
+
+static int ums_export_root(UmsExport* e)
+{
+    const char* device = get_dev_for_root(e->root);
+    if (device == NULL)
+        return -1;
+
+    // the host gets the raw block device, so we must not have it mounted
+    e->was_mounted = is_root_path_mounted(e->root) > 0;
+    if (e->was_mounted) {
+        sync();
+        if (0 != ensure_root_path_unmounted(e->root)) {
+            LOGE("Can't unmount %s\n", e->root);
+            return -1;
+        }
+    }
+    if (0 != write_lun_file(e->lunfile, device)) {
+        if (e->was_mounted)
+            ensure_root_path_mounted(e->root);
+        return -1;
+    }
+    e->exported = 1;
+    return 0;
+}
+
+static void ums_release_root(UmsExport* e)
+{
+    if (!e->exported)
+        return;
+    write_lun_file(e->lunfile, "\n");
+    e->exported = 0;
+
+    // the host may have changed anything on it, but nothing else
+    const char* mount_point = get_mount_point_for_root(e->root);
+    if (mount_point != NULL)
+        invalidate_dir_listing_cache(mount_point);
+    if (e->was_mounted)
+        ensure_root_path_mounted(e->root);
+}
+
 void show_mount_usb_storage_menu()
 {
-    char command[PATH_MAX];
-    sprintf(command, "echo %s > /sys/devices/platform/s3c-usbgadget/gadget/lun1/file", SDCARD_DEVICE_PRIMARY);
-    __system(command);
+    int i;
+    int exported = 0;
+    for (i = 0; i < NUM_UMS_EXPORTS; i++) {
+        if (0 == ums_export_root(&ums_exports[i]))
+            exported++;
+    }
+    if (exported == 0) {
+        ui_print("Unable to enable USB mass storage.\n");
+        return;
+    }
+
     static char* headers[] = {  "USB Mass Storage device",
                                 "Leaving this menu unmount",
                                 "your SD card from your PC.",
@@ -412,9 +584,9 @@ void show_mount_usb_storage_menu()
         if (chosen_item == GO_BACK || chosen_item == 0)
             break;
     }
-    
-    __system("echo '' > /sys/devices/platform/s3c-usbgadget/gadget/lun2/file");
-    __system("echo 0 > /sys/devices/platform/s3c-usbgadget/gadget/lun2/file");
+
+    for (i = 0; i < NUM_UMS_EXPORTS; i++)
+        ums_release_root(&ums_exports[i]);
 }
 
 int confirm_selection(const char* title, const char* confirm)
@@ -463,11 +635,7 @@ int format_non_mtd_device(const char* root)
         return 0;
     }
 
-    static char tmp[PATH_MAX];
-    sprintf(tmp, "rm -rf %s/*", path);
-    __system(tmp);
-    sprintf(tmp, "rm -rf %s/.*", path);
-    __system(tmp);
+    rm_contents(path, NULL, NULL);
     
     ensure_root_path_unmounted(root);
     return 0;
@@ -568,7 +736,7 @@ int convert_mtd_device(const char *root, const char* fs_list)
         }
 
     	// create folder for backup [/sdcard/ebrecovery/tmp] [mkdir -p /sdcard/ebrecovery/tmp]
-    	if (0 != __system("mkdir -p /sdcard/ebrecovery/tmp")) {
+    	if (0 != mkdir_p("/sdcard/ebrecovery/tmp")) {
     		ui_print("Can't create tmp folder for backup\n");
     		return -1;
     	}
@@ -617,7 +785,7 @@ int convert_mtd_device(const char *root, const char* fs_list)
     	// check size of $root ?
     	// delete temp backup files (delete tmp folder)
         ui_show_indeterminate_progress();
-    	if (0 != __system("rm /sdcard/ebrecovery/tmp/ctmp.tar")) {
+    	if (0 != unlink("/sdcard/ebrecovery/tmp/ctmp.tar")) {
     		ui_print("Can't remove backup file\n");
     		return -1;
     	}
@@ -797,7 +965,10 @@ int run_script_from_buffer(char* script_data, int script_len, char* filename)
 
     /* Execute the script.
      */
+    TraceStartFromEnv();
     int ret = execCommandList((ExecContext *)1, commands);
+    TraceFinish(TRACE_SUMMARY_TOP);
+    StopCoprocess();
     if (ret != 0) {
         int num = ret;
         char *line = NULL, *next = script_data;
@@ -839,8 +1010,8 @@ int run_script(char* filename)
 int run_and_remove_extendedcommand()
 {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cp %s /tmp/%s", EXTENDEDCOMMAND_SCRIPT, basename(EXTENDEDCOMMAND_SCRIPT));
-    __system(tmp);
+    sprintf(tmp, "/tmp/%s", basename(EXTENDEDCOMMAND_SCRIPT));
+    cp_file(EXTENDEDCOMMAND_SCRIPT, tmp);
     remove(EXTENDEDCOMMAND_SCRIPT);
     int i = 0;
     for (i = 20; i > 0; i--) {
@@ -1155,7 +1326,7 @@ void dumping_odin_image(const char* root)
         return;
     }
 
-    if (0 != __system("mkdir -p /sdcard/ebrecovery/odin/tmp")) {
+    if (0 != mkdir_p("/sdcard/ebrecovery/odin/tmp")) {
 		ui_print("Can't create tmp folder for backup\n");
 		return -1;
 	}
@@ -1182,7 +1353,7 @@ void dumping_odin_image(const char* root)
 		return -1;
 	}
 
-    __system("rm -r /sdcard/ebrecovery/odin/tmp");
+    rm_r("/sdcard/ebrecovery/odin/tmp", NULL, NULL);
 
     ui_print("Done\n");
 }
@@ -1260,9 +1431,9 @@ void show_advanced_menu()
                 ensure_root_path_mounted("SDEXT:");
                 ensure_root_path_mounted("CACHE:");
                 if (confirm_selection( "Confirm wipe?", "Yes - Wipe Dalvik Cache")) {
-                    __system("rm -r /data/dalvik-cache");
-                    __system("rm -r /cache/dalvik-cache");
-                    __system("rm -r /sd-ext/dalvik-cache");
+                    rm_r("/data/dalvik-cache", NULL, NULL);
+                    rm_r("/cache/dalvik-cache", NULL, NULL);
+                    rm_r("/sd-ext/dalvik-cache", NULL, NULL);
                 }
                 ensure_root_path_unmounted("DATA:");
                 ui_print("Dalvik Cache wiped.\n");
@@ -1414,7 +1585,7 @@ void write_fstab_root(char *root_path, FILE *file)
 
 void create_fstab()
 {
-    __system("touch /etc/mtab");
+    close(open("/etc/mtab", O_WRONLY | O_CREAT, 0644));
     FILE *file = fopen("/etc/fstab", "w");
     if (file == NULL) {
         LOGW("Unable to create /etc/fstab!");
@@ -1436,7 +1607,7 @@ void handle_failure(int ret)
     if (0 != ensure_root_path_mounted("SDCARD:"))
         return;
     mkdir("/sdcard/ebrecovery", S_IRWXU);
-    __system("cp /tmp/recovery.log /sdcard/ebrecovery/recovery.log");
+    cp_file("/tmp/recovery.log", "/sdcard/ebrecovery/recovery.log");
     ui_print("/tmp/recovery.log was copied to /sdcard/ebrecovery/recovery.log.\n");
 }
 
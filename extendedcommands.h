@@ -10,6 +10,15 @@ toggle_script_asserts();
 void
 show_choose_zip_menu();
 
+char**
+gather_files(const char* directory, const char* fileExtensionOrDirectory, int* numFiles);
+
+void
+free_string_array(char** array);
+
+void
+invalidate_dir_listing_cache(const char* prefix);
+
 int
 do_nandroid_backup(const char* backup_name);
 
@@ -0,0 +1,240 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "minzip/DirUtil.h"
+#include "md5.h"
+#include "fileops.h"
+
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+int mkdir_p(const char* path)
+{
+    return dirCreateHierarchy(path, 0755, NULL, false);
+}
+
+static int is_dot_or_dotdot(const char* name)
+{
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static int remove_directory_entries(const char* path, fileops_callback callback, void* cookie);
+
+static int remove_entry(const char* path, int is_dir, fileops_callback callback, void* cookie)
+{
+    if (callback != NULL)
+        callback(path, cookie);
+    if (!is_dir)
+        return unlink(path);
+    if (remove_directory_entries(path, callback, cookie) != 0)
+        return -1;
+    return rmdir(path);
+}
+
+static int remove_directory_entries(const char* path, fileops_callback callback, void* cookie)
+{
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+
+    int ret = 0;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (is_dot_or_dotdot(de->d_name))
+            continue;
+
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= (int)sizeof(child)) {
+            errno = ENAMETOOLONG;
+            ret = -1;
+            continue;
+        }
+
+        // d_type saves an lstat for everything but odd filesystems
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(child, &st) != 0) {
+                ret = -1;
+                continue;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        // keep going like rm -rf does, but remember that something failed
+        if (remove_entry(child, is_dir, callback, cookie) != 0)
+            ret = -1;
+    }
+    closedir(dir);
+    return ret;
+}
+
+int rm_r(const char* path, fileops_callback callback, void* cookie)
+{
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return errno == ENOENT ? 0 : -1;
+    return remove_entry(path, S_ISDIR(st.st_mode), callback, cookie);
+}
+
+int rm_contents(const char* path, fileops_callback callback, void* cookie)
+{
+    return remove_directory_entries(path, callback, cookie);
+}
+
+int cp_file(const char* src, const char* dst)
+{
+    struct stat st;
+    int in = open(src, O_RDONLY);
+    if (in < 0)
+        return -1;
+    if (fstat(in, &st) != 0) {
+        close(in);
+        return -1;
+    }
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    char* buffer = malloc(COPY_BUFFER_SIZE);
+    int ret = buffer == NULL ? -1 : 0;
+    while (ret == 0) {
+        ssize_t n = read(in, buffer, COPY_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ret = n;
+            break;
+        }
+        char* p = buffer;
+        while (n > 0) {
+            ssize_t written = write(out, p, n);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                ret = -1;
+                break;
+            }
+            p += written;
+            n -= written;
+        }
+    }
+    free(buffer);
+    close(in);
+    if (close(out) != 0)
+        ret = -1;
+    return ret < 0 ? -1 : 0;
+}
+
+static void walk_directory(const char* path, TreeStats* stats, tree_stats_callback callback, void* cookie)
+{
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return;
+
+    TreeStats here;
+    memset(&here, 0, sizeof(here));
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (is_dot_or_dotdot(de->d_name))
+            continue;
+        here.entries++;
+
+        // only directories and regular files need a closer look; d_type
+        // lets us skip the lstat for everything else
+        if (de->d_type != DT_DIR && de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+            continue;
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= (int)sizeof(child))
+            continue;
+        int is_dir = de->d_type == DT_DIR;
+        if (!is_dir) {
+            struct stat st;
+            if (lstat(child, &st) != 0)
+                continue;
+            if (S_ISREG(st.st_mode))
+                here.bytes += st.st_size;
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            here.directories++;
+            walk_directory(child, &here, callback, cookie);
+        }
+    }
+    closedir(dir);
+
+    if (callback != NULL)
+        callback(path, &here, cookie);
+    stats->entries += here.entries;
+    stats->directories += here.directories;
+    stats->bytes += here.bytes;
+}
+
+int tree_stats(const char* path, TreeStats* stats, tree_stats_callback callback, void* cookie)
+{
+    struct stat st;
+    memset(stats, 0, sizeof(*stats));
+    if (lstat(path, &st) != 0)
+        return -1;
+    stats->entries = 1;
+    if (!S_ISDIR(st.st_mode)) {
+        if (S_ISREG(st.st_mode))
+            stats->bytes = st.st_size;
+        return 0;
+    }
+    stats->directories = 1;
+    walk_directory(path, stats, callback, cookie);
+    return 0;
+}
+
+int count_entries(const char* path)
+{
+    TreeStats stats;
+    if (tree_stats(path, &stats, NULL, NULL) != 0)
+        return -1;
+    return stats.entries;
+}
+
+int md5_file(const char* path, char* hex)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    char* buffer = malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    MD5_CTX ctx;
+    MD5_init(&ctx);
+    ssize_t n;
+    while ((n = read(fd, buffer, COPY_BUFFER_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buffer);
+            close(fd);
+            return -1;
+        }
+        MD5_update(&ctx, buffer, n);
+    }
+    free(buffer);
+    close(fd);
+
+    const uint8_t* digest = MD5_final(&ctx);
+    int i;
+    for (i = 0; i < MD5_DIGEST_SIZE; i++)
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    return 0;
+}
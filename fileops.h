@@ -0,0 +1,45 @@
+#ifndef FILEOPS_H
+#define FILEOPS_H
+
+#include <stdint.h>
+
+// In-process versions of the shell commands recovery used to run
+// through __system().  They all return 0 on success and -1 (with errno
+// set) on failure, like the syscalls they're made of.
+
+// Called for every file or directory an operation is about to touch.
+typedef void (*fileops_callback)(const char* path, void* cookie);
+
+// mkdir -p <path>
+int mkdir_p(const char* path);
+
+// rm -rf <path>.  A path that doesn't exist is not an error.
+int rm_r(const char* path, fileops_callback callback, void* cookie);
+
+// rm -rf <path>/* <path>/.*, leaving <path> itself in place.
+int rm_contents(const char* path, fileops_callback callback, void* cookie);
+
+// cp <src> <dst>
+int cp_file(const char* src, const char* dst);
+
+typedef struct {
+    int entries;        // everything find would list, <path> included
+    int directories;
+    int64_t bytes;      // total size of the regular files
+} TreeStats;
+
+// Called as each directory is finished, with the totals for its subtree.
+typedef void (*tree_stats_callback)(const char* path, const TreeStats* stats, void* cookie);
+
+// Walks <path> without following symlinks and adds up what's in it.
+int tree_stats(const char* path, TreeStats* stats, tree_stats_callback callback, void* cookie);
+
+// find <path> | wc -l
+int count_entries(const char* path);
+
+#define MD5_HEX_SIZE 33
+
+// md5sum <path>; hex must have room for MD5_HEX_SIZE chars.
+int md5_file(const char* path, char* hex);
+
+#endif
@@ -0,0 +1,49 @@
+ifneq ($(TARGET_SIMULATOR),true)
+
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := sha1.c dirhash.c
+LOCAL_MODULE := libhashutils
+
+include $(BUILD_STATIC_LIBRARY)
+
+# For host tools (edify -c).
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := sha1.c dirhash.c
+LOCAL_MODULE := libhashutils
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := sha1_bench.c
+LOCAL_MODULE := sha1_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_STATIC_LIBRARIES := libhashutils libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := sha1_bench.c
+LOCAL_MODULE := sha1_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_STATIC_LIBRARIES := libhashutils
+LOCAL_LDLIBS += -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := dirhash_test.c
+LOCAL_MODULE := dirhash_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_STATIC_LIBRARIES := libhashutils
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+endif  # !TARGET_SIMULATOR
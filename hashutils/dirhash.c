@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dirhash.h"
+
+#define MAX_THREADS 8
+#define READ_BUFFER_SIZE 65536
+
+// -----------------------------------------------------------------
+//   leaf cache
+// -----------------------------------------------------------------
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    int used;
+} CacheEntry;
+
+typedef struct {
+    CacheEntry* entries;
+    int alloc;          // power of two
+    int count;
+} CacheTable;
+
+// bionic's struct stat has st_mtime_nsec where glibc has st_mtim.
+#ifdef HAVE_ANDROID_OS
+#define MTIME_NSEC(st) ((st)->st_mtime_nsec)
+#define CTIME_NSEC(st) ((st)->st_ctime_nsec)
+#else
+#define MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#define CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#endif
+
+// 'cache' has the files seen by the last walk; 'fresh' collects those
+// seen by this one, and replaces it at the end, so files that have
+// gone (or were in some other tree) are dropped.
+static pthread_mutex_t dirhash_lock = PTHREAD_MUTEX_INITIALIZER;
+static CacheTable cache;
+static CacheTable fresh;
+static time_t walk_start;
+
+static unsigned int HashInode(uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino ^ (dev << 32) ^ (dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(h >> 32);
+}
+
+static CacheEntry* CacheSlot(CacheEntry* table, int alloc,
+                             uint64_t dev, uint64_t ino) {
+    unsigned int i = HashInode(dev, ino) & (alloc - 1);
+    while (table[i].used && (table[i].dev != dev || table[i].ino != ino)) {
+        i = (i + 1) & (alloc - 1);
+    }
+    return table + i;
+}
+
+static int CacheMatches(const CacheEntry* c, const struct stat* st) {
+    return c->used &&
+        c->size == (int64_t)st->st_size &&
+        c->mtime_sec == (int64_t)st->st_mtime &&
+        c->mtime_nsec == (int64_t)MTIME_NSEC(st) &&
+        c->ctime_sec == (int64_t)st->st_ctime &&
+        c->ctime_nsec == (int64_t)CTIME_NSEC(st);
+}
+
+static void CachePut(CacheTable* t, const CacheEntry* e) {
+    if ((t->count + 1) * 2 > t->alloc) {
+        int new_alloc = t->alloc ? t->alloc * 2 : 1024;
+        CacheEntry* table = calloc(new_alloc, sizeof(CacheEntry));
+        int i;
+        for (i = 0; i < t->alloc; ++i) {
+            if (!t->entries[i].used) continue;
+            *CacheSlot(table, new_alloc, t->entries[i].dev,
+                       t->entries[i].ino) = t->entries[i];
+        }
+        free(t->entries);
+        t->entries = table;
+        t->alloc = new_alloc;
+    }
+    CacheEntry* c = CacheSlot(t->entries, t->alloc, e->dev, e->ino);
+    if (!c->used) ++t->count;
+    *c = *e;
+    c->used = 1;
+}
+
+// Returns the digest the last walk found for this file, if it hasn't
+// changed since; and keeps it for the next walk.
+static const uint8_t* CacheLookup(const struct stat* st) {
+    if (cache.count == 0) return NULL;
+    CacheEntry* c = CacheSlot(cache.entries, cache.alloc,
+                              st->st_dev, st->st_ino);
+    if (!CacheMatches(c, st)) return NULL;
+    CachePut(&fresh, c);
+    return c->digest;
+}
+
+static void CacheStore(const struct stat* st, const uint8_t* digest) {
+    // Many filesystems (yaffs2, rfs, ext3) keep whole seconds, so a
+    // file changed within the second it was stat()ed in can keep the
+    // same size and times.  Only remember files that were last changed
+    // well before this walk started.
+    if (st->st_mtime >= walk_start - 1 || st->st_ctime >= walk_start - 1) {
+        return;
+    }
+    CacheEntry e;
+    memset(&e, 0, sizeof(e));
+    e.dev = st->st_dev;
+    e.ino = st->st_ino;
+    e.size = st->st_size;
+    e.mtime_sec = st->st_mtime;
+    e.mtime_nsec = MTIME_NSEC(st);
+    e.ctime_sec = st->st_ctime;
+    e.ctime_nsec = CTIME_NSEC(st);
+    memcpy(e.digest, digest, SHA1_DIGEST_SIZE);
+    CachePut(&fresh, &e);
+}
+
+// -----------------------------------------------------------------
+//   walking the tree
+// -----------------------------------------------------------------
+
+typedef struct {
+    char* name;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    int dir;            // index of the subdirectory, or -1
+    uint8_t digest[SHA1_DIGEST_SIZE];
+} Entry;
+
+typedef struct {
+    Entry* entries;
+    int count;
+    uint8_t digest[SHA1_DIGEST_SIZE];
+} Dir;
+
+// A file whose contents have to be read.
+typedef struct {
+    char* path;
+    int dir;
+    int entry;
+    struct stat st;
+    int failed;
+} Job;
+
+typedef struct {
+    Dir* dirs;
+    int dirs_count;
+    int dirs_alloc;
+    Job* jobs;
+    int jobs_count;
+    int jobs_alloc;
+    int next_job;
+    pthread_mutex_t lock;
+} Walk;
+
+static int CompareEntryName(const void* a, const void* b) {
+    return strcmp(((const Entry*)a)->name, ((const Entry*)b)->name);
+}
+
+static void AddJob(Walk* w, const char* path, int dir, int entry,
+                   const struct stat* st) {
+    if (w->jobs_count >= w->jobs_alloc) {
+        w->jobs_alloc = w->jobs_alloc * 2 + 256;
+        w->jobs = realloc(w->jobs, w->jobs_alloc * sizeof(Job));
+    }
+    Job* j = w->jobs + w->jobs_count++;
+    j->path = strdup(path);
+    j->dir = dir;
+    j->entry = entry;
+    j->st = *st;
+    j->failed = 0;
+}
+
+// Fill in the entry for 'name' in directory fd (at 'path').  Returns
+// 0, or -1 on error.
+static int VisitEntry(Walk* w, int dir, int fd, const char* path,
+                      const char* name, Entry* e, const struct stat* st);
+
+// Read the directory 'fd' (which this takes over) into a new Dir.
+// Returns the Dir's index, or -1 on error.
+static int WalkDir(Walk* w, int fd, const char* path) {
+    DIR* d = fdopendir(fd);
+    if (d == NULL) {
+        printf("can't open %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (w->dirs_count >= w->dirs_alloc) {
+        w->dirs_alloc = w->dirs_alloc * 2 + 64;
+        w->dirs = realloc(w->dirs, w->dirs_alloc * sizeof(Dir));
+    }
+    int index = w->dirs_count++;
+    Entry* entries = NULL;
+    int count = 0;
+    int alloc = 0;
+
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (count >= alloc) {
+            alloc = alloc * 2 + 16;
+            entries = realloc(entries, alloc * sizeof(Entry));
+        }
+        entries[count].name = strdup(de->d_name);
+        entries[count].dir = -1;
+        ++count;
+    }
+    qsort(entries, count, sizeof(Entry), CompareEntryName);
+    w->dirs[index].entries = entries;
+    w->dirs[index].count = count;
+
+    // Subdirectories are visited after the readdir() so only one DIR
+    // per level is open at a time.
+    int status = 0;
+    size_t path_len = strlen(path);
+    int i;
+    for (i = 0; i < count && status == 0; ++i) {
+        Entry* e = w->dirs[index].entries + i;
+        char* child = malloc(path_len + strlen(e->name) + 2);
+        sprintf(child, "%s%s%s", path,
+                (path_len > 0 && path[path_len-1] == '/') ? "" : "/", e->name);
+        struct stat st;
+        if (fstatat(dirfd(d), e->name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            printf("can't stat %s: %s\n", child, strerror(errno));
+            status = -1;
+        } else {
+            status = VisitEntry(w, index, dirfd(d), child, e->name, e, &st);
+        }
+        free(child);
+    }
+    closedir(d);
+    return status == 0 ? index : -1;
+}
+
+static int VisitEntry(Walk* w, int dir, int fd, const char* path,
+                      const char* name, Entry* e, const struct stat* st) {
+    e->mode = st->st_mode;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    memset(e->digest, 0, SHA1_DIGEST_SIZE);
+
+    if (S_ISDIR(st->st_mode)) {
+        int child_fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (child_fd < 0) {
+            printf("can't open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        e->dir = WalkDir(w, child_fd, path);
+        if (e->dir < 0) return -1;
+    } else if (S_ISREG(st->st_mode)) {
+        const uint8_t* cached = CacheLookup(st);
+        if (cached != NULL) {
+            memcpy(e->digest, cached, SHA1_DIGEST_SIZE);
+        } else {
+            AddJob(w, path, dir, e - w->dirs[dir].entries, st);
+        }
+    } else if (S_ISLNK(st->st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(fd, name, target, sizeof(target));
+        if (len < 0) {
+            printf("can't read link %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        Sha1(target, len, e->digest);
+    } else {
+        uint64_t rdev = st->st_rdev;
+        Sha1(&rdev, sizeof(rdev), e->digest);
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------
+//   hashing file contents
+// -----------------------------------------------------------------
+
+static int HashFile(Job* j, uint8_t* buffer, uint8_t* digest) {
+    int fd = open(j->path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        printf("can't open %s: %s\n", j->path, strerror(errno));
+        return -1;
+    }
+    Sha1Ctx ctx;
+    Sha1Init(&ctx);
+    ssize_t n;
+    while ((n = read(fd, buffer, READ_BUFFER_SIZE)) > 0) {
+        Sha1Update(&ctx, buffer, n);
+    }
+    if (n < 0) {
+        printf("can't read %s: %s\n", j->path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    memcpy(digest, Sha1Final(&ctx), SHA1_DIGEST_SIZE);
+    return 0;
+}
+
+static void* HashThread(void* cookie) {
+    Walk* w = (Walk*)cookie;
+    uint8_t* buffer = malloc(READ_BUFFER_SIZE);
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        int i = w->next_job++;
+        pthread_mutex_unlock(&w->lock);
+        if (i >= w->jobs_count) break;
+
+        Job* j = w->jobs + i;
+        Entry* e = w->dirs[j->dir].entries + j->entry;
+        j->failed = HashFile(j, buffer, e->digest) < 0;
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int RunJobs(Walk* w) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+    if (threads > w->jobs_count) threads = w->jobs_count;
+
+    pthread_t thread[MAX_THREADS];
+    int started = 0;
+    int i;
+    for (i = 1; i < threads; ++i) {
+        if (pthread_create(&thread[started], NULL, HashThread, w) == 0) {
+            ++started;
+        }
+    }
+    HashThread(w);
+    for (i = 0; i < started; ++i) {
+        pthread_join(thread[i], NULL);
+    }
+
+    int status = 0;
+    for (i = 0; i < w->jobs_count; ++i) {
+        Job* j = w->jobs + i;
+        if (j->failed) {
+            status = -1;
+        } else {
+            CacheStore(&j->st, w->dirs[j->dir].entries[j->entry].digest);
+        }
+    }
+    return status;
+}
+
+// -----------------------------------------------------------------
+//   combining
+// -----------------------------------------------------------------
+
+static void PutLE32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// Every subdirectory has a higher index than its parent, so going
+// backwards each Dir's children are done before it is.
+static void CombineDirs(Walk* w) {
+    int d;
+    for (d = w->dirs_count-1; d >= 0; --d) {
+        Dir* dir = w->dirs + d;
+        Sha1Ctx ctx;
+        Sha1Init(&ctx);
+        int i;
+        for (i = 0; i < dir->count; ++i) {
+            Entry* e = dir->entries + i;
+            if (e->dir >= 0) {
+                memcpy(e->digest, w->dirs[e->dir].digest, SHA1_DIGEST_SIZE);
+            }
+            uint8_t meta[12];
+            PutLE32(meta, e->mode);
+            PutLE32(meta+4, e->uid);
+            PutLE32(meta+8, e->gid);
+            Sha1Update(&ctx, e->name, strlen(e->name) + 1);
+            Sha1Update(&ctx, meta, sizeof(meta));
+            Sha1Update(&ctx, e->digest, SHA1_DIGEST_SIZE);
+        }
+        memcpy(dir->digest, Sha1Final(&ctx), SHA1_DIGEST_SIZE);
+    }
+}
+
+static void FreeWalk(Walk* w) {
+    int i, j;
+    for (i = 0; i < w->dirs_count; ++i) {
+        for (j = 0; j < w->dirs[i].count; ++j) {
+            free(w->dirs[i].entries[j].name);
+        }
+        free(w->dirs[i].entries);
+    }
+    free(w->dirs);
+    for (i = 0; i < w->jobs_count; ++i) {
+        free(w->jobs[i].path);
+    }
+    free(w->jobs);
+    pthread_mutex_destroy(&w->lock);
+}
+
+int HashDir(const char* path, uint8_t* digest) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        printf("can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&dirhash_lock);
+    walk_start = time(NULL);
+
+    Walk w;
+    memset(&w, 0, sizeof(w));
+    pthread_mutex_init(&w.lock, NULL);
+    int status = WalkDir(&w, fd, path) < 0 ? -1 : 0;
+    if (status == 0) {
+        status = RunJobs(&w);
+    }
+    if (status == 0) {
+        CombineDirs(&w);
+        memcpy(digest, w.dirs[0].digest, SHA1_DIGEST_SIZE);
+        printf("hashed %s: %d dirs, %d files read\n",
+               path, w.dirs_count, w.jobs_count);
+    }
+    FreeWalk(&w);
+
+    free(cache.entries);
+    cache = fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    pthread_mutex_unlock(&dirhash_lock);
+    return status;
+}
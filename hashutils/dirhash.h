@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HASHUTILS_DIRHASH_H
+#define _HASHUTILS_DIRHASH_H
+
+#include <stdint.h>
+
+#include "sha1.h"
+
+// Hashes a directory tree, for scripts that check a partition is in
+// the state they expect (hash_dir() in amend and edify).
+//
+// The result is a Merkle tree of SHA-1s.  Each directory's digest
+// covers, for every entry in name order, the name, mode, uid, gid and
+// the digest of the entry:  a file's contents, a symlink's target, a
+// device's number, or a subdirectory's own digest.  The top
+// directory's own metadata isn't included.
+//
+// File contents are hashed on a pool of threads, one per CPU.  Within
+// a process, the content digest of each file is remembered by device,
+// inode, size, mtime and ctime, so hashing the same tree again only
+// reads the files that changed since.  Files last changed within a
+// second of being hashed aren't remembered, since filesystems with
+// whole-second timestamps could hide a second change in that time;
+// and each walk forgets the files it didn't see.  Nothing is kept
+// across processes, where device and inode numbers can't be trusted
+// to mean the same file.
+
+// Hash the tree under 'path' into digest (SHA1_DIGEST_SIZE bytes).
+// Returns 0 on success, or -1 after printing the reason.
+int HashDir(const char* path, uint8_t* digest);
+
+#endif  // _HASHUTILS_DIRHASH_H
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests for HashDir():
+//
+//   dirhash_test [<scratch dir>]
+//
+// Builds small trees under the scratch directory (default /tmp) and
+// checks that changes to them change the digest -- in particular a
+// same-size rewrite that keeps the file's mtime, as happens on
+// filesystems with whole-second timestamps.  Exits nonzero on
+// failure.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "dirhash.h"
+
+static int errors = 0;
+
+static void WriteFile(const char* path, const char* contents) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL || fputs(contents, f) < 0 || fclose(f) != 0) {
+        fprintf(stderr, "can't write %s\n", path);
+        exit(1);
+    }
+}
+
+static void Hash(const char* dir, uint8_t* digest) {
+    if (HashDir(dir, digest) != 0) {
+        fprintf(stderr, "failed to hash %s\n", dir);
+        exit(1);
+    }
+}
+
+static void ExpectSame(const char* what, const uint8_t* a, const uint8_t* b) {
+    if (memcmp(a, b, SHA1_DIGEST_SIZE) != 0) {
+        fprintf(stderr, "FAIL: %s changed the digest\n", what);
+        ++errors;
+    }
+}
+
+static void ExpectDifferent(const char* what,
+                            const uint8_t* a, const uint8_t* b) {
+    if (memcmp(a, b, SHA1_DIGEST_SIZE) == 0) {
+        fprintf(stderr, "FAIL: %s didn't change the digest\n", what);
+        ++errors;
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* scratch = argc > 1 ? argv[1] : "/tmp";
+    char dir[200], file[256], sub[256], subfile[256];
+    snprintf(dir, sizeof(dir), "%s/dirhash_test.%d", scratch, (int)getpid());
+    snprintf(file, sizeof(file), "%s/a", dir);
+    snprintf(sub, sizeof(sub), "%s/sub", dir);
+    snprintf(subfile, sizeof(subfile), "%s/sub/b", dir);
+    if (mkdir(dir, 0755) != 0 || mkdir(sub, 0755) != 0) {
+        fprintf(stderr, "can't make %s\n", dir);
+        return 1;
+    }
+
+    uint8_t first[SHA1_DIGEST_SIZE], second[SHA1_DIGEST_SIZE];
+
+    WriteFile(file, "hello");
+    WriteFile(subfile, "world");
+    Hash(dir, first);
+    Hash(dir, second);
+    ExpectSame("hashing again", first, second);
+
+    // Rewrite a file with the same size and put its mtime back, as a
+    // filesystem with whole-second times would show a rewrite within
+    // the same second.
+    struct utimbuf old_times = { 1217592000, 1217592000 };
+    utime(file, &old_times);
+    Hash(dir, first);
+    WriteFile(file, "jello");
+    utime(file, &old_times);
+    Hash(dir, second);
+    ExpectDifferent("a same-size rewrite with the same mtime", first, second);
+
+    // The same in a subdirectory, after the tree has had time to
+    // settle so that its files are cached.
+    sleep(2);
+    Hash(dir, first);
+    Hash(dir, second);
+    ExpectSame("hashing a settled tree again", first, second);
+    struct stat st;
+    stat(subfile, &st);
+    struct utimbuf sub_times = { st.st_atime, st.st_mtime };
+    WriteFile(subfile, "wurld");
+    utime(subfile, &sub_times);
+    Hash(dir, second);
+    ExpectDifferent("a same-size rewrite of a cached file", first, second);
+
+    // Mode changes count too.
+    Hash(dir, first);
+    chmod(file, 0600);
+    Hash(dir, second);
+    ExpectDifferent("a chmod", first, second);
+
+    unlink(subfile);
+    rmdir(sub);
+    unlink(file);
+    rmdir(dir);
+
+    if (errors == 0) printf("dirhash_test: all passed\n");
+    return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,539 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sha1.h"
+
+// Which accelerated block functions this compiler can build.  Each
+// one is compiled for its instruction set with a target attribute, so
+// the rest of the file (and the binary) still runs on CPUs without
+// it; the runtime check in DetectBackend() decides whether it's used.
+#if defined(__GNUC__) && (__GNUC__ >= 5) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && (__GNUC__ >= 6) && defined(__aarch64__)
+#define HAVE_ARMV8 1
+#define ARMV8_TARGET __attribute__((target("+crypto")))
+#elif defined(__ARM_FEATURE_CRYPTO) && defined(__ARM_NEON)
+// 32-bit ARM only gets the crypto intrinsics when the whole build
+// targets ARMv8.
+#define HAVE_ARMV8 1
+#define ARMV8_TARGET
+#endif
+
+#ifdef HAVE_ARMV8
+#include <arm_neon.h>
+#endif
+
+// Four-lane vectors for Sha1Multi(); these become NEON or SSE2
+// registers where the target has them and plain scalar code where it
+// doesn't.
+#if defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+#define HAVE_LANES 1
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+#endif
+
+typedef void (*Sha1CompressFn)(uint32_t* state, const uint8_t* data,
+                               size_t blocks);
+
+static const uint32_t K[4] = {
+    0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline uint32_t LoadBE32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// ---------------------------------------------------------------------
+// Portable C
+
+#define GENERIC_ROUND(f, k)                                        \
+    do {                                                           \
+        uint32_t t = ROL(a, 5) + (f) + e + (k) + w[i & 15];        \
+        e = d; d = c; c = ROL(b, 30); b = a; a = t;                \
+    } while (0)
+
+#define EXPAND(i) \
+    (w[(i) & 15] = ROL(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ \
+                       w[((i) + 2) & 15] ^ w[(i) & 15], 1))
+
+static void CompressGeneric(uint32_t* state, const uint8_t* data,
+                            size_t blocks) {
+    uint32_t w[16];
+    int i;
+    while (blocks--) {
+        uint32_t a = state[0], b = state[1], c = state[2];
+        uint32_t d = state[3], e = state[4];
+
+        for (i = 0; i < 16; ++i) {
+            w[i] = LoadBE32(data + i*4);
+            GENERIC_ROUND(d ^ (b & (c ^ d)), K[0]);
+        }
+        for (; i < 20; ++i) {
+            EXPAND(i);
+            GENERIC_ROUND(d ^ (b & (c ^ d)), K[0]);
+        }
+        for (; i < 40; ++i) {
+            EXPAND(i);
+            GENERIC_ROUND(b ^ c ^ d, K[1]);
+        }
+        for (; i < 60; ++i) {
+            EXPAND(i);
+            GENERIC_ROUND((b & c) | (d & (b | c)), K[2]);
+        }
+        for (; i < 80; ++i) {
+            EXPAND(i);
+            GENERIC_ROUND(b ^ c ^ d, K[3]);
+        }
+
+        state[0] += a; state[1] += b; state[2] += c;
+        state[3] += d; state[4] += e;
+        data += 64;
+    }
+}
+
+// ---------------------------------------------------------------------
+// x86 SHA extensions
+
+#ifdef HAVE_SHANI
+
+// Four rounds (group g of 20).  The message schedule runs three
+// groups ahead of the rounds; the conditions are all constant, so
+// each expansion compiles to straight-line code.
+#define SHANI_GROUP(g)                                                   \
+    do {                                                                 \
+        if ((g) < 4) {                                                   \
+            msg[(g) & 3] = _mm_shuffle_epi8(                             \
+                _mm_loadu_si128((const __m128i*)(data + (g)*16)), mask); \
+        }                                                                \
+        if ((g) == 0) {                                                  \
+            e[0] = _mm_add_epi32(e[0], msg[0]);                          \
+        } else {                                                         \
+            e[(g) & 1] = _mm_sha1nexte_epu32(e[(g) & 1], msg[(g) & 3]);  \
+        }                                                                \
+        e[((g) & 1) ^ 1] = abcd;                                         \
+        if ((g) >= 3 && (g) <= 18) {                                     \
+            msg[((g)+1) & 3] = _mm_sha1msg2_epu32(msg[((g)+1) & 3],      \
+                                                  msg[(g) & 3]);         \
+        }                                                                \
+        abcd = _mm_sha1rnds4_epu32(abcd, e[(g) & 1], (g) / 5);           \
+        if ((g) >= 1 && (g) <= 16) {                                     \
+            msg[((g)+3) & 3] = _mm_sha1msg1_epu32(msg[((g)+3) & 3],      \
+                                                  msg[(g) & 3]);         \
+        }                                                                \
+        if ((g) >= 2 && (g) <= 17) {                                     \
+            msg[((g)+2) & 3] = _mm_xor_si128(msg[((g)+2) & 3],           \
+                                             msg[(g) & 3]);              \
+        }                                                                \
+    } while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void CompressShaNi(uint32_t* state, const uint8_t* data,
+                          size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+                                        0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(
+        _mm_loadu_si128((const __m128i*)state), 0x1b);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (blocks--) {
+        __m128i abcd_save = abcd;
+        __m128i e[2];
+        __m128i msg[4];
+        e[0] = e0;
+
+        SHANI_GROUP(0);  SHANI_GROUP(1);  SHANI_GROUP(2);  SHANI_GROUP(3);
+        SHANI_GROUP(4);  SHANI_GROUP(5);  SHANI_GROUP(6);  SHANI_GROUP(7);
+        SHANI_GROUP(8);  SHANI_GROUP(9);  SHANI_GROUP(10); SHANI_GROUP(11);
+        SHANI_GROUP(12); SHANI_GROUP(13); SHANI_GROUP(14); SHANI_GROUP(15);
+        SHANI_GROUP(16); SHANI_GROUP(17); SHANI_GROUP(18); SHANI_GROUP(19);
+
+        e0 = _mm_sha1nexte_epu32(e[0], e0);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static int CpuHasShaNi() {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 7) return 0;
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & (1 << 19))) return 0;          // SSE4.1 (and so SSSE3)
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;             // SHA
+}
+
+#endif  // HAVE_SHANI
+
+// ---------------------------------------------------------------------
+// ARMv8 crypto extensions
+
+#ifdef HAVE_ARMV8
+
+#define ARMV8_GROUP(g, op)                                               \
+    do {                                                                 \
+        if ((g) >= 4) {                                                  \
+            msg[(g) & 3] = vsha1su1q_u32(                                \
+                vsha1su0q_u32(msg[(g) & 3], msg[((g)+1) & 3],            \
+                              msg[((g)+2) & 3]),                         \
+                msg[((g)+3) & 3]);                                       \
+        }                                                                \
+        uint32x4_t wk = vaddq_u32(msg[(g) & 3], vdupq_n_u32(K[(g) / 5])); \
+        uint32_t e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));           \
+        abcd = op(abcd, e, wk);                                          \
+        e = e_next;                                                      \
+    } while (0)
+
+ARMV8_TARGET
+static void CompressArmv8(uint32_t* state, const uint8_t* data,
+                          size_t blocks) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e0 = state[4];
+
+    while (blocks--) {
+        uint32x4_t msg[4];
+        uint32_t e = e0;
+        uint32x4_t abcd_save = abcd;
+        int i;
+        for (i = 0; i < 4; ++i) {
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i*16)));
+        }
+
+        ARMV8_GROUP(0, vsha1cq_u32);  ARMV8_GROUP(1, vsha1cq_u32);
+        ARMV8_GROUP(2, vsha1cq_u32);  ARMV8_GROUP(3, vsha1cq_u32);
+        ARMV8_GROUP(4, vsha1cq_u32);  ARMV8_GROUP(5, vsha1pq_u32);
+        ARMV8_GROUP(6, vsha1pq_u32);  ARMV8_GROUP(7, vsha1pq_u32);
+        ARMV8_GROUP(8, vsha1pq_u32);  ARMV8_GROUP(9, vsha1pq_u32);
+        ARMV8_GROUP(10, vsha1mq_u32); ARMV8_GROUP(11, vsha1mq_u32);
+        ARMV8_GROUP(12, vsha1mq_u32); ARMV8_GROUP(13, vsha1mq_u32);
+        ARMV8_GROUP(14, vsha1mq_u32); ARMV8_GROUP(15, vsha1pq_u32);
+        ARMV8_GROUP(16, vsha1pq_u32); ARMV8_GROUP(17, vsha1pq_u32);
+        ARMV8_GROUP(18, vsha1pq_u32); ARMV8_GROUP(19, vsha1pq_u32);
+
+        abcd = vaddq_u32(abcd, abcd_save);
+        e0 += e;
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e0;
+}
+
+// Read the kernel's hwcaps from the aux vector ourselves; bionic
+// doesn't have getauxval().
+static unsigned long ReadAuxv(unsigned long type) {
+    unsigned long entry[2];
+    unsigned long value = 0;
+    int fd = open("/proc/self/auxv", O_RDONLY);
+    if (fd < 0) return 0;
+    while (read(fd, entry, sizeof(entry)) == sizeof(entry) && entry[0] != 0) {
+        if (entry[0] == type) {
+            value = entry[1];
+            break;
+        }
+    }
+    close(fd);
+    return value;
+}
+
+static int CpuHasArmv8Sha1() {
+#ifdef __aarch64__
+    return (ReadAuxv(16 /* AT_HWCAP */) & (1 << 5 /* HWCAP_SHA1 */)) != 0;
+#else
+    return (ReadAuxv(26 /* AT_HWCAP2 */) & (1 << 2 /* HWCAP2_SHA1 */)) != 0;
+#endif
+}
+
+#endif  // HAVE_ARMV8
+
+// ---------------------------------------------------------------------
+// Dispatch
+
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+static Sha1Backend current_backend = SHA1_BACKEND_GENERIC;
+static Sha1CompressFn compress_fn = CompressGeneric;
+
+static Sha1CompressFn BackendFunction(Sha1Backend backend) {
+    switch (backend) {
+        case SHA1_BACKEND_GENERIC:
+            return CompressGeneric;
+#ifdef HAVE_ARMV8
+        case SHA1_BACKEND_ARMV8:
+            return CpuHasArmv8Sha1() ? CompressArmv8 : NULL;
+#endif
+#ifdef HAVE_SHANI
+        case SHA1_BACKEND_SHANI:
+            return CpuHasShaNi() ? CompressShaNi : NULL;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+static void DetectBackend() {
+    static const Sha1Backend preference[] = {
+        SHA1_BACKEND_SHANI, SHA1_BACKEND_ARMV8
+    };
+    unsigned int i;
+    for (i = 0; i < sizeof(preference) / sizeof(preference[0]); ++i) {
+        Sha1CompressFn fn = BackendFunction(preference[i]);
+        if (fn != NULL) {
+            current_backend = preference[i];
+            compress_fn = fn;
+            return;
+        }
+    }
+}
+
+int Sha1BackendAvailable(Sha1Backend backend) {
+    return backend == SHA1_BACKEND_AUTO || BackendFunction(backend) != NULL;
+}
+
+int Sha1SetBackend(Sha1Backend backend) {
+    pthread_once(&detect_once, DetectBackend);
+    if (backend == SHA1_BACKEND_AUTO) {
+        current_backend = SHA1_BACKEND_GENERIC;
+        compress_fn = CompressGeneric;
+        DetectBackend();
+        return 0;
+    }
+    Sha1CompressFn fn = BackendFunction(backend);
+    if (fn == NULL) return -1;
+    current_backend = backend;
+    compress_fn = fn;
+    return 0;
+}
+
+Sha1Backend Sha1CurrentBackend() {
+    pthread_once(&detect_once, DetectBackend);
+    return current_backend;
+}
+
+const char* Sha1BackendName(Sha1Backend backend) {
+    switch (backend) {
+        case SHA1_BACKEND_AUTO:    return "auto";
+        case SHA1_BACKEND_GENERIC: return "generic";
+        case SHA1_BACKEND_ARMV8:   return "armv8";
+        case SHA1_BACKEND_SHANI:   return "sha-ni";
+        default:                   return "unknown";
+    }
+}
+
+// ---------------------------------------------------------------------
+// Streaming interface
+
+void Sha1Init(Sha1Ctx* ctx) {
+    pthread_once(&detect_once, DetectBackend);
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->count = 0;
+}
+
+void Sha1Update(Sha1Ctx* ctx, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    size_t used = ctx->count & 63;
+    ctx->count += len;
+
+    if (used > 0) {
+        size_t fill = 64 - used;
+        if (len < fill) {
+            memcpy(ctx->buf + used, p, len);
+            return;
+        }
+        memcpy(ctx->buf + used, p, fill);
+        compress_fn(ctx->state, ctx->buf, 1);
+        p += fill;
+        len -= fill;
+    }
+    if (len >= 64) {
+        compress_fn(ctx->state, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(ctx->buf, p, len);
+}
+
+const uint8_t* Sha1Final(Sha1Ctx* ctx) {
+    uint64_t bits = ctx->count * 8;
+    size_t used = ctx->count & 63;
+    int i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        compress_fn(ctx->state, ctx->buf, 1);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, 56 - used);
+    for (i = 0; i < 8; ++i) {
+        ctx->buf[56 + i] = (uint8_t)(bits >> (56 - i*8));
+    }
+    compress_fn(ctx->state, ctx->buf, 1);
+
+    for (i = 0; i < 5; ++i) {
+        ctx->digest[i*4]   = (uint8_t)(ctx->state[i] >> 24);
+        ctx->digest[i*4+1] = (uint8_t)(ctx->state[i] >> 16);
+        ctx->digest[i*4+2] = (uint8_t)(ctx->state[i] >> 8);
+        ctx->digest[i*4+3] = (uint8_t)ctx->state[i];
+    }
+    return ctx->digest;
+}
+
+const uint8_t* Sha1(const void* data, size_t len, uint8_t* digest) {
+    Sha1Ctx ctx;
+    Sha1Init(&ctx);
+    Sha1Update(&ctx, data, len);
+    memcpy(digest, Sha1Final(&ctx), SHA1_DIGEST_SIZE);
+    return digest;
+}
+
+// ---------------------------------------------------------------------
+// Multi-buffer
+
+#ifdef HAVE_LANES
+
+#define LANE_ROUND(f, k)                                           \
+    do {                                                           \
+        u32x4 t = ROL(a, 5) + (f) + e + (k) + w[i & 15];           \
+        e = d; d = c; c = ROL(b, 30); b = a; a = t;                \
+    } while (0)
+
+// Runs 'blocks' blocks of four messages through SHA-1 at once, one
+// message per lane.  state[j] holds word j of all four states.
+static void CompressLanes(u32x4* state, const uint8_t* const* data,
+                          size_t blocks) {
+    const uint8_t* p[4] = { data[0], data[1], data[2], data[3] };
+    u32x4 w[16];
+    int i, lane;
+    while (blocks--) {
+        u32x4 a = state[0], b = state[1], c = state[2];
+        u32x4 d = state[3], e = state[4];
+
+        for (i = 0; i < 16; ++i) {
+            for (lane = 0; lane < 4; ++lane) {
+                w[i][lane] = LoadBE32(p[lane] + i*4);
+            }
+            LANE_ROUND(d ^ (b & (c ^ d)), K[0]);
+        }
+        for (; i < 20; ++i) {
+            EXPAND(i);
+            LANE_ROUND(d ^ (b & (c ^ d)), K[0]);
+        }
+        for (; i < 40; ++i) {
+            EXPAND(i);
+            LANE_ROUND(b ^ c ^ d, K[1]);
+        }
+        for (; i < 60; ++i) {
+            EXPAND(i);
+            LANE_ROUND((b & c) | (d & (b | c)), K[2]);
+        }
+        for (; i < 80; ++i) {
+            EXPAND(i);
+            LANE_ROUND(b ^ c ^ d, K[3]);
+        }
+
+        state[0] += a; state[1] += b; state[2] += c;
+        state[3] += d; state[4] += e;
+        for (lane = 0; lane < 4; ++lane) p[lane] += 64;
+    }
+}
+
+static int CompareJobLength(const void* a, const void* b) {
+    size_t la = (*(Sha1Job* const*)a)->len;
+    size_t lb = (*(Sha1Job* const*)b)->len;
+    return (la > lb) - (la < lb);
+}
+
+#endif  // HAVE_LANES
+
+void Sha1Multi(Sha1Job* jobs, int count) {
+    int i;
+    pthread_once(&detect_once, DetectBackend);
+
+#ifdef HAVE_LANES
+    // The hardware backends beat four software lanes; only use the
+    // lanes when we'd otherwise be running the portable code.
+    if (current_backend == SHA1_BACKEND_GENERIC && count >= 4) {
+        // Group jobs of similar length so the lanes stay busy.
+        Sha1Job** order = malloc(count * sizeof(Sha1Job*));
+        if (order != NULL) {
+            for (i = 0; i < count; ++i) order[i] = jobs + i;
+            qsort(order, count, sizeof(Sha1Job*), CompareJobLength);
+
+            for (i = 0; i + 4 <= count; i += 4) {
+                Sha1Job** group = order + i;
+                const uint8_t* data[4];
+                u32x4 state[5];
+                int lane, j;
+
+                // Sorted, so group[0] is the shortest.
+                size_t blocks = group[0]->len / 64;
+
+                Sha1Ctx ctx;
+                Sha1Init(&ctx);
+                for (j = 0; j < 5; ++j) {
+                    state[j] = (u32x4){ ctx.state[j], ctx.state[j],
+                                        ctx.state[j], ctx.state[j] };
+                }
+                for (lane = 0; lane < 4; ++lane) {
+                    data[lane] = (const uint8_t*)group[lane]->data;
+                }
+                CompressLanes(state, data, blocks);
+
+                // Finish each message on its own from where the lanes
+                // left off.
+                for (lane = 0; lane < 4; ++lane) {
+                    Sha1Job* job = group[lane];
+                    Sha1Init(&ctx);
+                    for (j = 0; j < 5; ++j) ctx.state[j] = state[j][lane];
+                    ctx.count = blocks * 64;
+                    Sha1Update(&ctx, data[lane] + blocks * 64,
+                               job->len - blocks * 64);
+                    memcpy(job->digest, Sha1Final(&ctx), SHA1_DIGEST_SIZE);
+                }
+            }
+            for (; i < count; ++i) {
+                Sha1(order[i]->data, order[i]->len, order[i]->digest);
+            }
+            free(order);
+            return;
+        }
+    }
+#endif
+
+    for (i = 0; i < count; ++i) {
+        Sha1(jobs[i].data, jobs[i].len, jobs[i].digest);
+    }
+}
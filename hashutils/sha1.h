@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HASHUTILS_SHA1_H
+#define _HASHUTILS_SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-1 with the block function picked at runtime for the CPU we're
+// on.  Drop-in for mincrypt's SHA_init/SHA_update/SHA_final/SHA; the
+// digests are identical, only faster where the hardware helps.
+
+#define SHA1_DIGEST_SIZE 20
+
+typedef struct {
+    uint32_t state[5];
+    uint64_t count;                  // bytes hashed so far
+    uint8_t buf[64];                 // partial block
+    uint8_t digest[SHA1_DIGEST_SIZE];
+} Sha1Ctx;
+
+void Sha1Init(Sha1Ctx* ctx);
+void Sha1Update(Sha1Ctx* ctx, const void* data, size_t len);
+// Returns a pointer to the digest, which lives in ctx.
+const uint8_t* Sha1Final(Sha1Ctx* ctx);
+// One-shot; writes the digest to 'digest' and returns it.
+const uint8_t* Sha1(const void* data, size_t len, uint8_t* digest);
+
+// Hashes 'count' independent buffers in one call.  Where the CPU
+// has vector registers, four buffers are hashed side by side in
+// their lanes, so lots of similar-sized buffers (say, every file in
+// a package) go through several times faster than one at a time.
+typedef struct {
+    const void* data;
+    size_t len;
+    uint8_t digest[SHA1_DIGEST_SIZE];   // out
+} Sha1Job;
+
+void Sha1Multi(Sha1Job* jobs, int count);
+
+typedef enum {
+    SHA1_BACKEND_AUTO = 0,      // the fastest one available
+    SHA1_BACKEND_GENERIC,       // portable C
+    SHA1_BACKEND_ARMV8,         // ARMv8 crypto extensions (SHA1C etc.)
+    SHA1_BACKEND_SHANI,         // x86 SHA extensions (SHA1RNDS4 etc.)
+    SHA1_BACKEND_COUNT
+} Sha1Backend;
+
+// Returns 1 if this build has the backend and the CPU supports it.
+int Sha1BackendAvailable(Sha1Backend backend);
+// Picks the backend used from now on.  Returns 0 on success, or -1
+// (leaving the choice unchanged) if the backend isn't available.
+int Sha1SetBackend(Sha1Backend backend);
+Sha1Backend Sha1CurrentBackend();
+const char* Sha1BackendName(Sha1Backend backend);
+
+#endif  // _HASHUTILS_SHA1_H
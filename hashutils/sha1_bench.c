@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Micro-benchmark for the SHA-1 backends:
+//
+//   sha1_bench [-s <MB>] [-m <cpu MHz>]
+//
+// Hashes a buffer with every backend this CPU supports, and a set of
+// small buffers with Sha1Multi(), and reports the speed of each.
+// Cycles/byte come from the TSC on x86; elsewhere pass the clock
+// speed with -m to get them.  Exits nonzero if any two backends
+// disagree on a digest.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sha1.h"
+
+#define MULTI_BUFFERS 64
+#define MULTI_BUFFER_SIZE (64 * 1024)
+
+static double cpu_mhz = 0;
+
+static double NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long Cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+static void Report(const char* name, size_t bytes, double ns,
+                   unsigned long long cycles) {
+    double cpb = 0;
+    if (cycles != 0) {
+        cpb = (double)cycles / bytes;
+    } else if (cpu_mhz > 0) {
+        cpb = ns * cpu_mhz / 1000.0 / bytes;
+    }
+    printf("%-16s %8.1f MB/s", name, bytes / ns * 1e9 / (1024 * 1024));
+    if (cpb > 0) {
+        printf("  %6.2f cycles/byte", cpb);
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    size_t size = 64 << 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m:")) != -1) {
+        switch (opt) {
+            case 's': size = (size_t)atoi(optarg) << 20; break;
+            case 'm': cpu_mhz = atof(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s <MB>] [-m <cpu MHz>]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    unsigned char* data = malloc(size);
+    unsigned char* multi = malloc(MULTI_BUFFERS * MULTI_BUFFER_SIZE);
+    if (data == NULL || multi == NULL) {
+        fprintf(stderr, "failed to allocate buffers\n");
+        return 1;
+    }
+    size_t i;
+    srand(1);
+    for (i = 0; i < size; ++i) data[i] = rand();
+    for (i = 0; i < MULTI_BUFFERS * MULTI_BUFFER_SIZE; ++i) multi[i] = rand();
+
+    uint8_t expected[SHA1_DIGEST_SIZE];
+    Sha1Job jobs[MULTI_BUFFERS];
+    uint8_t expected_multi[MULTI_BUFFERS][SHA1_DIGEST_SIZE];
+    int have_expected = 0;
+    int mismatch = 0;
+
+    int b;
+    for (b = SHA1_BACKEND_GENERIC; b < SHA1_BACKEND_COUNT; ++b) {
+        if (Sha1SetBackend(b) != 0) {
+            printf("%-16s unavailable\n", Sha1BackendName(b));
+            continue;
+        }
+
+        uint8_t digest[SHA1_DIGEST_SIZE];
+        double start = NowNs();
+        unsigned long long c0 = Cycles();
+        Sha1(data, size, digest);
+        unsigned long long c1 = Cycles();
+        Report(Sha1BackendName(b), size, NowNs() - start, c1 - c0);
+
+        for (i = 0; i < MULTI_BUFFERS; ++i) {
+            jobs[i].data = multi + i * MULTI_BUFFER_SIZE;
+            // Vary the lengths a little, as real files would.
+            jobs[i].len = MULTI_BUFFER_SIZE - (i * 97) % 4096;
+        }
+        start = NowNs();
+        c0 = Cycles();
+        Sha1Multi(jobs, MULTI_BUFFERS);
+        c1 = Cycles();
+        size_t multi_bytes = 0;
+        for (i = 0; i < MULTI_BUFFERS; ++i) multi_bytes += jobs[i].len;
+
+        char name[32];
+        snprintf(name, sizeof(name), "%s multi", Sha1BackendName(b));
+        Report(name, multi_bytes, NowNs() - start, c1 - c0);
+
+        if (!have_expected) {
+            memcpy(expected, digest, SHA1_DIGEST_SIZE);
+            for (i = 0; i < MULTI_BUFFERS; ++i) {
+                memcpy(expected_multi[i], jobs[i].digest, SHA1_DIGEST_SIZE);
+            }
+            have_expected = 1;
+        } else {
+            if (memcmp(expected, digest, SHA1_DIGEST_SIZE) != 0) {
+                printf("%s: digest mismatch\n", Sha1BackendName(b));
+                mismatch = 1;
+            }
+            for (i = 0; i < MULTI_BUFFERS; ++i) {
+                if (memcmp(expected_multi[i], jobs[i].digest,
+                           SHA1_DIGEST_SIZE) != 0) {
+                    printf("%s: multi digest %d mismatch\n",
+                           Sha1BackendName(b), (int)i);
+                    mismatch = 1;
+                }
+            }
+        }
+    }
+
+    free(data);
+    free(multi);
+    return mismatch;
+}
@@ -18,7 +18,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -31,6 +34,7 @@
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
+#include "updater/channel.h"
 #include "verifier.h"
 
 #include "firmware.h"
@@ -104,6 +108,300 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
     return INSTALL_SUCCESS;
 }
 
+// -----------------------------------------------------------------
+//   reading the update binary's commands
+// -----------------------------------------------------------------
+
+// A thread drains the pipe from the update binary as fast as it can
+// write, and queues what it reads for try_update_binary() to show;
+// so the binary never waits for the screen to redraw.  See
+// updater/channel.h for the two forms the commands come in.
+
+typedef struct UpdateCommand {
+    int type;                   // CHANNEL_UI_PRINT etc.
+    float fraction;
+    int seconds;
+    char* text;                 // for CHANNEL_UI_PRINT and CHANNEL_TEXT
+    struct UpdateCommand* next;
+} UpdateCommand;
+
+typedef struct {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UpdateCommand* head;
+    UpdateCommand* tail;
+    bool done;
+
+    char* line;                 // partial text-protocol line
+    size_t line_len;
+
+    volatile uint32_t* progress_word;   // shared with the binary, or NULL
+    uint32_t last_word;
+    int segments;               // CHANNEL_PROGRESS commands shown
+} UpdateReader;
+
+static void
+queue_command(UpdateReader* r, int type, float fraction, int seconds,
+              char* text) {
+    pthread_mutex_lock(&r->lock);
+    if (type == CHANNEL_SET_PROGRESS && r->tail != NULL &&
+        r->tail->type == CHANNEL_SET_PROGRESS) {
+        // Only the latest position matters.
+        r->tail->fraction = fraction;
+    } else {
+        UpdateCommand* c = malloc(sizeof(UpdateCommand));
+        c->type = type;
+        c->fraction = fraction;
+        c->seconds = seconds;
+        c->text = text;
+        c->next = NULL;
+        if (r->tail != NULL) {
+            r->tail->next = c;
+        } else {
+            r->head = c;
+        }
+        r->tail = c;
+        pthread_cond_signal(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Split text-protocol bytes into lines and queue them.
+static void
+add_text(UpdateReader* r, const char* data, size_t len) {
+    while (len > 0) {
+        const char* newline = memchr(data, '\n', len);
+        size_t n = newline ? (size_t)(newline - data) : len;
+        r->line = realloc(r->line, r->line_len + n + 1);
+        memcpy(r->line + r->line_len, data, n);
+        r->line_len += n;
+        r->line[r->line_len] = '\0';
+        if (newline == NULL) break;
+
+        queue_command(r, CHANNEL_TEXT, 0, 0, r->line);
+        r->line = NULL;
+        r->line_len = 0;
+        data += n + 1;
+        len -= n + 1;
+    }
+}
+
+static uint32_t
+get_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Queue one frame.  Returns false if it makes no sense.
+static bool
+add_frame(UpdateReader* r, int type, const uint8_t* payload, size_t len) {
+    switch (type) {
+        case CHANNEL_HELLO:
+            return len == strlen(CHANNEL_MAGIC) &&
+                memcmp(payload, CHANNEL_MAGIC, len) == 0;
+        case CHANNEL_UI_PRINT: {
+            char* text = malloc(len + 1);
+            memcpy(text, payload, len);
+            text[len] = '\0';
+            queue_command(r, CHANNEL_UI_PRINT, 0, 0, text);
+            return true;
+        }
+        case CHANNEL_PROGRESS:
+            if (len != 8) return false;
+            queue_command(r, CHANNEL_PROGRESS, get_le32(payload) / 1e6,
+                          (int)get_le32(payload+4), NULL);
+            return true;
+        case CHANNEL_SET_PROGRESS:
+            if (len != 4) return false;
+            queue_command(r, CHANNEL_SET_PROGRESS, get_le32(payload) / 1e6,
+                          0, NULL);
+            return true;
+        case CHANNEL_TEXT:
+            add_text(r, (const char*)payload, len);
+            return true;
+    }
+    return false;
+}
+
+static void*
+read_commands(void* cookie) {
+    UpdateReader* r = (UpdateReader*)cookie;
+    size_t alloc = 65536;
+    uint8_t* buffer = malloc(alloc);
+    size_t len = 0;
+    int framed = -1;            // not known until the first byte
+
+    for (;;) {
+        if (len == alloc) {
+            alloc *= 2;
+            buffer = realloc(buffer, alloc);
+        }
+        ssize_t n = read(r->fd, buffer + len, alloc - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (framed < 0) framed = (buffer[0] == CHANNEL_HELLO);
+
+        if (!framed) {
+            add_text(r, (const char*)buffer, n);
+            continue;
+        }
+        len += n;
+        size_t pos = 0;
+        while (len - pos >= CHANNEL_HEADER_SIZE) {
+            size_t size = buffer[pos+1] | (buffer[pos+2] << 8);
+            if (len - pos < CHANNEL_HEADER_SIZE + size) break;
+            if (!add_frame(r, buffer[pos], buffer + pos + CHANNEL_HEADER_SIZE,
+                           size)) {
+                LOGE("bad frame (type %d, %d bytes) from update binary\n",
+                     buffer[pos], (int)size);
+            }
+            pos += CHANNEL_HEADER_SIZE + size;
+        }
+        memmove(buffer, buffer + pos, len - pos);
+        len -= pos;
+    }
+    if (r->line_len > 0) add_text(r, "\n", 1);
+    free(buffer);
+
+    pthread_mutex_lock(&r->lock);
+    r->done = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// Show the progress the binary left in shared memory, if it's for the
+// segment on screen.
+static void
+check_progress_word(UpdateReader* r) {
+    if (r->progress_word == NULL) return;
+    uint32_t word = *r->progress_word;
+    if (word != r->last_word && (word >> 24) == (r->segments & 0xff)) {
+        r->last_word = word;
+        ui_set_progress((word & CHANNEL_PROGRESS_ONE) /
+                        (float)CHANNEL_PROGRESS_ONE);
+    }
+}
+
+// The text protocol.
+static void
+handle_text_command(char* buffer) {
+    char* command = strtok(buffer, " \n");
+    if (command == NULL) {
+        return;
+    } else if (strcmp(command, "progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        char* seconds_s = strtok(NULL, " \n");
+
+        float fraction = strtof(fraction_s, NULL);
+        int seconds = strtol(seconds_s, NULL, 10);
+
+        ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                         seconds);
+    } else if (strcmp(command, "set_progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        float fraction = strtof(fraction_s, NULL);
+        ui_set_progress(fraction);
+    } else if (strcmp(command, "ui_print") == 0) {
+        char* str = strtok(NULL, "\n");
+        if (str) {
+            ui_print("%s", str);
+        } else {
+            ui_print("\n");
+        }
+    } else {
+        LOGE("unknown command [%s]\n", command);
+    }
+}
+
+static void
+handle_command(UpdateReader* r, UpdateCommand* c) {
+    switch (c->type) {
+        case CHANNEL_UI_PRINT:
+            if (c->text[0] != '\0') {
+                ui_print("%s", c->text);
+            } else {
+                ui_print("\n");
+            }
+            break;
+        case CHANNEL_PROGRESS:
+            // Finish off the segment that's ending first.
+            check_progress_word(r);
+            ui_show_progress(c->fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                             c->seconds);
+            ++r->segments;
+            break;
+        case CHANNEL_SET_PROGRESS:
+            ui_set_progress(c->fraction);
+            break;
+        case CHANNEL_TEXT:
+            handle_text_command(c->text);
+            break;
+    }
+}
+
+// Show the commands as they arrive, until the binary closes the pipe.
+static void
+show_commands(UpdateReader* r) {
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        if (r->head == NULL && !r->done) {
+            // Wake up now and then for the shared progress word.
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            struct timespec deadline;
+            deadline.tv_sec = now.tv_sec;
+            deadline.tv_nsec = now.tv_usec * 1000 + 50 * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&r->cond, &r->lock, &deadline);
+        }
+        UpdateCommand* list = r->head;
+        r->head = r->tail = NULL;
+        bool done = r->done;
+        pthread_mutex_unlock(&r->lock);
+
+        while (list != NULL) {
+            UpdateCommand* next = list->next;
+            handle_command(r, list);
+            free(list->text);
+            free(list);
+            list = next;
+        }
+        check_progress_word(r);
+
+        pthread_mutex_lock(&r->lock);
+        if (done && r->head == NULL) break;
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Make the shared progress word for the binary.  Returns an fd for
+// it, or -1.  The fd is close-on-exec; the binary gets its own dup()
+// of it, so nothing else we start ever sees it.
+static int
+create_progress_word(UpdateReader* r) {
+    const char* path = "/tmp/update_progress";
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    unlink(path);
+    if (ftruncate(fd, CHANNEL_SHARED_SIZE) < 0) {
+        close(fd);
+        return -1;
+    }
+    void* p = mmap(NULL, CHANNEL_SHARED_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    r->progress_word = (volatile uint32_t*)p;
+    return fd;
+}
+
 // If the package contains an update binary, extract it and run it.
 static int
 try_update_binary(const char *path, ZipArchive *zip) {
@@ -164,6 +462,9 @@ try_update_binary(const char *path, ZipArchive *zip) {
     //
     //   - the name of the package zip file.
     //
+    // The binary may also use the framed protocol in
+    // updater/channel.h, which CHANNEL_ENV in its environment offers.
+    //
 
     char** args = malloc(sizeof(char*) * 5);
     args[0] = binary;
@@ -173,49 +474,48 @@ try_update_binary(const char *path, ZipArchive *zip) {
     args[3] = (char*)path;
     args[4] = NULL;
 
+    UpdateReader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = pipefd[0];
+    pthread_mutex_init(&reader.lock, NULL);
+    pthread_cond_init(&reader.cond, NULL);
+    int shared_fd = create_progress_word(&reader);
+
     pid_t pid = fork();
     if (pid == 0) {
         close(pipefd[0]);
+        char offer[16];
+        sprintf(offer, "%d", shared_fd >= 0 ? dup(shared_fd) : -1);
+        setenv(CHANNEL_ENV, offer, 1);
         execv(binary, args);
         fprintf(stderr, "E:Can't run %s (%s)\n", binary, strerror(errno));
         _exit(-1);
     }
     close(pipefd[1]);
+    if (shared_fd >= 0) close(shared_fd);
 
-    char buffer[1024];
-    FILE* from_child = fdopen(pipefd[0], "r");
-    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
-        char* command = strtok(buffer, " \n");
-        if (command == NULL) {
-            continue;
-        } else if (strcmp(command, "progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            char* seconds_s = strtok(NULL, " \n");
-
-            float fraction = strtof(fraction_s, NULL);
-            int seconds = strtol(seconds_s, NULL, 10);
-
-            ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
-                             seconds);
-        } else if (strcmp(command, "set_progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            float fraction = strtof(fraction_s, NULL);
-            ui_set_progress(fraction);
-        } else if (strcmp(command, "ui_print") == 0) {
-            char* str = strtok(NULL, "\n");
-            if (str) {
-                ui_print(str);
-            } else {
-                ui_print("\n");
-            }
-        } else {
-            LOGE("unknown command [%s]\n", command);
-        }
+    pthread_t reader_thread;
+    if (pthread_create(&reader_thread, NULL, read_commands, &reader) != 0) {
+        // Read them on this thread instead; the queue fills up, but
+        // we still get to show it.
+        read_commands(&reader);
+    } else {
+        show_commands(&reader);
+        pthread_join(reader_thread, NULL);
+    }
+    show_commands(&reader);
+    close(pipefd[0]);
+    if (reader.progress_word != NULL) {
+        munmap((void*)reader.progress_word, CHANNEL_SHARED_SIZE);
     }
-    fclose(from_child);
+    free(reader.line);
+    pthread_cond_destroy(&reader.cond);
+    pthread_mutex_destroy(&reader.lock);
 
     int status;
     waitpid(pid, &status, 0);
+    // the update binary mounts and unmounts things on its own
+    invalidate_mounted_volumes();
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
         LOGE("Error in %s\n(Status %d)\n", path, WEXITSTATUS(status));
         return INSTALL_ERROR;
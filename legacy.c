@@ -35,6 +35,8 @@
 #include "firmware.h"
 
 #include "amend/amend.h"
+#include "traceutils/trace.h"
+#include "spawnutils/spawn.h"
 #include "common.h"
 #include "install.h"
 #include "mincrypt/rsa.h"
@@ -97,7 +99,10 @@ handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
 
     /* Execute the script.
      */
+    TraceStartFromEnv();
     int ret = execCommandList((ExecContext *)1, commands);
+    TraceFinish(TRACE_SUMMARY_TOP);
+    StopCoprocess();
     if (ret != 0) {
         int num = ret;
         char *line, *next = script_data;
@@ -0,0 +1,158 @@
+#include <string.h>
+
+#include "md5.h"
+
+#define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+    (a) += f((b), (c), (d)) + (x) + (t); \
+    (a) = rol(s, (a)); \
+    (a) += (b);
+
+static void MD5_Transform(MD5_CTX* ctx) {
+    uint32_t W[16];
+    uint32_t A, B, C, D;
+    int t;
+
+    // input is little-endian regardless of the host
+    for (t = 0; t < 16; ++t) {
+        const uint8_t* p = ctx->buf + t * 4;
+        W[t] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    A = ctx->state[0];
+    B = ctx->state[1];
+    C = ctx->state[2];
+    D = ctx->state[3];
+
+    STEP(F, A, B, C, D, W[0],  0xd76aa478, 7)
+    STEP(F, D, A, B, C, W[1],  0xe8c7b756, 12)
+    STEP(F, C, D, A, B, W[2],  0x242070db, 17)
+    STEP(F, B, C, D, A, W[3],  0xc1bdceee, 22)
+    STEP(F, A, B, C, D, W[4],  0xf57c0faf, 7)
+    STEP(F, D, A, B, C, W[5],  0x4787c62a, 12)
+    STEP(F, C, D, A, B, W[6],  0xa8304613, 17)
+    STEP(F, B, C, D, A, W[7],  0xfd469501, 22)
+    STEP(F, A, B, C, D, W[8],  0x698098d8, 7)
+    STEP(F, D, A, B, C, W[9],  0x8b44f7af, 12)
+    STEP(F, C, D, A, B, W[10], 0xffff5bb1, 17)
+    STEP(F, B, C, D, A, W[11], 0x895cd7be, 22)
+    STEP(F, A, B, C, D, W[12], 0x6b901122, 7)
+    STEP(F, D, A, B, C, W[13], 0xfd987193, 12)
+    STEP(F, C, D, A, B, W[14], 0xa679438e, 17)
+    STEP(F, B, C, D, A, W[15], 0x49b40821, 22)
+
+    STEP(G, A, B, C, D, W[1],  0xf61e2562, 5)
+    STEP(G, D, A, B, C, W[6],  0xc040b340, 9)
+    STEP(G, C, D, A, B, W[11], 0x265e5a51, 14)
+    STEP(G, B, C, D, A, W[0],  0xe9b6c7aa, 20)
+    STEP(G, A, B, C, D, W[5],  0xd62f105d, 5)
+    STEP(G, D, A, B, C, W[10], 0x02441453, 9)
+    STEP(G, C, D, A, B, W[15], 0xd8a1e681, 14)
+    STEP(G, B, C, D, A, W[4],  0xe7d3fbc8, 20)
+    STEP(G, A, B, C, D, W[9],  0x21e1cde6, 5)
+    STEP(G, D, A, B, C, W[14], 0xc33707d6, 9)
+    STEP(G, C, D, A, B, W[3],  0xf4d50d87, 14)
+    STEP(G, B, C, D, A, W[8],  0x455a14ed, 20)
+    STEP(G, A, B, C, D, W[13], 0xa9e3e905, 5)
+    STEP(G, D, A, B, C, W[2],  0xfcefa3f8, 9)
+    STEP(G, C, D, A, B, W[7],  0x676f02d9, 14)
+    STEP(G, B, C, D, A, W[12], 0x8d2a4c8a, 20)
+
+    STEP(H, A, B, C, D, W[5],  0xfffa3942, 4)
+    STEP(H, D, A, B, C, W[8],  0x8771f681, 11)
+    STEP(H, C, D, A, B, W[11], 0x6d9d6122, 16)
+    STEP(H, B, C, D, A, W[14], 0xfde5380c, 23)
+    STEP(H, A, B, C, D, W[1],  0xa4beea44, 4)
+    STEP(H, D, A, B, C, W[4],  0x4bdecfa9, 11)
+    STEP(H, C, D, A, B, W[7],  0xf6bb4b60, 16)
+    STEP(H, B, C, D, A, W[10], 0xbebfbc70, 23)
+    STEP(H, A, B, C, D, W[13], 0x289b7ec6, 4)
+    STEP(H, D, A, B, C, W[0],  0xeaa127fa, 11)
+    STEP(H, C, D, A, B, W[3],  0xd4ef3085, 16)
+    STEP(H, B, C, D, A, W[6],  0x04881d05, 23)
+    STEP(H, A, B, C, D, W[9],  0xd9d4d039, 4)
+    STEP(H, D, A, B, C, W[12], 0xe6db99e5, 11)
+    STEP(H, C, D, A, B, W[15], 0x1fa27cf8, 16)
+    STEP(H, B, C, D, A, W[2],  0xc4ac5665, 23)
+
+    STEP(I, A, B, C, D, W[0],  0xf4292244, 6)
+    STEP(I, D, A, B, C, W[7],  0x432aff97, 10)
+    STEP(I, C, D, A, B, W[14], 0xab9423a7, 15)
+    STEP(I, B, C, D, A, W[5],  0xfc93a039, 21)
+    STEP(I, A, B, C, D, W[12], 0x655b59c3, 6)
+    STEP(I, D, A, B, C, W[3],  0x8f0ccc92, 10)
+    STEP(I, C, D, A, B, W[10], 0xffeff47d, 15)
+    STEP(I, B, C, D, A, W[1],  0x85845dd1, 21)
+    STEP(I, A, B, C, D, W[8],  0x6fa87e4f, 6)
+    STEP(I, D, A, B, C, W[15], 0xfe2ce6e0, 10)
+    STEP(I, C, D, A, B, W[6],  0xa3014314, 15)
+    STEP(I, B, C, D, A, W[13], 0x4e0811a1, 21)
+    STEP(I, A, B, C, D, W[4],  0xf7537e82, 6)
+    STEP(I, D, A, B, C, W[11], 0xbd3af235, 10)
+    STEP(I, C, D, A, B, W[2],  0x2ad7d2bb, 15)
+    STEP(I, B, C, D, A, W[9],  0xeb86d391, 21)
+
+    ctx->state[0] += A;
+    ctx->state[1] += B;
+    ctx->state[2] += C;
+    ctx->state[3] += D;
+}
+
+void MD5_init(MD5_CTX* ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+void MD5_update(MD5_CTX* ctx, const void* data, int len) {
+    int i = ctx->count & 63;
+    const uint8_t* p = (const uint8_t*)data;
+
+    ctx->count += len;
+
+    while (len > 0) {
+        int n = 64 - i;
+        if (n > len) n = len;
+        memcpy(ctx->buf + i, p, n);
+        i += n;
+        p += n;
+        len -= n;
+        if (i == 64) {
+            MD5_Transform(ctx);
+            i = 0;
+        }
+    }
+}
+
+const uint8_t* MD5_final(MD5_CTX* ctx) {
+    uint8_t* p = ctx->buf;
+    uint64_t cnt = ctx->count * 8;
+    int i;
+
+    MD5_update(ctx, (const uint8_t*)"\x80", 1);
+    while ((ctx->count & 63) != 56) {
+        MD5_update(ctx, (const uint8_t*)"\0", 1);
+    }
+    for (i = 0; i < 8; ++i) {
+        uint8_t tmp = cnt >> (i * 8);
+        MD5_update(ctx, &tmp, 1);
+    }
+
+    for (i = 0; i < 4; i++) {
+        uint32_t tmp = ctx->state[i];
+        *p++ = tmp;
+        *p++ = tmp >> 8;
+        *p++ = tmp >> 16;
+        *p++ = tmp >> 24;
+    }
+
+    return ctx->buf;
+}
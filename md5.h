@@ -0,0 +1,22 @@
+#ifndef RECOVERY_MD5_H_
+#define RECOVERY_MD5_H_
+
+#include <stdint.h>
+
+#define MD5_DIGEST_SIZE 16
+
+/* RFC 1321 MD5, with the same shape as mincrypt's SHA_CTX so the
+ * two can be used interchangeably.  Only used to produce and check
+ * nandroid.md5 files; don't use it for anything that needs to be secure.
+ */
+typedef struct MD5_CTX {
+    uint64_t count;
+    uint32_t state[4];
+    uint8_t buf[64];
+} MD5_CTX;
+
+void MD5_init(MD5_CTX* ctx);
+void MD5_update(MD5_CTX* ctx, const void* data, int len);
+const uint8_t* MD5_final(MD5_CTX* ctx);
+
+#endif  // RECOVERY_MD5_H_
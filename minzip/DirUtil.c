@@ -103,8 +103,10 @@ dirCreateHierarchy(const char *path, int mode,
      */
     ds = getPathDirStatus(cpath);
     if (ds == DDIR) {
+        free(cpath);
         return 0;
     } else if (ds == DILLEGAL) {
+        free(cpath);
         return -1;
     }
 
@@ -145,6 +147,13 @@ dirCreateHierarchy(const char *path, int mode,
             int err;
 
             err = mkdir(cpath, mode);
+            if (err != 0 && errno == EEXIST &&
+                    getPathDirStatus(cpath) == DDIR) {
+                /* Someone else (another thread extracting into the
+                 * same tree) made it first.
+                 */
+                err = 0;
+            }
             if (err != 0) {
                 free(cpath);
                 return -1;
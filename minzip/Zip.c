@@ -522,6 +522,40 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+    const ZipEntry* pEntry)
+{
+    if (pEntry->compression != STORED) {
+        return NULL;
+    }
+    /* Only the compressed length was checked against the map; a stored
+     * entry that claims a different uncompressed length is damaged.
+     */
+    if (pEntry->uncompLen != pEntry->compLen) {
+        return NULL;
+    }
+    /* parseZipArchive() checked that the data is inside the map. */
+    const unsigned char* data =
+        (const unsigned char*) pArchive->map.addr + pEntry->offset;
+
+    /* Nothing reads the data on its way out, so check it here, once.
+     * Racing threads may both check; either way the flag only ever
+     * goes from 0 to 1.
+     */
+    if (!pEntry->storedCrcOk) {
+        unsigned long crc = crc32(crc32(0L, Z_NULL, 0), data,
+                pEntry->uncompLen);
+        if (crc != (unsigned long)pEntry->crc32) {
+            LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
+                    pEntry->fileNameLen, pEntry->fileName, crc,
+                    pEntry->crc32);
+            return NULL;
+        }
+        ((ZipEntry*) pEntry)->storedCrcOk = 1;
+    }
+    return data;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
@@ -529,6 +563,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
     void *cookie)
 {
     size_t bytesLeft = pEntry->compLen;
+    off_t offset = pEntry->offset;
     while (bytesLeft > 0) {
         unsigned char buf[32 * 1024];
         ssize_t n;
@@ -539,7 +574,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
         if (count > sizeof(buf)) {
             count = sizeof(buf);
         }
-        n = read(pArchive->fd, buf, count);
+        n = pread(pArchive->fd, buf, count, offset);
         if (n < 0 || (size_t)n != count) {
             LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
             return false;
@@ -549,6 +584,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
             return false;
         }
         bytesLeft -= count;
+        offset += count;
     }
     return true;
 }
@@ -605,7 +641,8 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
             LOGVV("+++ reading %ld bytes (%ld left)\n",
                 getSize, compRemaining);
 
-            int cc = read(pArchive->fd, readBuf, getSize);
+            int cc = pread(pArchive->fd, readBuf, getSize,
+                    pEntry->offset + pEntry->compLen - compRemaining);
             if (cc != (int) getSize) {
                 LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
                 goto z_bail;
@@ -674,14 +711,10 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
+    /* The entry is read with pread() at its own offsets, leaving the
+     * file position alone, so several threads can extract at once.
+     */
     switch (pEntry->compression) {
     case STORED:
         ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
@@ -695,8 +728,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -33,6 +33,7 @@ typedef struct ZipEntry {
     long         crc32;
     int          versionMadeBy;
     long         externalFileAttributes;
+    int          storedCrcOk;    // see mzGetStoredZipEntryData()
 } ZipEntry;
 
 /*
@@ -128,6 +129,17 @@ INLINE long mzGetZipEntryCrc32(const ZipEntry* pEntry) {
 }
 bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
 
+/*
+ * Return a pointer to the data of a STORED (uncompressed) entry, in
+ * place in the archive's mapping.  Returns NULL if the entry is
+ * compressed, its compressed and uncompressed lengths differ, or its
+ * data doesn't match its CRC.  The CRC is checked on the first call
+ * for each entry; later calls trust that.  The pointer is good until
+ * the archive is closed.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+    const ZipEntry* pEntry);
+
 
 /*
  * Type definition for the callback function used by
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 #include <sys/mount.h>
 
@@ -34,12 +35,14 @@ typedef struct {
     MountedVolume *volumes;
     int volumes_allocd;
     int volume_count;
+    int valid;
 } MountsState;
 
 static MountsState g_mounts_state = {
     NULL,   // volumes
     0,      // volumes_allocd
-    0       // volume_count
+    0,      // volume_count
+    0       // valid
 };
 
 static inline void
@@ -56,12 +59,65 @@ free_volume_internals(const MountedVolume *volume, int zero)
 
 #define PROC_MOUNTS_FILENAME   "/proc/mounts"
 
+/* Reads all of /proc/mounts into a malloc()ed, NUL-terminated buffer.
+ * The file can be longer than a page once loop and tmpfs mounts pile up,
+ * so keep reading until EOF.
+ */
+static char *
+read_proc_mounts(ssize_t *out_len)
+{
+    size_t allocd = 2048;
+    size_t len = 0;
+    char *buf = malloc(allocd);
+    int fd;
+
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
+    if (fd < 0) {
+        free(buf);
+        return NULL;
+    }
+    for (;;) {
+        ssize_t nbytes;
+        if (len + 1 >= allocd) {
+            char *newbuf = realloc(buf, allocd * 2);
+            if (newbuf == NULL) {
+                close(fd);
+                free(buf);
+                errno = ENOMEM;
+                return NULL;
+            }
+            buf = newbuf;
+            allocd *= 2;
+        }
+        nbytes = read(fd, buf + len, allocd - len - 1);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            free(buf);
+            return NULL;
+        }
+        if (nbytes == 0) {
+            break;
+        }
+        len += nbytes;
+    }
+    close(fd);
+    buf[len] = '\0';
+    *out_len = len;
+    return buf;
+}
+
 int
 scan_mounted_volumes()
 {
-    char buf[2048];
+    char *buf;
     const char *bufp;
-    int fd;
     ssize_t nbytes;
 
     if (g_mounts_state.volumes == NULL) {
@@ -83,19 +139,14 @@ scan_mounted_volumes()
         }
     }
     g_mounts_state.volume_count = 0;
+    g_mounts_state.valid = 0;
 
     /* Open and read the file contents.
      */
-    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
-    if (fd < 0) {
+    buf = read_proc_mounts(&nbytes);
+    if (buf == NULL) {
         goto bail;
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-    if (nbytes < 0) {
-        goto bail;
-    }
-    buf[nbytes] = '\0';
 
     /* Parse the contents of the file, which looks like:
      *
@@ -130,6 +181,22 @@ scan_mounted_volumes()
             filesystem[sizeof(filesystem)-1] = '\0';
             flags[sizeof(flags)-1] = '\0';
 
+            if (g_mounts_state.volume_count ==
+                    g_mounts_state.volumes_allocd) {
+                int numv = g_mounts_state.volumes_allocd * 2;
+                MountedVolume *volumes = realloc(g_mounts_state.volumes,
+                        numv * sizeof(*volumes));
+                if (volumes == NULL) {
+                    free(buf);
+                    errno = ENOMEM;
+                    goto bail;
+                }
+                memset(volumes + g_mounts_state.volumes_allocd, 0,
+                        (numv - g_mounts_state.volumes_allocd) *
+                        sizeof(*volumes));
+                g_mounts_state.volumes = volumes;
+                g_mounts_state.volumes_allocd = numv;
+            }
             MountedVolume *v =
                     &g_mounts_state.volumes[g_mounts_state.volume_count++];
             v->device = strdup(device);
@@ -151,15 +218,37 @@ printf("matches was %d on <<%.40s>>\n", matches, bufp);
             nbytes--;
         }
     }
+    free(buf);
 
+    g_mounts_state.valid = 1;
     return 0;
 
 bail:
-//TODO: free the strings we've allocated.
+    {
+        int i;
+        for (i = 0; i < g_mounts_state.volume_count; i++) {
+            free_volume_internals(&g_mounts_state.volumes[i], 1);
+        }
+    }
     g_mounts_state.volume_count = 0;
     return -1;
 }
 
+int
+scan_mounted_volumes_cached()
+{
+    if (g_mounts_state.valid) {
+        return 0;
+    }
+    return scan_mounted_volumes();
+}
+
+void
+invalidate_mounted_volumes()
+{
+    g_mounts_state.valid = 0;
+}
+
 const MountedVolume *
 find_mounted_volume_by_device(const char *device)
 {
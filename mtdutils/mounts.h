@@ -21,6 +21,16 @@ typedef struct MountedVolume MountedVolume;
 
 int scan_mounted_volumes(void);
 
+/* Like scan_mounted_volumes(), but reuses the table from the previous
+ * scan unless invalidate_mounted_volumes() has been called since.
+ * Anything that mounts or unmounts behind our back (mount(2), a shell
+ * command, a child process) must invalidate the table.
+ * unmount_mounted_volume() keeps the table up to date by itself.
+ */
+int scan_mounted_volumes_cached(void);
+
+void invalidate_mounted_volumes(void);
+
 const MountedVolume *find_mounted_volume_by_device(const char *device);
 
 const MountedVolume *
@@ -17,6 +17,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 
+#include <pthread.h>
 #include <signal.h>
 #include <sys/wait.h>
 
@@ -40,6 +41,7 @@
 #include <sys/vfs.h>
 
 #include "extendedcommands.h"
+#include "fileops.h"
 #include "nandroid.h"
 
 #ifndef BOARD_USES_BMLUTILS
@@ -61,30 +63,163 @@ int print_and_error(char* message) {
 
 int yaffs_files_total = 0;
 int yaffs_files_count = 0;
+
+/* While backing up, progress is weighted by bytes rather than by files:
+ * one big apk takes longer than a directory full of tiny xml files.
+ * The totals come from a walk of the partition that runs alongside the
+ * start of the backup, so they show up a little after the first files.
+ */
+static pthread_mutex_t yaffs_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t yaffs_stats_thread;
+static int yaffs_stats_running = 0;
+static int yaffs_counting_bytes = 0;    // between compute_ and finish_
+static int yaffs_stats_ready = 0;
+static int64_t yaffs_bytes_total = 0;
+static int64_t yaffs_bytes_count = 0;
+
 void yaffs_callback(char* filename)
 {
     char* justfile = basename(filename);
     if (strlen(justfile) < 30)
         ui_print(justfile);
     yaffs_files_count++;
-    if (yaffs_files_total != 0)
-        ui_set_progress((float)yaffs_files_count / (float)yaffs_files_total);
+    if (yaffs_counting_bytes) {
+        struct stat st;
+        if (lstat(filename, &st) == 0 && S_ISREG(st.st_mode))
+            yaffs_bytes_count += st.st_size;
+    }
+
+    pthread_mutex_lock(&yaffs_stats_mutex);
+    float progress = -1;
+    if (yaffs_stats_ready && yaffs_bytes_total > 0)
+        progress = (float)yaffs_bytes_count / (float)yaffs_bytes_total;
+    else if (yaffs_files_total != 0)
+        progress = (float)yaffs_files_count / (float)yaffs_files_total;
+    pthread_mutex_unlock(&yaffs_stats_mutex);
+
+    if (progress >= 0)
+        ui_set_progress(progress > 1 ? 1 : progress);
     ui_reset_text_col();
 }
 
+static void* directory_stats_thread(void* cookie)
+{
+    char* directory = (char*)cookie;
+    TreeStats stats;
+    int ret = tree_stats(directory, &stats, NULL, NULL);
+    free(directory);
+
+    pthread_mutex_lock(&yaffs_stats_mutex);
+    if (ret == 0) {
+        yaffs_files_total = stats.entries;
+        yaffs_bytes_total = stats.bytes;
+    }
+    yaffs_stats_ready = 1;
+    pthread_mutex_unlock(&yaffs_stats_mutex);
+    return NULL;
+}
+
+/* Starts counting what's in directory, without waiting for the result.
+ * Pair with finish_directory_stats() once the backup of it is done.
+ */
 void compute_directory_stats(char* directory)
 {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "find %s | wc -l > /tmp/dircount", directory);
-    __system(tmp);
-    char count_text[100];
-    FILE* f = fopen("/tmp/dircount", "r");
-    fread(count_text, 1, sizeof(count_text), f);
-    fclose(f);
+    finish_directory_stats();
     yaffs_files_count = 0;
-    yaffs_files_total = atoi(count_text);
+    yaffs_files_total = 0;
+    yaffs_bytes_count = 0;
+    yaffs_bytes_total = 0;
+    yaffs_stats_ready = 0;
+    yaffs_counting_bytes = 1;
     ui_reset_progress();
     ui_show_progress(1, 0);
+
+    /* If there's no thread to be had, count up front instead; the
+     * backup then starts a little later but shows progress the same.
+     */
+    char* copy = strdup(directory);
+    if (copy != NULL && pthread_create(&yaffs_stats_thread, NULL, directory_stats_thread, copy) == 0) {
+        yaffs_stats_running = 1;
+    } else if (copy != NULL) {
+        directory_stats_thread(copy);
+    }
+}
+
+void finish_directory_stats()
+{
+    if (yaffs_stats_running) {
+        pthread_join(yaffs_stats_thread, NULL);
+        yaffs_stats_running = 0;
+    }
+    yaffs_counting_bytes = 0;
+}
+
+/* Same output as "cd backup_path && md5sum *img > nandroid.md5"
+ */
+static int nandroid_generate_md5(const char* backup_path)
+{
+    char dir[PATH_MAX];
+    char tmp[PATH_MAX];
+    int numFiles = 0;
+    int i;
+    int ret = 0;
+
+    sprintf(dir, "%s/", backup_path);
+    char** files = gather_files(dir, "img", &numFiles);
+    sprintf(tmp, "%s/nandroid.md5", backup_path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        free_string_array(files);
+        return -1;
+    }
+    for (i = 0; i < numFiles; i++) {
+        char hex[MD5_HEX_SIZE];
+        if (0 != md5_file(files[i], hex)) {
+            ui_print("Can't read %s\n", files[i]);
+            ret = -1;
+            break;
+        }
+        fprintf(f, "%s  %s\n", hex, files[i] + strlen(dir));
+    }
+    if (fclose(f) != 0)
+        ret = -1;
+    free_string_array(files);
+    return ret;
+}
+
+/* Same check as "cd backup_path && md5sum -c nandroid.md5"
+ */
+static int nandroid_check_md5(const char* backup_path)
+{
+    char tmp[PATH_MAX];
+    char line[PATH_MAX + MD5_HEX_SIZE + 2];
+    int checked = 0;
+    int ret = 0;
+
+    sprintf(tmp, "%s/nandroid.md5", backup_path);
+    FILE* f = fopen(tmp, "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        // "<32 hex digits>  <name>", or " *<name>" for binary mode
+        char* name = line + MD5_HEX_SIZE - 1;
+        if (strlen(line) < MD5_HEX_SIZE + 1 || (*name != ' ' && *name != '\t'))
+            continue;
+        *name++ = '\0';
+        if (*name == ' ' || *name == '*')
+            name++;
+        name[strcspn(name, "\r\n")] = '\0';
+
+        char hex[MD5_HEX_SIZE];
+        sprintf(tmp, "%s/%s", backup_path, name);
+        if (0 != md5_file(tmp, hex) || 0 != strcasecmp(hex, line)) {
+            ui_print("%s: FAILED\n", name);
+            ret = -1;
+        }
+        checked++;
+    }
+    fclose(f);
+    return checked == 0 ? -1 : ret;
 }
 
 /* TAR backup functions
@@ -133,9 +268,7 @@ int tarbackup_backup(const char* backup_path, int backup_system, int backup_data
     if (sdcard_free_mb < 220)
         ui_print("There may not be enough free space to complete backup... continuing...\n");
 
-    char tmp[PATH_MAX];
-    sprintf(tmp, "mkdir -p %s", backup_path);
-    __system(tmp);
+    mkdir_p(backup_path);
 
     if (backup_system && 0 != (ret = tarbackup_backup_partition_extended(backup_path, "SYSTEM:", 1)))
         return ret;
@@ -231,8 +364,7 @@ int tarbackup_restore(const char* backup_path, int restore_system, int restore_d
     char tmp[PATH_MAX];
 /*
     ui_print("Checking MD5 sums...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
+    if (0 != nandroid_check_md5(backup_path))
         return print_and_error("MD5 mismatch!\n");
 */
     int ret=0;
@@ -283,6 +415,7 @@ int nandroid_backup_partition_extended(const char* backup_path, char* root, int
     char tmp[PATH_MAX];
     sprintf(tmp, "%s/%s.img", backup_path, name);
     ret = mkyaffs2image(mount_point, tmp, 0, callback);
+    finish_directory_stats();
     if (umount_when_finished) {
         ensure_root_path_unmounted(root);
     }
@@ -304,7 +437,16 @@ int nandroid_backup(const char* backup_path) {
 int nandroid_backup_flags(const char* backup_path, int flags)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
-    
+
+    // bring up everything we're about to read from in one go; the
+    // per-partition backups below find them already mounted
+    static const char* backup_roots[] = { "SDCARD:", "SYSTEM:", "DATA:",
+#ifdef HAS_DATADATA
+                                          "DATADATA:",
+#endif
+                                          "CACHE:" };
+    ensure_root_paths_mounted(backup_roots, sizeof(backup_roots) / sizeof(backup_roots[0]));
+
     if (ensure_root_path_mounted("SDCARD:") != 0)
         return print_and_error("Can't mount /sdcard\n");
     
@@ -321,8 +463,7 @@ int nandroid_backup_flags(const char* backup_path, int flags)
         ui_print("There may not be enough free space to complete backup... continuing...\n");
     
     char tmp[PATH_MAX];
-    sprintf(tmp, "mkdir -p %s", backup_path);
-    __system(tmp);
+    mkdir_p(backup_path);
 
 #ifndef BOARD_RECOVERY_IGNORE_BOOTABLES
     ui_print("Backing up boot...\n");
@@ -376,8 +517,7 @@ int nandroid_backup_flags(const char* backup_path, int flags)
     }
 
     ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    if (0 != (ret = nandroid_generate_md5(backup_path))) {
         ui_print("Error while generating md5 sum!\n");
         return ret;
     }
@@ -392,9 +532,7 @@ int nandroid_backup_flags(const char* backup_path, int flags)
 typedef int (*format_function)(char* root);
 
 void ensure_directory(const char* dir) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "mkdir -p %s", dir);
-    __system(tmp);
+    mkdir_p(dir);
 }
 
 int nandroid_restore_partition_extended(const char* backup_path, const char* root, int umount_when_finished) {
@@ -456,6 +594,7 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_show_indeterminate_progress();
     yaffs_files_total = 0;
+    yaffs_stats_ready = 0;
 
     if (ensure_root_path_mounted("SDCARD:") != 0)
         return print_and_error("Can't mount /sdcard\n");
@@ -463,8 +602,7 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     char tmp[PATH_MAX];
 
     ui_print("Checking MD5 sums...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
+    if (0 != nandroid_check_md5(backup_path))
         return print_and_error("MD5 mismatch!\n");
     
     int ret;
@@ -488,8 +626,8 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
           return ret;
       // we don't want to restore the /system/etc/lagfix.conf files as they can cause problems
       ensure_root_path_mounted("SYSTEM:");
-      __system("rm /system/etc/lagfix.conf");
-      __system("rm /system/etc/lagfix.conf.old");
+      unlink("/system/etc/lagfix.conf");
+      unlink("/system/etc/lagfix.conf.old");
     }
 
     if (restore_data && 0 != (ret = nandroid_restore_partition(backup_path, "DATA:")))
@@ -16,6 +16,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
@@ -28,6 +29,7 @@
 #include "mtdutils/mounts.h"
 #include "mmcutils/mmcutils.h"
 #include "minzip/Zip.h"
+#include "spawnutils/spawn.h"
 #include "roots.h"
 #include "common.h"
 #include "make_ext4fs.h"
@@ -68,6 +70,19 @@ static RootInfo g_roots[] = {
 
 // TODO: for SDCARD:, try /dev/block/mmcblk0 if mmcblk0p1 fails
 
+/* The MTD partition table can't change while we're running, so
+ * only read /proc/mtd the first time somebody needs it.
+ */
+static int g_mtd_scanned = 0;
+
+static void
+scan_mtd_partitions_once()
+{
+    if (!g_mtd_scanned && mtd_scan_partitions() >= 0) {
+        g_mtd_scanned = 1;
+    }
+}
+
 const RootInfo *
 get_root_info_for_path(const char *root_path)
 {
@@ -193,7 +208,7 @@ internal_root_mounted(const RootInfo *info)
 
     /* See if this root is already mounted.
      */
-    int ret = scan_mounted_volumes();
+    int ret = scan_mounted_volumes_cached();
     if (ret < 0) {
         return ret;
     }
@@ -217,16 +232,28 @@ is_root_path_mounted(const char *root_path)
     return internal_root_mounted(info) >= 0;
 }
 
+/* Recovery's own mount, which knows the filesystems the kernel call
+ * can't be given options for.  No shell:  /system/bin/sh may be what
+ * we're mounting.
+ */
+#define MOUNT_BIN "/sbin/mount"
+
+/* Callers must invalidate_mounted_volumes() afterwards.  This runs
+ * on several threads at once (ensure_root_paths_mounted()), so it
+ * leaves the mounted volume table alone, and runs mount itself rather
+ * than with __system(), which swaps the process's SIGINT and SIGQUIT
+ * handlers around the wait.
+ */
 static int mount_internal(const char* device, const char* mount_point, const char* filesystem, const char* filesystem_options)
 {
     if (strcmp(filesystem, "auto") != 0 && filesystem_options == NULL) {
         return mount(device, mount_point, filesystem, MS_NOATIME | MS_NODEV | MS_NODIRATIME, "");
     }
     else {
-        char mount_cmd[PATH_MAX];
         const char* options = filesystem_options == NULL ? "noatime,nodiratime,nodev" : filesystem_options;
-        sprintf(mount_cmd, "mount -t %s -o%s %s %s", filesystem, options, device, mount_point);
-        return __system(mount_cmd);
+        char* argv[] = { "mount", "-t", (char*)filesystem, "-o", (char*)options,
+                         (char*)device, (char*)mount_point, NULL };
+        return SpawnAndWait(MOUNT_BIN, argv);
     }
 }
 
@@ -295,7 +322,9 @@ int detect_internal_fs(const char *root_path)
     int i;
     for (i=0; i<NUM_FSYSTEMS; i++) {
     	LOGW("detect_internal_fs: Try to mount: %s as %s (%s) - ", root_path, g_fs_options[i].filesystem, g_fs_options[i].filesystem_options);
-    	if (mount_internal(info->device, info->mount_point, g_fs_options[i].filesystem, g_fs_options[i].filesystem_options) == 0) {
+    	int mounted = mount_internal(info->device, info->mount_point, g_fs_options[i].filesystem, g_fs_options[i].filesystem_options) == 0;
+    	invalidate_mounted_volumes();
+    	if (mounted) {
     		LOGW("success\n");
     		/* success
     		 * set type of fs & options for root_path
@@ -312,29 +341,19 @@ int detect_internal_fs(const char *root_path)
     return -1;
 }
 
-int
-ensure_root_path_mounted(const char *root_path)
+/* Does the actual mount of a root we know isn't mounted yet.  Doesn't
+ * touch the mounted volume table or the signal handlers (see
+ * mount_internal()), so it's safe to run several of these at once as
+ * long as the MTD partitions have already been scanned.  The caller
+ * invalidates the mounted volume table once they're all done.
+ */
+static int
+mount_root_device(const RootInfo *info)
 {
-    const RootInfo *info = get_root_info_for_path(root_path);
-    if (info == NULL) {
-        return -1;
-    }
-
-    int ret = internal_root_mounted(info);
-    if (ret >= 0) {
-        /* It's already mounted.
-         */
-        return 0;
-    }
-
-    /* It's not mounted.
-     */
     if (info->device == g_mtd_device) {
         if (info->partition_name == NULL) {
             return -1;
         }
-//TODO: make the mtd stuff scan once when it needs to
-        mtd_scan_partitions();
         const MtdPartition *partition;
         partition = mtd_find_partition_by_name(info->partition_name);
         if (partition == NULL) {
@@ -366,6 +385,112 @@ ensure_root_path_mounted(const char *root_path)
     return 0;
 }
 
+int
+ensure_root_path_mounted(const char *root_path)
+{
+    const RootInfo *info = get_root_info_for_path(root_path);
+    if (info == NULL) {
+        return -1;
+    }
+
+    int ret = internal_root_mounted(info);
+    if (ret >= 0) {
+        /* It's already mounted.
+         */
+        return 0;
+    }
+
+    /* It's not mounted.
+     */
+    if (info->device == g_mtd_device) {
+        scan_mtd_partitions_once();
+    }
+    ret = mount_root_device(info);
+    invalidate_mounted_volumes();
+    return ret;
+}
+
+typedef struct {
+    const RootInfo *info;
+    pthread_t thread;
+    int started;
+    int ret;
+} MountJob;
+
+static void *
+mount_root_thread(void *cookie)
+{
+    MountJob *job = (MountJob *)cookie;
+    job->ret = mount_root_device(job->info);
+    return NULL;
+}
+
+int
+ensure_root_paths_mounted(const char * const *root_paths, int count)
+{
+    MountJob jobs[NUM_ROOTS];
+    int njobs = 0;
+    int ret = 0;
+    int i, j;
+
+    /* Work out which roots still need mounting, using a single look
+     * at the mount table.
+     */
+    for (i = 0; i < count; i++) {
+        const RootInfo *info = get_root_info_for_path(root_paths[i]);
+        if (info == NULL) {
+            ret = -1;
+            continue;
+        }
+        if (internal_root_mounted(info) >= 0) {
+            continue;
+        }
+        for (j = 0; j < njobs; j++) {
+            if (jobs[j].info == info) {
+                break;
+            }
+        }
+        if (j < njobs) {
+            continue;
+        }
+        if (info->device == g_mtd_device) {
+            scan_mtd_partitions_once();
+        }
+        jobs[njobs].info = info;
+        jobs[njobs].started = 0;
+        jobs[njobs].ret = -1;
+        njobs++;
+    }
+    if (njobs == 0) {
+        return ret;
+    }
+
+    /* Mount everything at once; the slow part is the filesystem
+     * driver replaying its journal, which doesn't serialize across
+     * devices.  If we can't get a thread, just do it inline.
+     */
+    for (i = 0; i < njobs; i++) {
+        if (njobs > 1 && pthread_create(&jobs[i].thread, NULL,
+                mount_root_thread, &jobs[i]) == 0) {
+            jobs[i].started = 1;
+        } else {
+            mount_root_thread(&jobs[i]);
+        }
+    }
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].started) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+        if (jobs[i].ret != 0) {
+            LOGW("ensure_root_paths_mounted: can't mount \"%s\"\n",
+                    jobs[i].info->name);
+            ret = -1;
+        }
+    }
+    invalidate_mounted_volumes();
+    return ret;
+}
+
 int
 ensure_root_path_unmounted(const char *root_path)
 {
@@ -382,7 +507,7 @@ ensure_root_path_unmounted(const char *root_path)
 
     /* See if this root is already mounted.
      */
-    int ret = scan_mounted_volumes();
+    int ret = scan_mounted_volumes_cached();
     if (ret < 0) {
         return ret;
     }
@@ -411,7 +536,7 @@ get_root_mtd_partition(const char *root_path)
         return NULL;
 #endif
     }
-    mtd_scan_partitions();
+    scan_mtd_partitions_once();
     return mtd_find_partition_by_name(info->partition_name);
 }
 
@@ -450,7 +575,7 @@ format_root_device(const char *root)
     /* Format the device.
      */
     if (info->device == g_mtd_device) {
-        mtd_scan_partitions();
+        scan_mtd_partitions_once();
         const MtdPartition *partition;
         partition = mtd_find_partition_by_name(info->partition_name);
         if (partition == NULL) {
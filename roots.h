@@ -125,6 +125,11 @@ int is_root_path_mounted(const char *root_path);
 
 int ensure_root_path_mounted(const char *root_path);
 
+/* Mounts every root in root_paths that isn't mounted yet, all at the
+ * same time.  Returns zero only if all of them ended up mounted.
+ */
+int ensure_root_paths_mounted(const char * const *root_paths, int count);
+
 int ensure_root_path_unmounted(const char *root_path);
 
 const MtdPartition *get_root_mtd_partition(const char *root_path);
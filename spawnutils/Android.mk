@@ -0,0 +1,11 @@
+ifneq ($(TARGET_SIMULATOR),true)
+
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := spawn.c
+LOCAL_MODULE := libspawnutils
+
+include $(BUILD_STATIC_LIBRARY)
+
+endif  # !TARGET_SIMULATOR
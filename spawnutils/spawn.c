@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "spawn.h"
+
+int SpawnAndWait(const char* path, char* const argv[]) {
+    // The child shares our memory until it execs, so it can leave the
+    // reason an exec failed here.
+    volatile int exec_errno = 0;
+
+    pid_t pid = vfork();
+    if (pid < 0) {
+        fprintf(stderr, "can't run %s: vfork failed: %s\n",
+                path, strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        execv(path, argv);
+        exec_errno = errno;
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "waiting for %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    if (exec_errno != 0) {
+        fprintf(stderr, "can't run %s: %s\n", path, strerror(exec_errno));
+        return -1;
+    }
+    return status;
+}
+
+// -----------------------------------------------------------------
+//   the busybox coprocess
+// -----------------------------------------------------------------
+
+// Each command is written to the shell's stdin (a socket, so a dead
+// shell gets us EPIPE rather than SIGPIPE) as one line, followed by
+// writing its exit status to the shell's fd 3, which we read.  The
+// shell's fd 4 is the stdin we had when it started, which each
+// command gets as its own.  Each command runs in a subshell, so
+// nothing it does (exit, cd, setting variables) outlives it.
+
+static pid_t coprocess_pid = -1;
+static int coprocess_in = -1;
+static FILE* coprocess_status = NULL;
+static char* coprocess_path = NULL;
+static int coprocess_broken = 0;    // failed to start; don't retry
+
+static int SendLine(const char* line, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(coprocess_in, line, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        line += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Returns the status the shell reports for the last command, or -1
+// if it has gone away.
+static int ReadStatus() {
+    char line[32];
+    if (fgets(line, sizeof(line), coprocess_status) == NULL) return -1;
+    return atoi(line);
+}
+
+static int StartCoprocess(const char* path) {
+    int have_stdin = fcntl(0, F_GETFD) >= 0;
+    int in[2];
+    int status[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, in) < 0) return -1;
+    if (pipe(status) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    // None of these belong in anything else we start; the child gets
+    // its ends by dup2(), which clears the flag.
+    fcntl(in[0], F_SETFD, FD_CLOEXEC);
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(status[0], F_SETFD, FD_CLOEXEC);
+    fcntl(status[1], F_SETFD, FD_CLOEXEC);
+
+    // Only done once, so a plain fork() (where the child can safely
+    // shuffle its fds) is fine.
+    pid_t pid = fork();
+    if (pid == 0) {
+        int saved_stdin = have_stdin ? fcntl(0, F_DUPFD, 5)
+                                     : open("/dev/null", O_RDONLY);
+        dup2(in[0], 0);
+        dup2(status[1], 3);
+        if (saved_stdin >= 0) dup2(saved_stdin, 4);
+
+        // The shell outlives the command that started it; it mustn't
+        // hold on to anything else of ours (the command pipe back to
+        // recovery, the package) for the rest of the run.
+        int fd;
+        int max_fd = getdtablesize();
+        for (fd = 5; fd < max_fd; ++fd) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        execl(path, path, "sh", NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(status[1]);
+    if (pid < 0) {
+        close(in[1]);
+        close(status[0]);
+        return -1;
+    }
+
+    coprocess_pid = pid;
+    coprocess_in = in[1];
+    coprocess_status = fdopen(status[0], "r");
+    free(coprocess_path);
+    coprocess_path = strdup(path);
+
+    // Make sure it's really a shell before handing it anything.
+    static const char hello[] = "echo 0 >&3\n";
+    if (SendLine(hello, sizeof(hello)-1) < 0 || ReadStatus() != 0) {
+        fprintf(stderr, "can't start \"%s sh\"; running programs directly\n",
+                path);
+        StopCoprocess();
+        return -1;
+    }
+    fprintf(stderr, "started \"%s sh\" (pid %d) for run_program\n",
+            path, (int)pid);
+    return 0;
+}
+
+void StopCoprocess() {
+    if (coprocess_pid < 0) return;
+    close(coprocess_in);
+    fclose(coprocess_status);
+    waitpid(coprocess_pid, NULL, 0);
+    coprocess_pid = -1;
+    coprocess_in = -1;
+    coprocess_status = NULL;
+}
+
+// Append s to the command line in single quotes.
+static void AppendQuoted(char** line, size_t* len, size_t* alloc,
+                         const char* s) {
+    size_t need = *len + strlen(s) * 4 + 3;
+    if (need > *alloc) {
+        *alloc = need * 2;
+        *line = realloc(*line, *alloc);
+    }
+    char* p = *line + *len;
+    *p++ = '\'';
+    for (; *s; ++s) {
+        if (*s == '\'') {
+            memcpy(p, "'\\''", 4);
+            p += 4;
+        } else {
+            *p++ = *s;
+        }
+    }
+    *p++ = '\'';
+    *p++ = ' ';
+    *len = p - *line;
+}
+
+static int RunInCoprocess(char* const argv[]) {
+    size_t len = 2;
+    size_t alloc = 256;
+    char* line = malloc(alloc);
+    memcpy(line, "( ", 2);
+    int i;
+    for (i = 1; argv[i] != NULL; ++i) {
+        AppendQuoted(&line, &len, &alloc, argv[i]);
+    }
+    // The command reads our stdin rather than the rest of the shell's
+    // script, and mustn't keep the status pipe open if it leaves
+    // something running.
+    static const char tail[] = ") <&4 3>&- 4<&-; echo $? >&3\n";
+    line = realloc(line, len + sizeof(tail));
+    memcpy(line + len, tail, sizeof(tail));
+
+    int status = -1;
+    if (SendLine(line, strlen(line)) == 0) {
+        status = ReadStatus();
+    }
+    free(line);
+    if (status < 0) {
+        fprintf(stderr, "\"%s sh\" went away running %s\n",
+                coprocess_path, argv[1]);
+        StopCoprocess();
+        return -1;
+    }
+    // Make it a wait status.  The shell reports a command killed by
+    // signal n as 128+n.
+    if (status > 128 && status < 128 + NSIG) {
+        return status - 128;
+    }
+    return (status & 0xff) << 8;
+}
+
+// Whether busybox run with argv would run the applet argv[1] -- which
+// is what the shell will do with it -- rather than acting on its own
+// name or taking argv[1] as one of its options.
+static int RunsApplet(char* const argv[]) {
+    if (argv[0] == NULL || argv[1] == NULL) return 0;
+    const char* base = strrchr(argv[0], '/');
+    base = base ? base+1 : argv[0];
+    return strncmp(base, "busybox", 7) == 0 &&
+        argv[1][0] != '\0' && argv[1][0] != '-' &&
+        strchr(argv[1], '/') == NULL;
+}
+
+int RunProgram(const char* path, char* const argv[]) {
+    const char* busybox = getenv(COPROCESS_ENV);
+    if (busybox == NULL || strcmp(path, busybox) != 0 ||
+        !RunsApplet(argv) || coprocess_broken) {
+        return SpawnAndWait(path, argv);
+    }
+
+    if (coprocess_pid >= 0 && strcmp(coprocess_path, path) != 0) {
+        StopCoprocess();
+    }
+    if (coprocess_pid < 0 && StartCoprocess(path) < 0) {
+        coprocess_broken = 1;
+        return SpawnAndWait(path, argv);
+    }
+    return RunInCoprocess(argv);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SPAWNUTILS_SPAWN_H_
+#define _SPAWNUTILS_SPAWN_H_
+
+// Running programs for run_program() in amend and edify scripts.
+
+// Run 'path' with argv (NULL-terminated) and wait for it.  Uses
+// vfork(), so the cost doesn't grow with the size of the caller (the
+// updater has the whole package mapped).  Returns the wait status, or
+// -1 if the program couldn't be started (after printing why).
+int SpawnAndWait(const char* path, char* const argv[]);
+
+// Set this to the path of a busybox binary to run consecutive
+// "busybox <applet> ..." commands in one long-lived "busybox sh"
+// instead of a process each.  The shell finds the applet itself:  a
+// standalone shell runs it in-process, otherwise it's looked up in
+// PATH (in recovery, /sbin has a link to busybox for every applet).
+#define COPROCESS_ENV "UPDATER_COPROCESS"
+
+// Like SpawnAndWait(path, argv), except that when 'path' is the busybox
+// named by COPROCESS_ENV, and argv is "busybox <applet> ...", the
+// command goes to the coprocess (started on first use) to run in a
+// subshell.  Its stdin, stdout and stderr are the ones we had then.
+// A command that exits with a status over 128 is taken to have been
+// killed by a signal, as the shell can't tell us the difference.
+int RunProgram(const char* path, char* const argv[]);
+
+// Stop the coprocess, if any.
+void StopCoprocess();
+
+#endif
@@ -77,5 +77,17 @@ test_roots()
     if (file_exists(CANARY_FILE)) return -__LINE__;
     if (is_root_path_mounted(CANARY_FILE_ROOT_PATH)) return -__LINE__;
 
+    /* Mount it again through the batch interface, naming it twice.
+     */
+    const char *roots[] = { CANARY_FILE_ROOT_PATH, "SYSTEM:" };
+    ret = ensure_root_paths_mounted(roots, 2);
+    if (ret < 0) return -__LINE__;
+    if (!file_exists(CANARY_FILE)) return -__LINE__;
+    if (!is_root_path_mounted(CANARY_FILE_ROOT_PATH)) return -__LINE__;
+
+    ret = ensure_root_path_unmounted(CANARY_FILE_ROOT_PATH);
+    if (ret < 0) return -__LINE__;
+    if (is_root_path_mounted(CANARY_FILE_ROOT_PATH)) return -__LINE__;
+
     return 0;
 }
@@ -0,0 +1,19 @@
+ifneq ($(TARGET_SIMULATOR),true)
+
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := trace.c
+LOCAL_MODULE := libtraceutils
+
+include $(BUILD_STATIC_LIBRARY)
+
+# For the host edify and amend tools.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := trace.c
+LOCAL_MODULE := libtraceutils
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+endif  # !TARGET_SIMULATOR
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+volatile int gTraceEnabled = 0;
+
+typedef struct {
+    const char* name;
+    const char* category;
+    int line;
+    int column;
+    int tid;
+    int64_t start_us;
+    int64_t dur_us;
+    int64_t read_bytes;
+    int64_t write_bytes;
+    int64_t syscalls;
+} TraceEvent;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceEvent* events = NULL;
+static int events_count = 0;
+static int events_alloc = 0;
+static char* trace_path = NULL;
+static int64_t trace_start_us;
+
+// Reading our own I/O counters is itself a read() syscall, which the
+// kernel counts along with the bytes it returns.  Each thread keeps
+// a running total of that, so spans can leave it out.
+typedef struct {
+    int64_t syscalls;
+    int64_t bytes;
+} Overhead;
+
+static pthread_key_t overhead_key;
+static pthread_once_t overhead_once = PTHREAD_ONCE_INIT;
+
+static void CreateOverheadKey() {
+    pthread_key_create(&overhead_key, free);
+}
+
+static Overhead* ThreadOverhead() {
+    pthread_once(&overhead_once, CreateOverheadKey);
+    Overhead* o = pthread_getspecific(overhead_key);
+    if (o == NULL) {
+        o = calloc(1, sizeof(Overhead));
+        pthread_setspecific(overhead_key, o);
+    }
+    return o;
+}
+
+static int GetTid() {
+    return syscall(__NR_gettid);
+}
+
+static int64_t NowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t IoField(const char* buffer, const char* field) {
+    const char* p = strstr(buffer, field);
+    return p ? strtoll(p + strlen(field), NULL, 10) : 0;
+}
+
+// Read this thread's I/O counters.  They stay zero if the kernel
+// doesn't keep them (no CONFIG_TASK_IO_ACCOUNTING).
+static void ReadIo(TraceSpan* span, Overhead* o) {
+    char path[64];
+    char buffer[512];
+    span->read_bytes = span->write_bytes = span->syscalls = 0;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/io", GetTid());
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    ssize_t n = read(fd, buffer, sizeof(buffer)-1);
+    close(fd);
+    if (n <= 0) return;
+    buffer[n] = '\0';
+
+    span->read_bytes = IoField(buffer, "rchar:");
+    span->write_bytes = IoField(buffer, "wchar:");
+    span->syscalls = IoField(buffer, "syscr:") + IoField(buffer, "syscw:");
+    o->syscalls += 1;
+    o->bytes += n;
+}
+
+void TraceStart(const char* json_path) {
+    pthread_mutex_lock(&trace_lock);
+    free(trace_path);
+    trace_path = strdup(json_path);
+    events_count = 0;
+    trace_start_us = NowUs();
+    gTraceEnabled = 1;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int TraceStartFromEnv() {
+    const char* path = getenv(TRACE_ENV);
+    if (path == NULL || path[0] == '\0') return 0;
+    printf("tracing script execution to %s\n", path);
+    TraceStart(path);
+    return 1;
+}
+
+void TraceBegin(TraceSpan* span) {
+    Overhead* o = ThreadOverhead();
+    span->overhead_syscalls = o->syscalls;
+    span->overhead_bytes = o->bytes;
+    ReadIo(span, o);
+    span->start_us = NowUs();
+}
+
+void TraceEnd(TraceSpan* span, const char* name, const char* category,
+              int line, int column) {
+    int64_t end_us = NowUs();
+    Overhead* o = ThreadOverhead();
+    int64_t overhead_syscalls = o->syscalls - span->overhead_syscalls;
+    int64_t overhead_bytes = o->bytes - span->overhead_bytes;
+    TraceSpan now;
+    ReadIo(&now, o);
+
+    TraceEvent e;
+    e.name = name;
+    e.category = category;
+    e.line = line;
+    e.column = column;
+    e.tid = GetTid();
+    e.start_us = span->start_us;
+    e.dur_us = end_us - span->start_us;
+    e.read_bytes = now.read_bytes - span->read_bytes - overhead_bytes;
+    e.write_bytes = now.write_bytes - span->write_bytes;
+    e.syscalls = now.syscalls - span->syscalls - overhead_syscalls;
+    if (e.read_bytes < 0) e.read_bytes = 0;
+    if (e.syscalls < 0) e.syscalls = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    if (gTraceEnabled) {
+        if (events_count >= events_alloc) {
+            events_alloc = events_alloc * 2 + 256;
+            events = realloc(events, events_alloc * sizeof(TraceEvent));
+        }
+        events[events_count++] = e;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void WriteJsonString(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", (unsigned char)*s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static int WriteJson(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        printf("failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int pid = getpid();
+    fprintf(f, "{\"traceEvents\":[\n");
+    int i;
+    for (i = 0; i < events_count; ++i) {
+        const TraceEvent* e = events + i;
+        fprintf(f, "{\"name\":");
+        WriteJsonString(f, e->name);
+        fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%lld,\"dur\":%lld,\"args\":{\"line\":%d,\"column\":%d,"
+                "\"read_bytes\":%lld,\"write_bytes\":%lld,\"syscalls\":%lld}}%s\n",
+                e->category, pid, e->tid,
+                (long long)(e->start_us - trace_start_us), (long long)e->dur_us,
+                e->line, e->column, (long long)e->read_bytes,
+                (long long)e->write_bytes, (long long)e->syscalls,
+                i+1 < events_count ? "," : "");
+    }
+    fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+    if (fclose(f) != 0) {
+        printf("failed to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int CompareDuration(const void* a, const void* b) {
+    int64_t da = ((const TraceEvent*)a)->dur_us;
+    int64_t db = ((const TraceEvent*)b)->dur_us;
+    return da > db ? -1 : da < db ? 1 : 0;
+}
+
+typedef struct {
+    const char* name;
+    int calls;
+    int64_t total_us;
+    int64_t read_bytes;
+    int64_t write_bytes;
+} FunctionTotal;
+
+static int CompareTotal(const void* a, const void* b) {
+    int64_t ta = ((const FunctionTotal*)a)->total_us;
+    int64_t tb = ((const FunctionTotal*)b)->total_us;
+    return ta > tb ? -1 : ta < tb ? 1 : 0;
+}
+
+static void PrintSummary(int top) {
+    int i, j;
+    printf("trace: %d calls in %.1f ms\n", events_count,
+           (NowUs() - trace_start_us) / 1000.0);
+
+    // Totals per function.  Nested calls are counted in their callers
+    // too, so these overlap.
+    FunctionTotal* totals = calloc(events_count + 1, sizeof(FunctionTotal));
+    int totals_count = 0;
+    for (i = 0; i < events_count; ++i) {
+        for (j = 0; j < totals_count; ++j) {
+            if (strcmp(totals[j].name, events[i].name) == 0) break;
+        }
+        if (j == totals_count) {
+            totals[totals_count++].name = events[i].name;
+        }
+        totals[j].calls++;
+        totals[j].total_us += events[i].dur_us;
+        totals[j].read_bytes += events[i].read_bytes;
+        totals[j].write_bytes += events[i].write_bytes;
+    }
+    qsort(totals, totals_count, sizeof(FunctionTotal), CompareTotal);
+    printf("trace: functions by total time:\n");
+    for (i = 0; i < totals_count && i < top; ++i) {
+        printf("  %10.1f ms %6d calls  read %lld  wrote %lld  %s\n",
+               totals[i].total_us / 1000.0, totals[i].calls,
+               (long long)totals[i].read_bytes,
+               (long long)totals[i].write_bytes, totals[i].name);
+    }
+    free(totals);
+
+    qsort(events, events_count, sizeof(TraceEvent), CompareDuration);
+    printf("trace: slowest calls:\n");
+    for (i = 0; i < events_count && i < top; ++i) {
+        const TraceEvent* e = events + i;
+        printf("  %10.1f ms  line %d col %d  %s  read %lld  wrote %lld  "
+               "syscalls %lld\n",
+               e->dur_us / 1000.0, e->line, e->column, e->name,
+               (long long)e->read_bytes, (long long)e->write_bytes,
+               (long long)e->syscalls);
+    }
+}
+
+void TraceFinish(int top) {
+    pthread_mutex_lock(&trace_lock);
+    if (!gTraceEnabled) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    gTraceEnabled = 0;
+
+    if (WriteJson(trace_path) == 0) {
+        printf("wrote %d trace events to %s\n", events_count, trace_path);
+    }
+    PrintSummary(top);
+
+    free(events);
+    events = NULL;
+    events_count = events_alloc = 0;
+    free(trace_path);
+    trace_path = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TRACEUTILS_TRACE_H_
+#define _TRACEUTILS_TRACE_H_
+
+#include <stdint.h>
+
+// Records how long each script function takes, and the I/O it does,
+// for edify and amend scripts.
+//
+// Set UPDATER_TRACE in the environment to the path of a file to trace
+// script execution into.  The file gets Chrome trace-event JSON (load
+// it in chrome://tracing); a summary of the slowest calls goes to
+// stdout, and so to the recovery log.
+
+#define TRACE_ENV "UPDATER_TRACE"
+
+// How many entries the summaries list.
+#define TRACE_SUMMARY_TOP 20
+
+// Nonzero while tracing; check it before calling TraceBegin().
+extern volatile int gTraceEnabled;
+
+// Start tracing if TRACE_ENV is set.  Returns nonzero if it is.
+int TraceStartFromEnv();
+
+// Start tracing into json_path.
+void TraceStart(const char* json_path);
+
+// If tracing, stop, write the trace file, and print the 'top'
+// slowest calls and the functions with the most time.
+void TraceFinish(int top);
+
+typedef struct {
+    int64_t start_us;
+    int64_t read_bytes;
+    int64_t write_bytes;
+    int64_t syscalls;
+    int64_t overhead_syscalls;
+    int64_t overhead_bytes;
+} TraceSpan;
+
+// Mark the start of a call.
+void TraceBegin(TraceSpan* span);
+
+// Record a call that started at TraceBegin(span).  'name' must stay
+// valid until TraceFinish(); 'line' and 'column' locate it in the
+// script (1-based; 0 if unknown).
+void TraceEnd(TraceSpan* span, const char* name, const char* category,
+              int line, int column);
+
+#endif
@@ -3,7 +3,10 @@
 LOCAL_PATH := $(call my-dir)
 
 updater_src_files := \
+	channel.c \
 	install.c \
+	parallel.c \
+	plan.c \
 	updater.c
 
 #
@@ -24,8 +27,8 @@ ifdef BOARD_USES_BMLUTILS
 endif
 
 LOCAL_STATIC_LIBRARIES += $(TARGET_RECOVERY_UPDATER_LIBS) $(TARGET_RECOVERY_UPDATER_EXTRA_LIBS)
-LOCAL_STATIC_LIBRARIES += libapplypatch libedify libmtdutils libmmcutils libminzip libz
-LOCAL_STATIC_LIBRARIES += libmincrypt libbz
+LOCAL_STATIC_LIBRARIES += libapplypatch libedify libtraceutils libmtdutils libmmcutils libminzip libz
+LOCAL_STATIC_LIBRARIES += libmincrypt libhashutils libspawnutils libbz
 LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 
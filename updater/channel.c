@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "channel.h"
+
+static int WriteFully(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Send a frame, or several if the payload is too long for one (only
+// done for text, where that makes no difference).
+static int SendFrame(UpdateChannel* c, int type,
+                     const void* payload, size_t len) {
+    const char* p = (const char*)payload;
+    do {
+        size_t chunk = len > CHANNEL_MAX_PAYLOAD ? CHANNEL_MAX_PAYLOAD : len;
+        uint8_t header[CHANNEL_HEADER_SIZE];
+        header[0] = type;
+        header[1] = chunk;
+        header[2] = chunk >> 8;
+        struct iovec iov[2];
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = (void*)p;
+        iov[1].iov_len = chunk;
+        if (WriteFully(c->fd, iov, 2) < 0) {
+            fprintf(stderr, "failed to write to recovery: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+        p += chunk;
+        len -= chunk;
+    } while (len > 0);
+    return 0;
+}
+
+static void PutLE32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t Millionths(double frac) {
+    if (frac < 0.0) frac = 0.0;
+    if (frac > 1.0) frac = 1.0;
+    return (uint32_t)(frac * 1000000 + 0.5);
+}
+
+// cmd_pipe's write function when framing:  wraps whatever it's given
+// in CHANNEL_TEXT frames.  It's line buffered, so that's a line at a
+// time.
+static int CookieWrite(void* cookie, const char* buf, int size) {
+    UpdateChannel* c = (UpdateChannel*)cookie;
+    return SendFrame(c, CHANNEL_TEXT, buf, size) < 0 ? -1 : size;
+}
+
+UpdateChannel* OpenUpdateChannel(int fd) {
+    UpdateChannel* c = calloc(1, sizeof(UpdateChannel));
+    c->fd = fd;
+    c->last_progress = ~0u;
+
+    const char* offer = getenv(CHANNEL_ENV);
+    if (offer != NULL) {
+        c->framed = 1;
+        int shared_fd = atoi(offer);
+        if (shared_fd >= 0) {
+            void* p = mmap(NULL, CHANNEL_SHARED_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, shared_fd, 0);
+            if (p == MAP_FAILED) {
+                fprintf(stderr, "can't map progress word: %s\n",
+                        strerror(errno));
+            } else {
+                c->progress_word = (volatile uint32_t*)p;
+            }
+            // Mapped (or not), the fd has done its job; don't let
+            // anything we run inherit it.
+            close(shared_fd);
+        }
+        // Programs we run don't need to know.
+        unsetenv(CHANNEL_ENV);
+        SendFrame(c, CHANNEL_HELLO, CHANNEL_MAGIC, strlen(CHANNEL_MAGIC));
+        c->cmd_pipe = funopen(c, NULL, CookieWrite, NULL, NULL);
+    } else {
+        c->cmd_pipe = fdopen(fd, "wb");
+    }
+    setlinebuf(c->cmd_pipe);
+    return c;
+}
+
+void ChannelPrint(UpdateChannel* c, const char* line) {
+    fflush(c->cmd_pipe);
+    if (c->framed) {
+        SendFrame(c, CHANNEL_UI_PRINT, line, strlen(line));
+    } else if (line[0] == '\0') {
+        fprintf(c->cmd_pipe, "ui_print\n");
+    } else {
+        fprintf(c->cmd_pipe, "ui_print %s\n", line);
+    }
+}
+
+void ChannelShowProgress(UpdateChannel* c, double frac, int seconds) {
+    fflush(c->cmd_pipe);
+    c->last_progress = ~0u;
+    if (c->framed) {
+        uint8_t payload[8];
+        PutLE32(payload, Millionths(frac));
+        PutLE32(payload+4, seconds);
+        SendFrame(c, CHANNEL_PROGRESS, payload, sizeof(payload));
+        ++c->segment;
+    } else {
+        fprintf(c->cmd_pipe, "progress %f %d\n", frac, seconds);
+    }
+}
+
+void ChannelSetProgress(UpdateChannel* c, double frac) {
+    // Repeats don't move the bar; don't send them.
+    uint32_t millionths = Millionths(frac);
+    if (millionths == c->last_progress) return;
+    c->last_progress = millionths;
+
+    if (c->progress_word != NULL) {
+        *c->progress_word =
+            CHANNEL_PROGRESS_WORD(c->segment & 0xff, millionths / 1e6);
+    } else if (c->framed) {
+        fflush(c->cmd_pipe);
+        uint8_t payload[4];
+        PutLE32(payload, millionths);
+        SendFrame(c, CHANNEL_SET_PROGRESS, payload, sizeof(payload));
+    } else {
+        fprintf(c->cmd_pipe, "set_progress %f\n", frac);
+    }
+}
+
+void CloseUpdateChannel(UpdateChannel* c) {
+    fclose(c->cmd_pipe);
+    if (c->framed) close(c->fd);
+    if (c->progress_word != NULL) {
+        munmap((void*)c->progress_word, CHANNEL_SHARED_SIZE);
+    }
+    free(c);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_CHANNEL_H_
+#define _UPDATER_CHANNEL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// The pipe from the update binary back to recovery.
+//
+// Originally it carried lines of text ("ui_print ...", "progress ...",
+// "set_progress ...", see try_update_binary() in install.c), and any
+// update binary may still send those.  If recovery sets
+// CHANNEL_ENV in the binary's environment, it also understands a
+// framed binary protocol:
+//
+//   - every frame is a one-byte type, a two-byte little-endian payload
+//     length, and the payload;
+//
+//   - the first frame is CHANNEL_HELLO, whose leading zero byte can't
+//     start a text command, so recovery can tell the two apart;
+//
+//   - if CHANNEL_ENV's value is a file descriptor (rather than "-1"),
+//     it is a file of at least CHANNEL_SHARED_SIZE bytes to map shared,
+//     whose first word is the progress within the current segment.
+//     set_progress then just stores to memory, and recovery picks it
+//     up when it next redraws.
+//
+// Recovery reads the pipe on its own thread, so the updater never
+// waits for the screen.
+
+#define CHANNEL_ENV "UPDATE_CHANNEL"
+#define CHANNEL_SHARED_SIZE 4096
+
+enum {
+    CHANNEL_HELLO = 0,          // CHANNEL_MAGIC
+    CHANNEL_UI_PRINT,           // text, without a newline
+    CHANNEL_PROGRESS,           // LE32 fraction (millionths), LE32 seconds
+    CHANNEL_SET_PROGRESS,       // LE32 fraction (millionths)
+    CHANNEL_TEXT,               // bytes of the text protocol
+};
+
+#define CHANNEL_MAGIC "UPB1"
+#define CHANNEL_HEADER_SIZE 3
+#define CHANNEL_MAX_PAYLOAD 65535
+
+// The shared progress word:  the low 24 bits are the fraction of the
+// segment (scaled to CHANNEL_PROGRESS_ONE), the top 8 the number of
+// CHANNEL_PROGRESS frames sent before it, so a reader that hasn't
+// seen the frame starting a segment yet can ignore it.
+#define CHANNEL_PROGRESS_ONE 0xffffff
+#define CHANNEL_PROGRESS_WORD(segment, frac) \
+    (((uint32_t)(segment) << 24) | \
+     (uint32_t)((frac) * CHANNEL_PROGRESS_ONE + 0.5))
+
+// The updater's end.
+typedef struct {
+    int fd;
+    int framed;                         // using frames, not text
+    volatile uint32_t* progress_word;   // shared; NULL if none
+    int segment;                        // CHANNEL_PROGRESS frames sent
+    uint32_t last_progress;             // last set_progress sent
+    FILE* cmd_pipe;                     // text commands, for extensions
+} UpdateChannel;
+
+// Open the channel on the pipe 'fd', using frames if recovery offered
+// them.  cmd_pipe always accepts the text protocol (device extensions
+// write to it); with frames it wraps what's written in CHANNEL_TEXT.
+UpdateChannel* OpenUpdateChannel(int fd);
+
+void ChannelPrint(UpdateChannel* channel, const char* line);
+void ChannelShowProgress(UpdateChannel* channel, double frac, int seconds);
+void ChannelSetProgress(UpdateChannel* channel, double frac);
+
+void CloseUpdateChannel(UpdateChannel* channel);
+
+#endif
@@ -31,13 +31,64 @@
 #include "cutils/properties.h"
 #include "edify/expr.h"
 #include "mincrypt/sha.h"
+#include "hashutils/sha1.h"
+#include "hashutils/dirhash.h"
+#include "spawnutils/spawn.h"
 #include "minzip/DirUtil.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "mmcutils/mmcutils.h"
+#include "install.h"
 #include "updater.h"
 #include "applypatch/applypatch.h"
 
+static ScriptPlan* PlanOf(State* state) {
+    return ((UpdaterInfo*)(state->cookie))->plan;
+}
+
+int MountVolume(const char* type, const char* location,
+                const char* mount_point) {
+    mkdir(mount_point, 0755);
+
+    if (strcmp(type, "MTD") == 0) {
+        mtd_scan_partitions();
+        const MtdPartition* mtd;
+        mtd = mtd_find_partition_by_name(location);
+        if (mtd == NULL) {
+            fprintf(stderr, "mount: no mtd partition named \"%s\"",
+                    location);
+            return -1;
+        }
+        if (mtd_mount_partition(mtd, mount_point, "yaffs2", 0 /* rw */) != 0) {
+            fprintf(stderr, "mtd mount of %s failed: %s\n",
+                    location, strerror(errno));
+            return -1;
+        }
+    } else if (strcmp(type, "MMC") == 0) {
+        mmc_scan_partitions();
+        const MmcPartition* mmc;
+        mmc = mmc_find_partition_by_name(location);
+        if (mmc == NULL) {
+            fprintf(stderr, "mount: no mmc partition named \"%s\"",
+                    location);
+            return -1;
+        }
+        if (mmc_mount_partition(mmc, mount_point, 0 /* rw */) != 0) {
+            fprintf(stderr, "mmc mount of %s failed: %s\n",
+                    location, strerror(errno));
+            return -1;
+        }
+    } else {
+        if (mount(location, mount_point, type,
+                  MS_NOATIME | MS_NODEV | MS_NODIRATIME, "") < 0) {
+            fprintf(stderr, "mount: failed to mount %s at %s: %s\n",
+                    location, mount_point, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
 // mount(type, location, mount_point)
 //
 //   what:  type="MTD"   location="<partition>"            to mount a yaffs2 filesystem
@@ -67,51 +118,17 @@ Value* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
-    mkdir(mount_point, 0755);
-
-    if (strcmp(type, "MTD") == 0) {
-        mtd_scan_partitions();
-        const MtdPartition* mtd;
-        mtd = mtd_find_partition_by_name(location);
-        if (mtd == NULL) {
-            fprintf(stderr, "%s: no mtd partition named \"%s\"",
-                    name, location);
-            result = strdup("");
-            goto done;
-        }
-        if (mtd_mount_partition(mtd, mount_point, "yaffs2", 0 /* rw */) != 0) {
-            fprintf(stderr, "mtd mount of %s failed: %s\n",
-                    location, strerror(errno));
-            result = strdup("");
-            goto done;
-        }
+    // The plan may have mounted it already (see plan.h).
+    if (TakePremount(PlanOf(state), type, location, mount_point)) {
         result = mount_point;
-    } else if (strcmp(type, "MMC") == 0) {
-        mmc_scan_partitions();
-        const MmcPartition* mmc;
-        mmc = mmc_find_partition_by_name(location);
-        if (mmc == NULL) {
-            fprintf(stderr, "%s: no mmc partition named \"%s\"",
-                    name, location);
-            result = strdup("");
-            goto done;
-        }
-        if (mmc_mount_partition(mmc, mount_point, 0 /* rw */) != 0) {
-            fprintf(stderr, "mmc mount of %s failed: %s\n",
-                    location, strerror(errno));
-            result = strdup("");
-            goto done;
-        }
+        goto done;
+    }
+    WaitForPremounts(PlanOf(state));
+
+    if (MountVolume(type, location, mount_point) == 0) {
         result = mount_point;
     } else {
-        if (mount(location, mount_point, type,
-                  MS_NOATIME | MS_NODEV | MS_NODIRATIME, "") < 0) {
-            fprintf(stderr, "%s: failed to mount %s at %s: %s\n",
-                    name, location, mount_point, strerror(errno));
-            result = strdup("");
-        } else {
-            result = mount_point;
-        }
+        result = strdup("");
     }
 
 done:
@@ -137,6 +154,7 @@ Value* IsMountedFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    WaitForPremounts(PlanOf(state));
     scan_mounted_volumes();
     const MountedVolume* vol = find_mounted_volume_by_mount_point(mount_point);
     if (vol == NULL) {
@@ -165,6 +183,7 @@ Value* UnmountFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    StopPlan(PlanOf(state));
     scan_mounted_volumes();
     const MountedVolume* vol = find_mounted_volume_by_mount_point(mount_point);
     if (vol == NULL) {
@@ -204,6 +223,8 @@ Value* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    StopPlan(PlanOf(state));
+
     if (strcmp(type, "MTD") == 0) {
         mtd_scan_partitions();
         const MtdPartition* mtd = mtd_find_partition_by_name(location);
@@ -269,6 +290,7 @@ Value* DeleteFn(const char* name, State* state, int argc, Expr* argv[]) {
             return NULL;
         }
     }
+    WaitForPremounts(PlanOf(state));
 
     bool recursive = (strcmp(name, "delete_recursive") == 0);
 
@@ -300,7 +322,7 @@ Value* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     int sec = strtol(sec_str, NULL, 10);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    ChannelShowProgress(ui->channel, frac, sec);
 
     free(sec_str);
     return StringValue(frac_str);
@@ -318,7 +340,7 @@ Value* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     double frac = strtod(frac_str, NULL);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    ChannelSetProgress(ui->channel, frac);
 
     return StringValue(frac_str);
 }
@@ -332,6 +354,7 @@ Value* PackageExtractDirFn(const char* name, State* state,
     char* zip_path;
     char* dest_path;
     if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
+    WaitForPremounts(PlanOf(state));
 
     ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
 
@@ -365,6 +388,7 @@ Value* PackageExtractFileFn(const char* name, State* state,
         char* zip_path;
         char* dest_path;
         if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
+        WaitForPremounts(PlanOf(state));
 
         ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
         const ZipEntry* entry = mzFindZipEntry(za, zip_path);
@@ -398,13 +422,28 @@ Value* PackageExtractFileFn(const char* name, State* state,
 
         if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
 
-        ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+        UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+        ZipArchive* za = ui->package_zip;
         const ZipEntry* entry = mzFindZipEntry(za, zip_path);
         if (entry == NULL) {
             fprintf(stderr, "%s: no %s in package\n", name, zip_path);
             goto done1;
         }
 
+        // A stored entry is already in memory, in the package's
+        // mapping (where its pages can be dropped and read back
+        // again); lend that out rather than copying it.  That only
+        // happens once its length and CRC have checked out; otherwise
+        // it's copied like a compressed one.
+        const unsigned char* stored = mzGetStoredZipEntryData(za, entry);
+        if (stored != NULL && ui->package_source != NULL) {
+            free(zip_path);
+            free(v);
+            return BorrowedBlobValue((char*)stored,
+                                     mzGetZipEntryUncompLen(entry),
+                                     ui->package_source);
+        }
+
         v->size = mzGetZipEntryUncompLen(entry);
         v->data = malloc(v->size);
         if (v->data == NULL) {
@@ -443,6 +482,7 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
         free(target);
         return NULL;
     }
+    WaitForPremounts(PlanOf(state));
 
     int i;
     for (i = 0; i < argc-1; ++i) {
@@ -474,6 +514,7 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     char** args = ReadVarArgs(state, argc, argv);
     if (args == NULL) return NULL;
+    WaitForPremounts(PlanOf(state));
 
     char* end;
     int i;
@@ -566,6 +607,7 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (ReadArgs(state, argv, 2, &filename, &key) < 0) {
         return NULL;
     }
+    WaitForPremounts(PlanOf(state));
 
     struct stat st;
     if (stat(filename, &st) < 0) {
@@ -681,6 +723,8 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    WaitForPremounts(PlanOf(state));
+
 #ifdef BOARD_USES_BMLUTILS
     if (0 == write_raw_image(name, filename)) {
         result = partition;
@@ -799,6 +843,8 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
                  &target_sha1, &target_size_str) < 0) {
         return NULL;
     }
+    // Sources and targets may be partitions ("MTD:...").
+    WaitForPremounts(PlanOf(state));
 
     char* endptr;
     size_t target_size = strtol(target_size_str, &endptr, 10);
@@ -867,6 +913,7 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
     if (ReadArgs(state, argv, 1, &filename) < 0) {
         return NULL;
     }
+    WaitForPremounts(PlanOf(state));
 
     int patchcount = argc-1;
     char** sha1s = ReadVarArgs(state, argc-1, argv+1);
@@ -882,6 +929,70 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
 
+// apply_patch_check_batch(file_1, sha1s_1, file_2, sha1s_2, ...)
+//
+// Like calling apply_patch_check() on every file, but the files are
+// hashed concurrently.  Each sha1s_n is a colon-separated list of
+// acceptable sha1s for file_n (empty to only require that the file be
+// readable).  Returns "t" if every file passes; each file that
+// doesn't is named in the log.
+Value* ApplyPatchCheckBatchFn(const char* name, State* state,
+                              int argc, Expr* argv[]) {
+    if (argc < 2 || (argc % 2) == 1) {
+        return ErrorAbort(state, "%s(): expected a positive even number "
+                          "of args, got %d", name, argc);
+    }
+
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) {
+        return NULL;
+    }
+    WaitForPremounts(PlanOf(state));
+
+    int count = argc / 2;
+    PatchCheckItem* items = malloc(count * sizeof(PatchCheckItem));
+    int i;
+    for (i = 0; i < count; ++i) {
+        char* list = args[i*2+1];
+        int n = (*list == '\0') ? 0 : 1;
+        char* p;
+        for (p = list; *p; ++p) {
+            if (*p == ':') ++n;
+        }
+
+        items[i].filename = args[i*2];
+        items[i].num_sha1s = n;
+        items[i].sha1s = malloc((n > 0 ? n : 1) * sizeof(char*));
+        items[i].result = 1;
+
+        // split the list in place
+        int j = 0;
+        p = list;
+        while (j < n) {
+            items[i].sha1s[j++] = p;
+            p = strchr(p, ':');
+            if (p == NULL) break;
+            *p++ = '\0';
+        }
+    }
+
+    int failures = applypatch_check_batch(items, count);
+    if (failures > 0) {
+        printf("%s(): %d of %d files failed\n", name, failures, count);
+    }
+
+    for (i = 0; i < count; ++i) {
+        free(items[i].sha1s);
+    }
+    free(items);
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+
+    return StringValue(strdup(failures == 0 ? "t" : ""));
+}
+
 Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     char** args = ReadVarArgs(state, argc, argv);
     if (args == NULL) {
@@ -903,13 +1014,13 @@ Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     free(args);
     buffer[size] = '\0';
 
+    UpdateChannel* channel = ((UpdaterInfo*)(state->cookie))->channel;
     char* line = strtok(buffer, "\n");
     while (line) {
-        fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print %s\n", line);
+        ChannelPrint(channel, line);
         line = strtok(NULL, "\n");
     }
-    fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe, "ui_print\n");
+    ChannelPrint(channel, "");
 
     return StringValue(buffer);
 }
@@ -923,21 +1034,19 @@ Value* RunProgramFn(const char* name, State* state, int argc, Expr* argv[]) {
         return NULL;
     }
 
+    // There's no telling what it will do to the filesystems.
+    StopPlan(PlanOf(state));
+
     char** args2 = malloc(sizeof(char*) * (argc+1));
     memcpy(args2, args, sizeof(char*) * argc);
     args2[argc] = NULL;
 
     fprintf(stderr, "about to run program [%s] with %d args\n", args2[0], argc);
 
-    pid_t child = fork();
-    if (child == 0) {
-        execv(args2[0], args2);
-        fprintf(stderr, "run_program: execv failed: %s\n", strerror(errno));
-        _exit(1);
-    }
-    int status;
-    waitpid(child, &status, 0);
-    if (WIFEXITED(status)) {
+    int status = RunProgram(args2[0], args2);
+    if (status == -1) {
+        fprintf(stderr, "run_program: couldn't run %s\n", args2[0]);
+    } else if (WIFEXITED(status)) {
         if (WEXITSTATUS(status) != 0) {
             fprintf(stderr, "run_program: child exited with status %d\n",
                     WEXITSTATUS(status));
@@ -996,7 +1105,7 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
         return StringValue(strdup(""));
     }
     uint8_t digest[SHA_DIGEST_SIZE];
-    SHA(args[0]->data, args[0]->size, digest);
+    Sha1(args[0]->data, args[0]->size, digest);
     FreeValue(args[0]);
 
     if (argc == 1) {
@@ -1031,6 +1140,29 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
     return args[i];
 }
 
+// hash_dir(path)
+//    returns the hex sha1 of the whole tree under the directory path
+//    (names, modes, owners and contents; see hashutils/dirhash.h).
+//    Files that haven't changed since an earlier hash_dir() aren't
+//    read again.
+Value* HashDirFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+    char* path;
+    if (ReadArgs(state, argv, 1, &path) < 0) return NULL;
+    WaitForPremounts(PlanOf(state));
+
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    if (HashDir(path, digest) != 0) {
+        ErrorAbort(state, "%s() failed to hash \"%s\"", name, path);
+        free(path);
+        return NULL;
+    }
+    free(path);
+    return StringValue(PrintSha1(digest));
+}
+
 // Read a local file and return its contents (the char* returned
 // is actually a FileContents*).
 Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -1039,12 +1171,13 @@ Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
     char* filename;
     if (ReadArgs(state, argv, 1, &filename) < 0) return NULL;
+    WaitForPremounts(PlanOf(state));
 
     Value* v = malloc(sizeof(Value));
     v->type = VAL_BLOB;
 
     FileContents fc;
-    if (LoadFileContents(filename, &fc) != 0) {
+    if (LoadFileContentsCopy(filename, &fc) != 0) {
         ErrorAbort(state, "%s() loading \"%s\" failed: %s",
                    name, filename, strerror(errno));
         free(filename);
@@ -1081,10 +1214,12 @@ void RegisterInstallFunctions() {
 
     RegisterFunction("apply_patch", ApplyPatchFn);
     RegisterFunction("apply_patch_check", ApplyPatchCheckFn);
+    RegisterFunction("apply_patch_check_batch", ApplyPatchCheckBatchFn);
     RegisterFunction("apply_patch_space", ApplyPatchSpaceFn);
 
     RegisterFunction("read_file", ReadFileFn);
     RegisterFunction("sha1_check", Sha1CheckFn);
+    RegisterFunction("hash_dir", HashDirFn);
 
     RegisterFunction("ui_print", UIPrintFn);
 
@@ -19,4 +19,11 @@
 
 void RegisterInstallFunctions();
 
+// What mount() does:  mount a volume of the given type ("MTD", "MMC",
+// or a filesystem type for a block device) at mount_point, creating
+// the directory if need be.  Returns 0 on success, or -1 after
+// printing the reason.
+int MountVolume(const char* type, const char* location,
+                const char* mount_point);
+
 #endif
@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs the top-level statements of an updater-script concurrently
+// where that can't change the outcome.
+//
+// The script is cut into runs of statements that touch only the
+// paths named in their (literal) arguments; anything else is a
+// barrier.  Within a run each statement gets a level one higher than
+// that of every earlier statement whose paths overlap its own, and the
+// levels are executed in order, each level's statements in parallel.
+//
+// Paths are compared as text, which a symlink defeats:  two names for
+// one file would look independent.  So statements that can make
+// symlinks (symlink(), and package_extract_dir() of a directory with
+// symlinks in it) are barriers, and a run is only formed once those
+// before it have finished, from statements none of whose paths go
+// through a symlink that's on the device by then.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+#include "parallel.h"
+#include "plan.h"
+#include "updater.h"
+
+typedef struct {
+    const char* name;
+    int first_path;     // arguments from this one on are paths
+    int recursive;      // each path stands for everything under it too
+} PathFunction;
+
+static const PathFunction path_functions[] = {
+    { "set_perm",             3, 0 },
+    { "set_perm_recursive",   4, 1 },
+    { "package_extract_file", 1, 0 },
+    { "package_extract_dir",  1, 1 },
+    { "delete",               0, 0 },
+    { "delete_recursive",     0, 1 },
+};
+#define NUM_PATH_FUNCTIONS (sizeof(path_functions)/sizeof(path_functions[0]))
+
+// Paths are compared as text, so only accept ones where that's
+// meaningful:  absolute, and without "//", "." or "..".  Returns the
+// length without any trailing slashes, or -1.
+static int PathLength(const char* path) {
+    if (path[0] != '/') return -1;
+    const char* p;
+    for (p = path; *p; ++p) {
+        if (p[0] == '/' && (p[1] == '/' ||
+                            (p[1] == '.' && (p[2] == '\0' || p[2] == '/')) ||
+                            (p[1] == '.' && p[2] == '.' &&
+                             (p[3] == '\0' || p[3] == '/')))) {
+            // Tolerate trailing slashes, but nothing else.
+            const char* q = p;
+            while (*q == '/') ++q;
+            if (*q != '\0') return -1;
+            break;
+        }
+    }
+    int len = p - path;
+    while (len > 0 && path[len-1] == '/') --len;
+    return len > 0 ? len : -1;
+}
+
+// Returns the PathFunction for a statement that can be reordered, or
+// NULL for a barrier.
+static const PathFunction* FindPathFunction(Expr* e) {
+    if (e->fn == Literal) return NULL;
+
+    const PathFunction* pf = NULL;
+    unsigned int i;
+    for (i = 0; i < NUM_PATH_FUNCTIONS; ++i) {
+        if (strcmp(e->name, path_functions[i].name) == 0) {
+            pf = path_functions + i;
+            break;
+        }
+    }
+    if (pf == NULL) return NULL;
+
+    int j;
+    for (j = 0; j < e->argc; ++j) {
+        if (e->argv[j]->fn != Literal) return NULL;
+        if (j >= pf->first_path && PathLength(e->argv[j]->name) < 0) {
+            return NULL;
+        }
+    }
+    return pf;
+}
+
+// Whether path, or any directory on the way to it, is a symlink now.
+// Missing ones aren't; whatever creates them later is a barrier.
+static int ThroughSymlink(const char* path) {
+    int len = PathLength(path);
+    char* p = strndup(path, len);
+    int result = 0;
+    int k;
+    for (k = len; k > 0; --k) {
+        if (k < len && p[k] != '/') continue;
+        p[k] = '\0';
+        struct stat st;
+        if (lstat(p, &st) == 0 && S_ISLNK(st.st_mode)) {
+            result = 1;
+            break;
+        }
+    }
+    free(p);
+    return result;
+}
+
+// Whether package_extract_dir() of zip_path would create symlinks.
+// Matches the entries mzExtractRecursive() does.
+static int DirHasSymlinks(ZipArchive* za, const char* zip_path) {
+    size_t len = strlen(zip_path);
+    while (len > 0 && zip_path[len-1] == '/') --len;
+    unsigned int i;
+    for (i = 0; i < mzZipEntryCount(za); ++i) {
+        const ZipEntry* entry = mzGetZipEntryAt(za, i);
+        UnterminatedString name = mzGetZipEntryFileName(entry);
+        if ((len == 0 || (name.len > len && name.str[len] == '/' &&
+                          strncmp(name.str, zip_path, len) == 0)) &&
+            mzIsZipEntrySymlink(entry)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// FindPathFunction(), plus the checks against the device and the
+// package:  returns NULL for a statement that has to be a barrier
+// given what's there now.
+static const PathFunction* FindReorderable(State* state, Expr* e) {
+    const PathFunction* pf = FindPathFunction(e);
+    if (pf == NULL) return NULL;
+
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    if (strcmp(pf->name, "package_extract_dir") == 0 &&
+        DirHasSymlinks(ui->package_zip, e->argv[0]->name)) {
+        return NULL;
+    }
+    int i;
+    for (i = pf->first_path; i < e->argc; ++i) {
+        if (ThroughSymlink(e->argv[i]->name)) return NULL;
+    }
+    return pf;
+}
+
+// -----------------------------------------------------------------
+//   path -> level maps
+// -----------------------------------------------------------------
+
+typedef struct {
+    char** keys;
+    int* levels;
+    int alloc;          // power of two
+    int count;
+} LevelMap;
+
+static unsigned int HashPath(const char* s, int len) {
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int LevelSlot(char** keys, int alloc, const char* path, int len) {
+    unsigned int i = HashPath(path, len) & (alloc - 1);
+    while (keys[i] != NULL &&
+           (strncmp(keys[i], path, len) != 0 || keys[i][len] != '\0')) {
+        i = (i + 1) & (alloc - 1);
+    }
+    return i;
+}
+
+static int GetLevel(const LevelMap* m, const char* path, int len) {
+    if (m->count == 0) return 0;
+    int i = LevelSlot(m->keys, m->alloc, path, len);
+    return m->keys[i] ? m->levels[i] : 0;
+}
+
+static void RaiseLevel(LevelMap* m, const char* path, int len, int level) {
+    if ((m->count + 1) * 2 > m->alloc) {
+        int new_alloc = m->alloc ? m->alloc * 2 : 64;
+        char** keys = calloc(new_alloc, sizeof(char*));
+        int* levels = malloc(new_alloc * sizeof(int));
+        int i;
+        for (i = 0; i < m->alloc; ++i) {
+            if (m->keys[i] == NULL) continue;
+            int j = LevelSlot(keys, new_alloc, m->keys[i], strlen(m->keys[i]));
+            keys[j] = m->keys[i];
+            levels[j] = m->levels[i];
+        }
+        free(m->keys);
+        free(m->levels);
+        m->keys = keys;
+        m->levels = levels;
+        m->alloc = new_alloc;
+    }
+    int i = LevelSlot(m->keys, m->alloc, path, len);
+    if (m->keys[i] == NULL) {
+        m->keys[i] = strndup(path, len);
+        m->levels[i] = level;
+        ++m->count;
+    } else if (m->levels[i] < level) {
+        m->levels[i] = level;
+    }
+}
+
+static void FreeLevelMap(LevelMap* m) {
+    int i;
+    for (i = 0; i < m->alloc; ++i) free(m->keys[i]);
+    free(m->keys);
+    free(m->levels);
+    memset(m, 0, sizeof(*m));
+}
+
+typedef struct {
+    LevelMap exact;         // statements that name the path itself
+    LevelMap recursive;     // ... that name it recursively
+    LevelMap subtree;       // ... that name it or anything under it
+} Footprints;
+
+// Find the level at which statement e can run:  after every earlier
+// statement it overlaps with.  Then record its paths.
+static int AssignLevel(Footprints* fp, Expr* e, const PathFunction* pf) {
+    int level = 1;
+    int i, k;
+    for (i = pf->first_path; i < e->argc; ++i) {
+        const char* path = e->argv[i]->name;
+        int len = PathLength(path);
+        int l = GetLevel(&fp->exact, path, len) + 1;
+        if (l > level) level = l;
+        for (k = 1; k < len; ++k) {
+            if (path[k] != '/') continue;
+            l = GetLevel(&fp->recursive, path, k) + 1;
+            if (l > level) level = l;
+        }
+        if (pf->recursive) {
+            l = GetLevel(&fp->subtree, path, len) + 1;
+            if (l > level) level = l;
+        }
+    }
+
+    for (i = pf->first_path; i < e->argc; ++i) {
+        const char* path = e->argv[i]->name;
+        int len = PathLength(path);
+        RaiseLevel(&fp->exact, path, len, level);
+        if (pf->recursive) RaiseLevel(&fp->recursive, path, len, level);
+        RaiseLevel(&fp->subtree, path, len, level);
+        for (k = 1; k < len; ++k) {
+            if (path[k] == '/') RaiseLevel(&fp->subtree, path, k, level);
+        }
+    }
+    return level;
+}
+
+// -----------------------------------------------------------------
+//   running a level
+// -----------------------------------------------------------------
+
+typedef struct {
+    State* state;
+    Expr** exprs;
+    Value** results;
+    char** errmsgs;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} Batch;
+
+static void* BatchThread(void* cookie) {
+    Batch* b = (Batch*)cookie;
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        int i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->count) break;
+
+        State state;
+        state.cookie = b->state->cookie;
+        state.script = b->state->script;
+        state.errmsg = NULL;
+        b->results[i] = EvaluateValue(&state, b->exprs[i]);
+        b->errmsgs[i] = state.errmsg;
+    }
+    return NULL;
+}
+
+// Run every statement in exprs[], using up to 'threads' threads
+// (counting this one).
+static void RunBatch(State* state, Expr** exprs, int count, int threads,
+                     Value** results, char** errmsgs) {
+    Batch b;
+    b.state = state;
+    b.exprs = exprs;
+    b.results = results;
+    b.errmsgs = errmsgs;
+    b.count = count;
+    b.next = 0;
+    pthread_mutex_init(&b.lock, NULL);
+
+    if (threads > count) threads = count;
+    pthread_t* thread = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    int i;
+    for (i = 1; i < threads; ++i) {
+        if (pthread_create(&thread[started], NULL, BatchThread, &b) == 0) {
+            ++started;
+        }
+    }
+    BatchThread(&b);
+    for (i = 0; i < started; ++i) {
+        pthread_join(thread[i], NULL);
+    }
+    free(thread);
+    pthread_mutex_destroy(&b.lock);
+}
+
+// Run a stretch of reorderable statements.  On success returns 0 and
+// replaces *last with the value of the final statement.  On failure
+// returns -1 with the error of the first statement (in script order)
+// of the failing level in state->errmsg.
+static int RunReorderable(State* state, Expr** exprs, int count,
+                          int threads, Value** last) {
+    Footprints fp;
+    memset(&fp, 0, sizeof(fp));
+    int* levels = malloc(count * sizeof(int));
+    int max_level = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        levels[i] = AssignLevel(&fp, exprs[i], FindPathFunction(exprs[i]));
+        if (levels[i] > max_level) max_level = levels[i];
+    }
+    FreeLevelMap(&fp.exact);
+    FreeLevelMap(&fp.recursive);
+    FreeLevelMap(&fp.subtree);
+
+    fprintf(stderr, "running %d statements in %d step%s\n",
+            count, max_level, max_level == 1 ? "" : "s");
+
+    Expr** batch = malloc(count * sizeof(Expr*));
+    int* index = malloc(count * sizeof(int));
+    Value** results = malloc(count * sizeof(Value*));
+    char** errmsgs = malloc(count * sizeof(char*));
+    Value* final = NULL;
+    int status = 0;
+
+    int level;
+    for (level = 1; level <= max_level && status == 0; ++level) {
+        int n = 0;
+        for (i = 0; i < count; ++i) {
+            if (levels[i] == level) {
+                index[n] = i;
+                batch[n++] = exprs[i];
+            }
+        }
+        RunBatch(state, batch, n, threads, results, errmsgs);
+
+        for (i = 0; i < n; ++i) {
+            if (results[i] == NULL && status == 0) {
+                free(state->errmsg);
+                state->errmsg = errmsgs[i];
+                status = -1;
+            } else {
+                free(errmsgs[i]);
+            }
+            if (index[i] == count-1) {
+                final = results[i];
+            } else {
+                FreeValue(results[i]);
+            }
+        }
+    }
+
+    free(levels);
+    free(batch);
+    free(index);
+    free(results);
+    free(errmsgs);
+
+    if (status == 0) {
+        FreeValue(*last);
+        *last = final;
+    } else {
+        FreeValue(final);
+    }
+    return status;
+}
+
+char* EvaluateParallel(State* state, Expr* root, int threads) {
+    // Flatten the left-leaning chain of "a; b; c; ..." into a list of
+    // statements.
+    int n = 1;
+    Expr* p;
+    for (p = root; p->fn == SequenceFn; p = p->argv[0]) ++n;
+    Expr** statements = malloc(n * sizeof(Expr*));
+    int i;
+    for (i = n-1, p = root; p->fn == SequenceFn; p = p->argv[0], --i) {
+        statements[i] = p->argv[1];
+    }
+    statements[0] = p;
+    for (i = 0; i < n; ++i) {
+        CompileExpr(statements[i]);
+    }
+
+    // What ThroughSymlink() sees has to be the mounted filesystems.
+    WaitForPremounts(((UpdaterInfo*)(state->cookie))->plan);
+
+    Value* v = NULL;
+    int start = 0;
+    while (start < n) {
+        int end = start;
+        while (end < n && FindReorderable(state, statements[end]) != NULL) {
+            ++end;
+        }
+
+        if (end - start > 1 && threads > 1) {
+            if (RunReorderable(state, statements+start, end-start,
+                               threads, &v) < 0) {
+                break;
+            }
+            start = end;
+            continue;
+        }
+
+        // A barrier (or a lone statement):  run it by itself.
+        FreeValue(v);
+        v = EvaluateValue(state, statements[start]);
+        if (v == NULL) break;
+        ++start;
+    }
+    free(statements);
+
+    if (start < n) {
+        FreeValue(v);
+        return NULL;
+    }
+    if (v->type != VAL_STRING) {
+        ErrorAbort(state, "expecting string, got value type %d", v->type);
+        FreeValue(v);
+        return NULL;
+    }
+    char* result = v->data;
+    free(v);
+    return result;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PARALLEL_H_
+#define _UPDATER_PARALLEL_H_
+
+#include "edify/expr.h"
+
+// Evaluate a script like Evaluate(state, root), but run independent
+// top-level statements on up to 'threads' threads.
+//
+// Only calls to file functions whose arguments are all literals
+// (set_perm, set_perm_recursive, package_extract_file,
+// package_extract_dir, delete, delete_recursive) are run
+// concurrently, and only when the paths they name don't overlap and
+// don't go through a symlink on the device.  Every other statement --
+// symlink, mount, format, assert, run_program, a package_extract_dir
+// that would create symlinks, and anything else -- is a barrier that
+// runs alone, after everything before it has finished.
+//
+// state->cookie must be the updater's UpdaterInfo.
+//
+// If statements that ran together fail, the error is the one from
+// the first of them in the script; unlike Evaluate(), its neighbours
+// may already have run.
+//
+// Compiles the statements (CompileExpr()) as it goes; don't compile
+// the root first.
+char* EvaluateParallel(State* state, Expr* root, int threads);
+
+#endif
@@ -0,0 +1,547 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+#include "applypatch/applypatch.h"
+#include "install.h"
+#include "plan.h"
+
+enum {
+    PREMOUNT_NONE = 0,      // not done ahead of time
+    PREMOUNT_PENDING,
+    PREMOUNT_DONE,
+    PREMOUNT_FAILED,
+    PREMOUNT_TAKEN,         // handed to the script's mount()
+};
+
+typedef struct {
+    // These point at literals in the tree, which outlives the plan.
+    const char* type;
+    const char* location;
+    const char* mount_point;
+    int premount;
+    int mounted;            // by the plan
+    long long bytes;        // written under mount_point
+} PlannedMount;
+
+struct ScriptPlan {
+    PlannedMount* mounts;
+    int mount_count;
+    int mount_alloc;
+
+    const char** sources;   // patch sources, in script order
+    int source_count;
+    int source_alloc;
+
+    // Partitions and paths something has used, after which a mount of
+    // them (or of a directory containing or under such a path) can't
+    // be moved earlier; touched_count is -1 for all of them.
+    const char** touched;
+    int touched_count;
+    int touched_alloc;
+
+    long long other_bytes;  // written outside any mount point
+    long long cache_bytes;  // largest apply_patch_space()
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // premount state or mounts_done changed
+    pthread_t thread;
+    int started;
+    int mounts_done;
+    volatile int stop;
+};
+
+// Functions whose effects on mounts and paths the planner looks at;
+// anything else stops mounts after it from being moved.
+static const char* known_functions[] = {
+    "abort", "apply_patch", "apply_patch_check", "apply_patch_check_batch",
+    "apply_patch_space", "assert", "concat", "delete", "delete_recursive",
+    "file_getprop", "format", "getprop", "greater_than_int", "hash_dir",
+    "ifelse", "is_mounted", "is_substring", "less_than_int", "mount",
+    "package_extract_dir", "package_extract_file", "read_file",
+    "set_perm", "set_perm_recursive", "set_progress", "sha1_check",
+    "show_progress", "sleep", "stdout", "symlink", "ui_print", "unmount",
+    "write_raw_image",
+};
+#define NUM_KNOWN_FUNCTIONS \
+    (sizeof(known_functions)/sizeof(known_functions[0]))
+
+static int IsKnownFunction(const char* name) {
+    unsigned int i;
+    for (i = 0; i < NUM_KNOWN_FUNCTIONS; ++i) {
+        if (strcmp(name, known_functions[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+// Returns 1 if the first 'count' arguments of e are all literals.
+static int LiteralArgs(Expr* e, int count) {
+    if (e->argc < count) return 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (e->argv[i]->fn != Literal) return 0;
+    }
+    return 1;
+}
+
+static void* Grow(void* array, int* alloc, int count, size_t size) {
+    if (count < *alloc) return array;
+    *alloc = *alloc ? *alloc * 2 : 8;
+    return realloc(array, *alloc * size);
+}
+
+static void Touch(ScriptPlan* plan, const char* name) {
+    if (plan->touched_count < 0) return;
+    plan->touched = Grow(plan->touched, &plan->touched_alloc,
+                         plan->touched_count, sizeof(char*));
+    plan->touched[plan->touched_count++] = name;
+}
+
+static void TouchAll(ScriptPlan* plan) {
+    plan->touched_count = -1;
+}
+
+// Whether a and b are the same partition, or paths one of which
+// contains the other.
+static int Overlap(const char* a, const char* b) {
+    if (a[0] != '/' || b[0] != '/') return strcmp(a, b) == 0;
+    size_t alen = strlen(a);
+    size_t blen = strlen(b);
+    while (alen > 1 && a[alen-1] == '/') --alen;
+    while (blen > 1 && b[blen-1] == '/') --blen;
+    if (alen > blen) {
+        const char* t = a; a = b; b = t;
+        size_t l = alen; alen = blen; blen = l;
+    }
+    // a is now the shorter; b must start with it, at a component.
+    return strncmp(a, b, alen) == 0 &&
+        (alen == 1 || b[alen] == '/' || b[alen] == '\0');
+}
+
+static int Touched(const ScriptPlan* plan, const char* name) {
+    if (plan->touched_count < 0) return 1;
+    int i;
+    for (i = 0; i < plan->touched_count; ++i) {
+        if (Overlap(plan->touched[i], name)) return 1;
+    }
+    return 0;
+}
+
+// Arguments that are paths on the device.  A mount can't be moved
+// ahead of a call that would see or change the directory underneath
+// it instead of the mounted filesystem.
+typedef struct {
+    const char* name;
+    int first;          // first path argument
+    int last;           // last one, or -1 for all the rest
+    int step;
+} PathArgs;
+
+static const PathArgs path_args[] = {
+    { "apply_patch",             0,  1, 1 },
+    { "apply_patch_check",       0,  0, 1 },
+    { "apply_patch_check_batch", 0, -1, 2 },
+    { "delete",                  0, -1, 1 },
+    { "delete_recursive",        0, -1, 1 },
+    { "file_getprop",            0,  0, 1 },
+    { "hash_dir",                0,  0, 1 },
+    { "is_mounted",              0,  0, 1 },
+    { "package_extract_dir",     1,  1, 1 },
+    { "package_extract_file",    1,  1, 1 },
+    { "read_file",               0,  0, 1 },
+    { "set_perm",                3, -1, 1 },
+    { "set_perm_recursive",      4, -1, 1 },
+    { "symlink",                 1, -1, 1 },
+    { "unmount",                 0,  0, 1 },
+    { "write_raw_image",         0,  0, 1 },
+};
+#define NUM_PATH_ARGS (sizeof(path_args)/sizeof(path_args[0]))
+
+static void TouchPaths(ScriptPlan* plan, Expr* e) {
+    unsigned int k;
+    for (k = 0; k < NUM_PATH_ARGS; ++k) {
+        if (strcmp(e->name, path_args[k].name) == 0) break;
+    }
+    if (k == NUM_PATH_ARGS) return;
+    const PathArgs* pa = path_args + k;
+    int last = (pa->last < 0 || pa->last >= e->argc) ? e->argc-1 : pa->last;
+    int i;
+    for (i = pa->first; i <= last; i += pa->step) {
+        if (e->argv[i]->fn != Literal) {
+            TouchAll(plan);
+            return;
+        }
+        // Not "MTD:..." partitions, or apply_patch()'s "-".
+        if (e->argv[i]->name[0] == '/') Touch(plan, e->argv[i]->name);
+    }
+}
+
+static void AddMount(ScriptPlan* plan, Expr* e, int early) {
+    plan->mounts = Grow(plan->mounts, &plan->mount_alloc,
+                        plan->mount_count, sizeof(PlannedMount));
+    PlannedMount* m = plan->mounts + plan->mount_count++;
+    m->type = e->argv[0]->name;
+    m->location = e->argv[1]->name;
+    m->mount_point = e->argv[2]->name;
+    m->premount = early ? PREMOUNT_PENDING : PREMOUNT_NONE;
+    m->mounted = 0;
+    m->bytes = 0;
+}
+
+static void AddSource(ScriptPlan* plan, const char* filename) {
+    // Only files; not "MTD:..." partitions.
+    if (filename[0] != '/') return;
+    int i;
+    for (i = 0; i < plan->source_count; ++i) {
+        if (strcmp(plan->sources[i], filename) == 0) return;
+    }
+    plan->sources = Grow(plan->sources, &plan->source_alloc,
+                         plan->source_count, sizeof(char*));
+    plan->sources[plan->source_count++] = filename;
+}
+
+// Charge 'bytes' to the filesystem 'path' is on:  that of the longest
+// mount point seen so far that contains it.
+static void AddBytes(ScriptPlan* plan, const char* path, long long bytes) {
+    PlannedMount* best = NULL;
+    size_t best_len = 0;
+    int i;
+    for (i = 0; i < plan->mount_count; ++i) {
+        PlannedMount* m = plan->mounts + i;
+        size_t len = strlen(m->mount_point);
+        while (len > 1 && m->mount_point[len-1] == '/') --len;
+        if (len > best_len && strncmp(path, m->mount_point, len) == 0 &&
+            (path[len] == '/' || path[len] == '\0')) {
+            best = m;
+            best_len = len;
+        }
+    }
+    if (best != NULL) {
+        best->bytes += bytes;
+    } else {
+        plan->other_bytes += bytes;
+    }
+}
+
+// Bytes package_extract_dir() will extract from zip_path, which is
+// the same as mzExtractRecursive() matches.
+static long long DirBytes(ZipArchive* za, const char* zip_path) {
+    size_t len = strlen(zip_path);
+    while (len > 0 && zip_path[len-1] == '/') --len;
+    long long total = 0;
+    unsigned int i;
+    for (i = 0; i < mzZipEntryCount(za); ++i) {
+        const ZipEntry* entry = mzGetZipEntryAt(za, i);
+        UnterminatedString name = mzGetZipEntryFileName(entry);
+        if (len == 0 || (name.len > len && name.str[len] == '/' &&
+                         strncmp(name.str, zip_path, len) == 0)) {
+            total += mzGetZipEntryUncompLen(entry);
+        }
+    }
+    return total;
+}
+
+// Look at one call anywhere in a statement.
+static void PlanCall(ScriptPlan* plan, ZipArchive* za, Expr* e) {
+    if (e->fn == Literal) return;
+
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        PlanCall(plan, za, e->argv[i]);
+    }
+
+    // Operators have no name of their own, and can't do anything
+    // their arguments don't.
+    if (strcmp(e->name, "(operator)") == 0) return;
+
+    const char* name = e->name;
+    TouchPaths(plan, e);
+    if (!IsKnownFunction(name) ||
+        strcmp(name, "abort") == 0 || strcmp(name, "assert") == 0) {
+        // Either might be checking this is the right device before
+        // anything is mounted.
+        TouchAll(plan);
+    } else if (strcmp(name, "mount") == 0) {
+        // Top-level mounts were added by PlanScript(); this one is
+        // inside a condition.
+        if (e->argc == 3 && LiteralArgs(e, 3)) {
+            AddMount(plan, e, 0);
+            Touch(plan, e->argv[1]->name);
+            Touch(plan, e->argv[2]->name);
+        } else {
+            TouchAll(plan);
+        }
+    } else if (strcmp(name, "format") == 0) {
+        if (LiteralArgs(e, 2)) {
+            Touch(plan, e->argv[1]->name);
+        } else {
+            TouchAll(plan);
+        }
+    } else if (strcmp(name, "write_raw_image") == 0) {
+        if (LiteralArgs(e, 2)) {
+            Touch(plan, e->argv[1]->name);
+        } else {
+            TouchAll(plan);
+        }
+    } else if (strcmp(name, "package_extract_file") == 0) {
+        if (e->argc == 2 && LiteralArgs(e, 2)) {
+            const ZipEntry* entry = mzFindZipEntry(za, e->argv[0]->name);
+            if (entry != NULL) {
+                AddBytes(plan, e->argv[1]->name,
+                         mzGetZipEntryUncompLen(entry));
+            }
+        }
+    } else if (strcmp(name, "package_extract_dir") == 0) {
+        if (LiteralArgs(e, 2)) {
+            AddBytes(plan, e->argv[1]->name, DirBytes(za, e->argv[0]->name));
+        }
+    } else if (strcmp(name, "apply_patch") == 0) {
+        if (LiteralArgs(e, 4)) {
+            const char* source = e->argv[0]->name;
+            const char* target = e->argv[1]->name;
+            if (strcmp(target, "-") == 0) target = source;
+            AddSource(plan, source);
+            if (target[0] == '/') {
+                AddBytes(plan, target, strtoll(e->argv[3]->name, NULL, 10));
+            }
+        }
+    } else if (strcmp(name, "apply_patch_check") == 0) {
+        if (LiteralArgs(e, 1)) AddSource(plan, e->argv[0]->name);
+    } else if (strcmp(name, "apply_patch_check_batch") == 0) {
+        for (i = 0; i+1 < e->argc; i += 2) {
+            if (e->argv[i]->fn == Literal) AddSource(plan, e->argv[i]->name);
+        }
+    } else if (strcmp(name, "apply_patch_space") == 0) {
+        if (LiteralArgs(e, 1)) {
+            long long bytes = strtoll(e->argv[0]->name, NULL, 10);
+            if (bytes > plan->cache_bytes) plan->cache_bytes = bytes;
+        }
+    }
+}
+
+// Returns the mount() a top-level statement consists of (possibly
+// inside assert()), or NULL.
+static Expr* TopLevelMount(Expr* s) {
+    if (s->fn != Literal && strcmp(s->name, "assert") == 0 && s->argc == 1) {
+        s = s->argv[0];
+    }
+    if (s->fn == Literal || strcmp(s->name, "mount") != 0) return NULL;
+    if (s->argc != 3 || !LiteralArgs(s, 3)) return NULL;
+    return s;
+}
+
+ScriptPlan* PlanScript(Expr* root, ZipArchive* za) {
+    ScriptPlan* plan = calloc(1, sizeof(ScriptPlan));
+    pthread_mutex_init(&plan->lock, NULL);
+    pthread_cond_init(&plan->cond, NULL);
+
+    // Flatten the left-leaning chain of "a; b; c; ..." into a list of
+    // statements.
+    int n = 1;
+    Expr* p;
+    for (p = root; p->fn == SequenceFn; p = p->argv[0]) ++n;
+    Expr** statements = malloc(n * sizeof(Expr*));
+    int i;
+    for (i = n-1, p = root; p->fn == SequenceFn; p = p->argv[0], --i) {
+        statements[i] = p->argv[1];
+    }
+    statements[0] = p;
+
+    int early = 0;
+    for (i = 0; i < n; ++i) {
+        Expr* m = TopLevelMount(statements[i]);
+        if (m != NULL) {
+            int e = !Touched(plan, m->argv[1]->name) &&
+                    !Touched(plan, m->argv[2]->name);
+            AddMount(plan, m, e);
+            if (e) ++early;
+            // Whether or not this one moves, a later mount of the
+            // same thing mustn't; nor may any mount move ahead of an
+            // assert() that could stop the script.
+            Touch(plan, m->argv[1]->name);
+            Touch(plan, m->argv[2]->name);
+            if (m != statements[i]) TouchAll(plan);
+            continue;
+        }
+        PlanCall(plan, za, statements[i]);
+    }
+    free(statements);
+
+    fprintf(stderr, "plan: %d mount(s), %d ahead of time; "
+            "%d patch source(s)\n",
+            plan->mount_count, early, plan->source_count);
+    for (i = 0; i < plan->mount_count; ++i) {
+        if (plan->mounts[i].bytes > 0) {
+            fprintf(stderr, "plan: up to %lld bytes to write to %s\n",
+                    plan->mounts[i].bytes, plan->mounts[i].mount_point);
+        }
+    }
+    if (plan->other_bytes > 0) {
+        fprintf(stderr, "plan: up to %lld bytes to write elsewhere\n",
+                plan->other_bytes);
+    }
+    return plan;
+}
+
+// -----------------------------------------------------------------
+//   the plan's thread
+// -----------------------------------------------------------------
+
+static void CheckSpace(const char* path, long long bytes) {
+    size_t free_space = FreeSpaceForFile(path);
+    if (free_space == (size_t)-1) return;
+    if (bytes > (long long)free_space) {
+        fprintf(stderr, "plan: %s has %lld bytes free; the script may "
+                "write up to %lld there\n",
+                path, (long long)free_space, bytes);
+    }
+}
+
+// Read a file into the page cache.  Returns the bytes read.
+static long long Prefetch(ScriptPlan* plan, const char* filename,
+                          long long limit) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+    char buffer[65536];
+    long long total = 0;
+    while (total < limit && !plan->stop) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        total += n;
+    }
+    close(fd);
+    return total;
+}
+
+static void* PlanThread(void* cookie) {
+    ScriptPlan* plan = (ScriptPlan*)cookie;
+
+    int i;
+    for (i = 0; i < plan->mount_count; ++i) {
+        PlannedMount* m = plan->mounts + i;
+        if (m->premount != PREMOUNT_PENDING) continue;
+        int status = MountVolume(m->type, m->location, m->mount_point);
+        if (status != 0) {
+            fprintf(stderr, "plan: mounting %s early failed; the script "
+                    "will try again\n", m->mount_point);
+        }
+        m->mounted = (status == 0);
+        pthread_mutex_lock(&plan->lock);
+        m->premount = (status == 0) ? PREMOUNT_DONE : PREMOUNT_FAILED;
+        pthread_cond_broadcast(&plan->cond);
+        pthread_mutex_unlock(&plan->lock);
+    }
+    pthread_mutex_lock(&plan->lock);
+    plan->mounts_done = 1;
+    pthread_cond_broadcast(&plan->cond);
+    pthread_mutex_unlock(&plan->lock);
+
+    for (i = 0; i < plan->mount_count; ++i) {
+        PlannedMount* m = plan->mounts + i;
+        if (m->mounted && m->bytes > 0) {
+            CheckSpace(m->mount_point, m->bytes);
+        }
+    }
+    if (plan->cache_bytes > 0) {
+        CheckSpace("/cache", plan->cache_bytes);
+    }
+
+    long long total = 0;
+    for (i = 0; i < plan->source_count && !plan->stop; ++i) {
+        total += Prefetch(plan, plan->sources[i], PLAN_PREFETCH_LIMIT - total);
+        if (total >= PLAN_PREFETCH_LIMIT) break;
+    }
+    if (total > 0) {
+        fprintf(stderr, "plan: read ahead %lld bytes of patch sources\n",
+                total);
+    }
+    return NULL;
+}
+
+void StartPlan(ScriptPlan* plan) {
+    if (pthread_create(&plan->thread, NULL, PlanThread, plan) != 0) {
+        fprintf(stderr, "plan: can't start thread; not mounting early\n");
+        int i;
+        for (i = 0; i < plan->mount_count; ++i) {
+            plan->mounts[i].premount = PREMOUNT_NONE;
+        }
+        plan->mounts_done = 1;
+        return;
+    }
+    plan->started = 1;
+}
+
+int TakePremount(ScriptPlan* plan, const char* type,
+                 const char* location, const char* mount_point) {
+    if (plan == NULL) return 0;
+    int result = 0;
+    pthread_mutex_lock(&plan->lock);
+    int i;
+    for (i = 0; i < plan->mount_count; ++i) {
+        PlannedMount* m = plan->mounts + i;
+        if (m->premount == PREMOUNT_NONE || m->premount == PREMOUNT_TAKEN ||
+            strcmp(m->mount_point, mount_point) != 0 ||
+            strcmp(m->location, location) != 0 ||
+            strcmp(m->type, type) != 0) {
+            continue;
+        }
+        while (m->premount == PREMOUNT_PENDING) {
+            pthread_cond_wait(&plan->cond, &plan->lock);
+        }
+        result = (m->premount == PREMOUNT_DONE);
+        m->premount = PREMOUNT_TAKEN;
+        break;
+    }
+    pthread_mutex_unlock(&plan->lock);
+    return result;
+}
+
+void WaitForPremounts(ScriptPlan* plan) {
+    if (plan == NULL) return;
+    pthread_mutex_lock(&plan->lock);
+    while (!plan->mounts_done) {
+        pthread_cond_wait(&plan->cond, &plan->lock);
+    }
+    pthread_mutex_unlock(&plan->lock);
+}
+
+void StopPlan(ScriptPlan* plan) {
+    if (plan == NULL || !plan->started) return;
+    plan->stop = 1;
+    pthread_join(plan->thread, NULL);
+    plan->started = 0;
+}
+
+void FreeScriptPlan(ScriptPlan* plan) {
+    if (plan == NULL) return;
+    StopPlan(plan);
+    pthread_mutex_destroy(&plan->lock);
+    pthread_cond_destroy(&plan->cond);
+    free(plan->mounts);
+    free(plan->sources);
+    free(plan->touched);
+    free(plan);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PLAN_H_
+#define _UPDATER_PLAN_H_
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+
+// A look over the script before it runs, to report what it will need
+// and to start the slow parts early.
+//
+// PlanScript() walks the tree once.  From calls whose arguments are
+// all literals it collects:
+//
+//   - the mount() calls, and which of them can be done ahead of time:
+//     top-level ones (or ones directly inside assert()) with nothing
+//     before them that could notice or change the difference.  That
+//     rules out coming after any assert() or abort() (which may be
+//     checking the device), run_program(), a function the planner
+//     doesn't know, a format() or mount() of the same partition, or a
+//     call with a path argument that is the mount point, is under it,
+//     or contains it -- or isn't a literal;
+//
+//   - the bytes package_extract_file(), package_extract_dir() and
+//     apply_patch() will write under each mount point, and the
+//     largest apply_patch_space().  It's an upper bound: conditional
+//     calls are counted, and files being replaced free their space;
+//
+//   - the source files apply_patch() and apply_patch_check() will read.
+//
+// StartPlan() then, on a thread of its own, does those mounts in
+// script order, logs each filesystem's free space against what's
+// going to be written to it, and reads the patch sources so they're
+// in the page cache by the time the script hashes them.
+
+typedef struct ScriptPlan ScriptPlan;
+
+// Bytes of patch sources to read ahead, at most.
+#define PLAN_PREFETCH_LIMIT (64 << 20)
+
+ScriptPlan* PlanScript(Expr* root, ZipArchive* za);
+void StartPlan(ScriptPlan* plan);
+
+// For mount():  if the plan mounted exactly this (type, location,
+// mount_point), wait for that and return 1 if it succeeded.  Returns
+// 0 if the caller should mount it itself.  Each plan mount is only
+// handed out once.
+int TakePremount(ScriptPlan* plan, const char* type,
+                 const char* location, const char* mount_point);
+
+// Wait until the plan has finished mounting.  Functions that scan
+// partitions or the mount table call this first, since the mtdutils,
+// mmcutils and mounts tables aren't safe to share between threads; so
+// do functions that take paths, so what they see never depends on how
+// far the plan has got.
+void WaitForPremounts(ScriptPlan* plan);
+
+// Stop reading ahead and wait for the plan's thread, before anything
+// that may need filesystems to be idle (unmount(), format(),
+// run_program()).
+void StopPlan(ScriptPlan* plan);
+
+void FreeScriptPlan(ScriptPlan* plan);
+
+#endif
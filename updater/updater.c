@@ -17,11 +17,18 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "edify/expr.h"
 #include "updater.h"
 #include "install.h"
+#include "parallel.h"
 #include "minzip/Zip.h"
+#include "mincrypt/sha.h"
+#include "hashutils/sha1.h"
+#include "traceutils/trace.h"
+#include "spawnutils/spawn.h"
+#include "applypatch/applypatch.h"
 
 // Generated by the makefile, this function defines the
 // RegisterDeviceExtensions() function, which calls all the
@@ -32,6 +39,54 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// An optional precompiled image of the script (made with "edify -c"),
+// which lets us skip parsing it.
+#define SCRIPT_IMAGE_NAME "META-INF/com/google/android/updater-script.img"
+
+// Blobs that package_extract_file() lends out of the package's
+// mapping hold references to this, so the archive is only closed once
+// the last of them has been freed.
+typedef struct {
+    BlobSource source;
+    ZipArchive* za;
+} PackageSource;
+
+static void ClosePackage(BlobSource* source) {
+    mzCloseZipArchive(((PackageSource*)source)->za);
+}
+
+// Load the script's image, if the package has one and it was made
+// from this script.  A stored (uncompressed) image is used in place
+// in the package's mapping; a compressed one is inflated into memory
+// that the tree then keeps.
+static Expr* LoadPrecompiledScript(ZipArchive* za, const uint8_t* digest,
+                                   size_t script_len) {
+    const ZipEntry* entry = mzFindZipEntry(za, SCRIPT_IMAGE_NAME);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    long size = mzGetZipEntryUncompLen(entry);
+    const unsigned char* data = mzGetStoredZipEntryData(za, entry);
+    char* copy = NULL;
+    if (data == NULL) {
+        copy = malloc(size);
+        if (copy == NULL || !mzReadZipEntry(za, entry, copy, size)) {
+            fprintf(stderr, "failed to read %s\n", SCRIPT_IMAGE_NAME);
+            free(copy);
+            return NULL;
+        }
+        data = (const unsigned char*)copy;
+    }
+
+    Expr* root = LoadScriptImage(data, size, digest, script_len);
+    if (root == NULL) {
+        fprintf(stderr, "not using %s\n", SCRIPT_IMAGE_NAME);
+        free(copy);
+    }
+    return root;
+}
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random.  The log file makes more sense if buffering is
@@ -57,8 +112,7 @@ int main(int argc, char** argv) {
     // Set up the pipe for sending commands back to the parent process.
 
     int fd = atoi(argv[2]);
-    FILE* cmd_pipe = fdopen(fd, "wb");
-    setlinebuf(cmd_pipe);
+    UpdateChannel* channel = OpenUpdateChannel(fd);
 
     // Extract the script from the package.
 
@@ -92,22 +146,47 @@ int main(int argc, char** argv) {
     RegisterDeviceExtensions();
     FinishRegistration();
 
-    // Parse the script.
+    uint8_t digest[SHA_DIGEST_SIZE];
+    Sha1(script, script_entry->uncompLen, digest);
+
+    // Load the precompiled script if there is one; otherwise parse
+    // the script.
 
-    Expr* root;
-    int error_count = 0;
-    yy_scan_string(script);
-    int error = yyparse(&root, &error_count);
-    if (error != 0 || error_count > 0) {
-        fprintf(stderr, "%d parse errors\n", error_count);
-        return 6;
+    Expr* root = LoadPrecompiledScript(&za, digest, script_entry->uncompLen);
+    if (root == NULL) {
+        int error_count = 0;
+        yy_scan_string(script);
+        int error = yyparse(&root, &error_count);
+        if (error != 0 || error_count > 0) {
+            fprintf(stderr, "%d parse errors\n", error_count);
+            return 6;
+        }
+    }
+
+    // Pick up the patch journal if this same package was interrupted
+    // partway through.  The script names every target file and its
+    // sha1, so its hash identifies the package's work.
+
+    char package_id[SHA_DIGEST_SIZE*2+1];
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        sprintf(package_id+i*2, "%02x", digest[i]);
     }
+    OpenPatchJournal(CACHE_PATCH_JOURNAL, package_id);
 
     // Evaluate the parsed script.
 
+    PackageSource package_source;
+    package_source.source.refcount = 1;
+    package_source.source.release = ClosePackage;
+    package_source.za = &za;
+
     UpdaterInfo updater_info;
-    updater_info.cmd_pipe = cmd_pipe;
+    updater_info.cmd_pipe = channel->cmd_pipe;
+    updater_info.channel = channel;
     updater_info.package_zip = &za;
+    updater_info.package_source = &package_source.source;
+    updater_info.plan = NULL;
     updater_info.version = atoi(version);
 
     State state;
@@ -115,28 +194,66 @@ int main(int argc, char** argv) {
     state.script = script;
     state.errmsg = NULL;
 
-    char* result = Evaluate(&state, root);
+    // Setting UPDATER_THREADS to more than 1 opts in to running
+    // independent file operations concurrently (see parallel.h).
+    const char* threads_env = getenv("UPDATER_THREADS");
+    int threads = (threads_env != NULL) ? atoi(threads_env) : 0;
+
+    // Look the script over for the space it needs, and start its
+    // mounts and the reading of its patch sources now (see plan.h).
+    // Setting UPDATER_PLAN to 0 turns that off.
+    const char* plan_env = getenv("UPDATER_PLAN");
+    if (plan_env == NULL || strcmp(plan_env, "0") != 0) {
+        updater_info.plan = PlanScript(root, &za);
+        StartPlan(updater_info.plan);
+    }
+
+    // Setting UPDATER_TRACE to a file name records every function call
+    // (see traceutils/trace.h).
+    TraceStartFromEnv();
+
+    char* result;
+    if (threads > 1) {
+        fprintf(stderr, "evaluating with up to %d threads\n", threads);
+        result = EvaluateParallel(&state, root, threads);
+    } else {
+        // Compile the operators to bytecode.  It costs about one walk
+        // of the tree, but the statement chain then runs in a loop
+        // instead of one level of C recursion per statement, and the
+        // operators stop allocating.
+        CompileExpr(root);
+        result = Evaluate(&state, root);
+    }
+    TraceFinish(TRACE_SUMMARY_TOP);
+    FreeScriptPlan(updater_info.plan);
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
-            fprintf(cmd_pipe, "ui_print script aborted (no error message)\n");
+            ChannelPrint(channel, "script aborted (no error message)");
         } else {
             fprintf(stderr, "script aborted: %s\n", state.errmsg);
             char* line = strtok(state.errmsg, "\n");
             while (line) {
-                fprintf(cmd_pipe, "ui_print %s\n", line);
+                ChannelPrint(channel, line);
                 line = strtok(NULL, "\n");
             }
-            fprintf(cmd_pipe, "ui_print\n");
+            ChannelPrint(channel, "");
         }
         free(state.errmsg);
+        StopCoprocess();
+        ClosePatchJournal(0);
+        CloseUpdateChannel(channel);
         return 7;
     } else {
         fprintf(stderr, "script result was [%s]\n", result);
         free(result);
     }
 
-    mzCloseZipArchive(&za);
+    StopCoprocess();
+    ClosePatchJournal(1);
+    CloseUpdateChannel(channel);
+
+    ReleaseBlobSource(&package_source.source);
     free(script);
 
     return 0;
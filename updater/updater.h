@@ -19,10 +19,16 @@
 
 #include <stdio.h>
 #include "minzip/Zip.h"
+#include "edify/expr.h"
+#include "channel.h"
+#include "plan.h"
 
 typedef struct {
-    FILE* cmd_pipe;
+    FILE* cmd_pipe;             // channel->cmd_pipe
+    UpdateChannel* channel;
     ZipArchive* package_zip;
+    BlobSource* package_source; // owns package_zip's mapping; may be NULL
+    ScriptPlan* plan;           // see plan.h; may be NULL
     int version;
 } UpdaterInfo;
 
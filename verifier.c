@@ -19,6 +19,7 @@
 
 #include "mincrypt/rsa.h"
 #include "mincrypt/sha.h"
+#include "hashutils/sha1.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -136,8 +137,8 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
 
 #define BUFFER_SIZE 4096
 
-    SHA_CTX ctx;
-    SHA_init(&ctx);
+    Sha1Ctx ctx;
+    Sha1Init(&ctx);
     unsigned char* buffer = malloc(BUFFER_SIZE);
     if (buffer == NULL) {
         LOGE("failed to alloc memory for sha1 buffer\n");
@@ -156,7 +157,7 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
             fclose(f);
             return VERIFY_FAILURE;
         }
-        SHA_update(&ctx, buffer, size);
+        Sha1Update(&ctx, buffer, size);
         so_far += size;
         double f = so_far / (double)signed_len;
         if (f > frac + 0.02 || size == so_far) {
@@ -167,7 +168,7 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     fclose(f);
     free(buffer);
 
-    const uint8_t* sha1 = SHA_final(&ctx);
+    const uint8_t* sha1 = Sha1Final(&ctx);
     for (i = 0; i < numKeys; ++i) {
         // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
         // the signing tool appends after the signature itself.